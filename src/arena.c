@@ -0,0 +1,77 @@
+#include <stdalign.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+size_t arena_size(size_t count, size_t size)
+{
+  return (count * size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+size_t arena_string_size(const char *string)
+{
+  return string ? arena_size(strlen(string) + 1, 1) : 0;
+}
+
+int arena_init(struct arena *arena, size_t size)
+{
+  *arena = (struct arena) {0};
+  if (size == 0) return 0;
+
+  // Populate up front so the control loop never takes a page fault on
+  // its own state
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (base == MAP_FAILED) {
+    perror("Failed to map arena");
+    return -1;
+  }
+
+  arena->base = base;
+  arena->size = size;
+
+  return 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t count, size_t size)
+{
+  if (count == 0) return NULL;
+
+  size_t bytes = arena_size(count, size);
+  if (bytes > arena->size - arena->used) {
+    (void)fprintf(stderr, "Arena exhausted: %zu of %zu bytes used, %zu requested\n",
+                  arena->used, arena->size, bytes);
+    return NULL;
+  }
+
+  // Anonymous mappings are zero filled and the arena is never reused
+  void *ptr = arena->base + arena->used;
+  arena->used += bytes;
+
+  return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *string)
+{
+  if (string == NULL) return NULL;
+
+  size_t len = strlen(string) + 1;
+  char *copy = arena_alloc(arena, len, 1);
+  if (copy) {
+    memcpy(copy, string, len);
+  }
+
+  return copy;
+}
+
+void arena_free(struct arena *arena)
+{
+  if (arena->base && munmap(arena->base, arena->size) == -1) {
+    perror("munmap");
+  }
+  *arena = (struct arena) {0};
+}
@@ -0,0 +1,20 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena {
+  unsigned char *base;
+  size_t size;
+  size_t used;
+};
+
+size_t arena_size(size_t count, size_t size);
+size_t arena_string_size(const char *string);
+
+int arena_init(struct arena *arena, size_t size);
+void *arena_alloc(struct arena *arena, size_t count, size_t size);
+char *arena_strdup(struct arena *arena, const char *string);
+void arena_free(struct arena *arena);
+
+#endif
@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "autotune.h"
+#include "arena.h"
+#include "config.h"
+#include "control.h"
+#include "log.h"
+#include "loop.h"
+
+#define NS_PER_SEC 1000000000L
+
+#define DEFAULT_STATE_DIRECTORY "/var/lib/cfans"
+#define MODEL_FILE "models"
+
+// Length of the windows over which the slope is measured around a step
+#define WINDOW_SECONDS 10.0
+// Half the weight of a step is gone after about seventy more
+#define FORGETTING 0.99
+// Longer gaps between ticks, such as suspend, start the trend afresh
+#define MAX_GAP_SECONDS 30.0
+
+#define MIN_SAMPLES 20
+#define UPDATE_SECONDS 60
+#define SAVE_SECONDS 900
+#define NOISE_SIGMAS 3.0
+#define NOISE_WEIGHT 0.001
+
+static bool uses_autotune(const struct config *config)
+{
+  for (int i = 0; i < config->num_curves; i++) {
+    if (config->curve[i].autotune) return true;
+  }
+
+  return false;
+}
+
+static double elapsed_seconds(const struct timespec *from, const struct timespec *to)
+{
+  return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / NS_PER_SEC;
+}
+
+static void line_add(struct line_fit *fit, double time, double value)
+{
+  fit->weight += 1.0;
+  fit->time += time;
+  fit->time_sq += time * time;
+  fit->value += value;
+  fit->product += time * value;
+}
+
+// Moves the readings back in time by dt, so the next one goes in at zero,
+// and fades them
+static void line_age(struct line_fit *fit, double dt, double decay)
+{
+  fit->time_sq = (fit->time_sq - (2.0 * dt * fit->time) + (dt * dt * fit->weight)) * decay;
+  fit->product = (fit->product - (dt * fit->value)) * decay;
+  fit->time = (fit->time - (dt * fit->weight)) * decay;
+  fit->weight *= decay;
+  fit->value *= decay;
+}
+
+static bool line_slope(const struct line_fit *fit, double *slope)
+{
+  double denominator = (fit->weight * fit->time_sq) - (fit->time * fit->time);
+  if (fit->weight < 2.0 || denominator <= 0) return false;
+
+  *slope = ((fit->weight * fit->product) - (fit->time * fit->value)) / denominator;
+  return true;
+}
+
+static void reset_model(struct curve_model *model)
+{
+  model->step_sq = 0;
+  model->step_change = 0;
+  model->slope_sq = 0;
+  model->slope_product = 0;
+  model->noise = 0;
+  model->samples = 0;
+}
+
+static void learn(struct curve_model *model, int window, double slope)
+{
+  if (window == 0) {
+    double change = slope - model->slope_before;
+    model->step_sq = (model->step_sq * FORGETTING) + (model->step * model->step);
+    model->step_change = (model->step_change * FORGETTING) + (model->step * change);
+    model->slope_after = slope;
+    model->samples++;
+  }
+  else {
+    model->slope_sq = (model->slope_sq * FORGETTING) + (model->slope_after * model->slope_after);
+    model->slope_product = (model->slope_product * FORGETTING) + (model->slope_after * slope);
+  }
+}
+
+// Feeds one tick's reading, taken before the fans were written, and fan
+// percent to the model. Constant time, and the tick interval may vary.
+static void observe(struct curve_model *model, float input, float percent, const struct timespec *clock)
+{
+  double dt = elapsed_seconds(&model->last_clock, clock);
+  if (!model->primed || dt <= 0 || dt > MAX_GAP_SECONDS) {
+    model->primed = true;
+    model->trend = (struct line_fit) {0};
+    model->window_index = -1;
+    model->last_step = *clock;
+  }
+  else {
+    double difference = input - model->last_input;
+    double weight = model->noise > 0 ? NOISE_WEIGHT : 1.0;
+    model->noise += ((difference * difference / 2.0) - model->noise) * weight;
+
+    line_age(&model->trend, dt, exp(-dt / WINDOW_SECONDS));
+  }
+  line_add(&model->trend, 0, input);
+
+  if (model->window_index >= 0) {
+    double since = elapsed_seconds(&model->last_step, clock) - (model->window_index * WINDOW_SECONDS);
+    double slope;
+    if (since > WINDOW_SECONDS) {
+      if (!line_slope(&model->window, &slope)) {
+        model->window_index = -1;
+      }
+      else {
+        learn(model, model->window_index, slope);
+        model->window_index = model->window_index == 0 ? 1 : -1;
+        since -= WINDOW_SECONDS;
+      }
+      model->window = (struct line_fit) {0};
+    }
+    if (model->window_index >= 0) {
+      line_add(&model->window, since, input);
+    }
+  }
+
+  // A step only counts when the trend before it is long enough to measure,
+  // and cuts short the windows of the one before
+  if (percent != model->last_percent) {
+    bool settled = elapsed_seconds(&model->last_step, clock) >= WINDOW_SECONDS &&
+                   line_slope(&model->trend, &model->slope_before);
+
+    model->step = percent - model->last_percent;
+    model->window_index = settled ? 0 : -1;
+    model->window = (struct line_fit) {0};
+    model->trend = (struct line_fit) {0};
+    model->last_step = *clock;
+  }
+
+  model->last_input = input;
+  model->last_percent = percent;
+  model->last_clock = *clock;
+}
+
+// Degrees per second per percent, negative when the fans cool
+static double cooling_rate(const struct curve_model *model)
+{
+  return model->step_change / model->step_sq;
+}
+
+// Zero when the slope does not decay from one window to the next
+static double time_constant(const struct curve_model *model)
+{
+  double ratio = model->slope_sq > 0 ? model->slope_product / model->slope_sq : 0;
+  return ratio > 0 && ratio < 1 ? -WINDOW_SECONDS / log(ratio) : 0;
+}
+
+// Splits the overshoot allowed between the hysteresis band, which saves
+// the fan steps of slow drifts and must at least cover the sensor noise,
+// and the response time, which saves those of short bursts. The response
+// time is as long as the temperature can move at its fastest rate without
+// using up the rest. The fastest rate is what the full fan range can cool
+// by, and the response time is kept under one time constant. Returns false
+// until the fit is trustworthy.
+static bool suggest(struct curve_model *model)
+{
+  // More airflow has to cool
+  if (model->samples < MIN_SAMPLES || model->step_sq <= 0 || cooling_rate(model) >= 0) return false;
+
+  double max_rate = -cooling_rate(model) * 100.0;
+  double hysteresis = fmin(fmax(NOISE_SIGMAS * sqrt(model->noise), model->overshoot / 2.0), model->overshoot);
+  double response_time = (model->overshoot - hysteresis) / max_rate;
+
+  double tau = time_constant(model);
+  if (tau > 0) {
+    response_time = fmin(response_time, tau);
+  }
+
+  model->hysteresis = (float)hysteresis;
+  // settle_curve() counts whole seconds
+  model->response_time = (float)floor(response_time);
+
+  return true;
+}
+
+static void apply_model(struct app_context *app_context, int index)
+{
+  struct curve_state *curve = &app_context->curve;
+  const struct curve_model *model = &app_context->autotune->model[index];
+
+  if (fabsf(curve->hysteresis[index] - model->hysteresis) < 0.05F &&
+      curve->response_time[index] == model->response_time)
+  {
+    return;
+  }
+
+  curve->hysteresis[index] = model->hysteresis;
+  curve->response_time[index] = model->response_time;
+
+  log_entity(&curve->log[index], LOG_NOTICE, LOG_CURVE, curve->name[index], 0,
+             "Curve %s: autotune set hysteresis %.2fC and response time %.0fs",
+             curve->name[index], model->hysteresis, model->response_time);
+}
+
+static int find_curve(const struct app_context *app_context, const char *name)
+{
+  for (int c = 0; c < app_context->num_curves; c++) {
+    if (app_context->autotune->model[c].enabled && strcmp(app_context->curve.name[c], name) == 0) {
+      return c;
+    }
+  }
+
+  return -1;
+}
+
+// Models of curves that are gone or no longer tuned are dropped on the
+// next save
+static void load_models(struct app_context *app_context)
+{
+  struct autotune *autotune = app_context->autotune;
+
+  FILE *file = fopen(autotune->path, "re");
+  if (!file) {
+    if (errno != ENOENT) {
+      (void)fprintf(stderr, "Failed to read thermal models from %s: %s\n", autotune->path, strerror(errno));
+    }
+    return;
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, file)) > 0) {
+    if (line[len - 1] == '\n') {
+      line[len - 1] = '\0';
+    }
+
+    struct curve_model loaded = {0};
+    int name_offset = -1;
+    (void)sscanf(line, "%lf %lf %lf %lf %lf %lu %n", &loaded.step_sq, &loaded.step_change,
+                 &loaded.slope_sq, &loaded.slope_product, &loaded.noise, &loaded.samples, &name_offset);
+    if (name_offset < 0) continue;
+
+    int c = find_curve(app_context, line + name_offset);
+    if (c < 0) continue;
+
+    struct curve_model *model = &autotune->model[c];
+    model->step_sq = loaded.step_sq;
+    model->step_change = loaded.step_change;
+    model->slope_sq = loaded.slope_sq;
+    model->slope_product = loaded.slope_product;
+    model->noise = loaded.noise;
+    model->samples = loaded.samples;
+  }
+
+  free(line);
+  (void)fclose(file);
+}
+
+static int model_path(const struct config *config, char *path, size_t size)
+{
+  const char *directory = config->state_directory;
+  int len = -1;
+
+  // systemd passes every StateDirectory= entry, separated by colons
+  if (!directory && (directory = getenv("STATE_DIRECTORY")) != NULL) {
+    const char *colon = strchr(directory, ':');
+    len = colon ? (int)(colon - directory) : -1;
+  }
+  if (!directory) {
+    directory = DEFAULT_STATE_DIRECTORY;
+  }
+
+  int written = len < 0 ? snprintf(path, size, "%s/%s", directory, MODEL_FILE)
+                        : snprintf(path, size, "%.*s/%s", len, directory, MODEL_FILE);
+  if (written >= (int)size) {
+    (void)fprintf(stderr, "Path truncated: %s\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Saved now and then so a crash loses little of what was learnt. The
+// timer is handled by the event loop after the tick's writes, so the file
+// I/O never delays them.
+static void handle_save(void *userdata, short revents)
+{
+  const struct app_context *app_context = userdata;
+  (void)revents;
+
+  uint64_t expirations;
+  if (read(app_context->autotune->timer_fildes, &expirations, sizeof(expirations)) < 0) {
+    if (errno != EAGAIN) {
+      perror("read");
+    }
+    return;
+  }
+
+  (void)autotune_save(app_context);
+}
+
+int autotune_init(const struct config *config, struct app_context *app_context, struct event_loop *loop)
+{
+  if (!uses_autotune(config)) return 0;
+
+  struct arena *arena = &app_context->arena;
+
+  struct autotune *autotune = arena_alloc(arena, 1, sizeof(*autotune));
+  if (!autotune) return -1;
+
+  autotune->model = arena_alloc(arena, config->num_curves, sizeof(*autotune->model));
+  char *path = arena_alloc(arena, PATH_MAX, 1);
+  if (!autotune->model || !path) return -1;
+
+  autotune->timer_fildes = -1;
+  app_context->autotune = autotune;
+
+  if (model_path(config, path, PATH_MAX) < 0) return -1;
+  autotune->path = path;
+
+  for (int c = 0; c < config->num_curves; c++) {
+    const struct curve_config *curve = &config->curve[c];
+    struct curve_model *model = &autotune->model[c];
+    if (!curve->autotune) continue;
+
+    model->enabled = true;
+    model->apply = strcmp(curve->autotune, "apply") == 0;
+    model->overshoot = curve->overshoot;
+    reset_model(model);
+  }
+
+  load_models(app_context);
+
+  // A model kept from the last run is good to use straight away
+  for (int c = 0; c < config->num_curves; c++) {
+    struct curve_model *model = &autotune->model[c];
+    if (model->enabled && suggest(model) && model->apply) {
+      apply_model(app_context, c);
+    }
+  }
+
+  autotune->timer_fildes = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (autotune->timer_fildes < 0) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  struct itimerspec timer = {
+    .it_value = { .tv_sec = SAVE_SECONDS },
+    .it_interval = { .tv_sec = SAVE_SECONDS }
+  };
+  if (timerfd_settime(autotune->timer_fildes, 0, &timer, NULL) == -1) {
+    perror("timerfd_settime");
+    return -1;
+  }
+
+  return loop_add(loop, autotune->timer_fildes, POLLIN, handle_save, app_context);
+}
+
+void autotune_destroy(struct app_context *app_context)
+{
+  struct autotune *autotune = app_context->autotune;
+  if (!autotune) return;
+
+  if (autotune->timer_fildes >= 0 && close(autotune->timer_fildes) == -1) {
+    perror("close");
+  }
+  autotune->timer_fildes = -1;
+}
+
+// Runs after the writes of every tick in which the fans are under our
+// control. Only curves that read a good value this tick feed their model.
+void autotune_update(struct app_context *app_context)
+{
+  struct autotune *autotune = app_context->autotune;
+  if (!autotune) return;
+
+  const struct curve_state *curve = &app_context->curve;
+  const struct timespec *clock = &app_context->clock;
+
+  for (int c = 0; c < app_context->num_curves; c++) {
+    struct curve_model *model = &autotune->model[c];
+    if (!model->enabled) continue;
+
+    if (curve->tick[c] != app_context->tick || curve->failures[c] > 0 || curve->failsafe[c]) {
+      model->primed = false;
+      continue;
+    }
+    observe(model, curve->input[c], curve->fan_percent[c], clock);
+  }
+
+  if (autotune->updated.tv_sec == 0) {
+    autotune->updated = *clock;
+  }
+
+  if (elapsed_seconds(&autotune->updated, clock) >= UPDATE_SECONDS) {
+    autotune->updated = *clock;
+
+    for (int c = 0; c < app_context->num_curves; c++) {
+      struct curve_model *model = &autotune->model[c];
+      if (model->enabled && suggest(model) && model->apply) {
+        apply_model(app_context, c);
+      }
+    }
+  }
+}
+
+int autotune_save(const struct app_context *app_context)
+{
+  const struct autotune *autotune = app_context->autotune;
+  if (!autotune) return 0;
+
+  char temp_path[PATH_MAX];
+  if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", autotune->path) >= (int)sizeof(temp_path)) {
+    (void)fprintf(stderr, "Path truncated: %s\n", temp_path);
+    return -1;
+  }
+
+  FILE *file = fopen(temp_path, "we");
+  if (!file) {
+    (void)fprintf(stderr, "Failed to save thermal models to %s: %s\n", temp_path, strerror(errno));
+    return -1;
+  }
+
+  for (int c = 0; c < app_context->num_curves; c++) {
+    const struct curve_model *model = &autotune->model[c];
+    if (!model->enabled || model->samples == 0) continue;
+
+    (void)fprintf(file, "%.17g %.17g %.17g %.17g %.17g %lu %s\n", model->step_sq, model->step_change,
+                  model->slope_sq, model->slope_product, model->noise, model->samples,
+                  app_context->curve.name[c]);
+  }
+
+  if (fclose(file) == EOF) {
+    (void)fprintf(stderr, "Failed to save thermal models to %s: %s\n", temp_path, strerror(errno));
+    return -1;
+  }
+
+  // Replaced in one step, so a crash mid-write keeps the previous models
+  if (rename(temp_path, autotune->path) < 0) {
+    (void)fprintf(stderr, "Failed to save thermal models to %s: %s\n", autotune->path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+void autotune_print(const struct app_context *app_context, FILE *stream)
+{
+  const struct autotune *autotune = app_context->autotune;
+  if (!autotune) return;
+
+  const struct curve_state *curve = &app_context->curve;
+
+  (void)fprintf(stream, "Thermal models:\n");
+  for (int c = 0; c < app_context->num_curves; c++) {
+    struct curve_model model = autotune->model[c];
+    if (!model.enabled) continue;
+
+    if (!suggest(&model)) {
+      (void)fprintf(stream, "  %-24s fitting, %lu fan steps\n", curve->name[c], model.samples);
+      continue;
+    }
+
+    double tau = time_constant(&model);
+    (void)fprintf(stream, "  %-24s cooling %.4fC/s per %%, ", curve->name[c], -cooling_rate(&model));
+    if (tau > 0) {
+      (void)fprintf(stream, "time constant %.1fs, gain %.3fC/%%, ", tau, cooling_rate(&model) * tau);
+    }
+    (void)fprintf(stream, "noise %.2fC, %lu fan steps\n", sqrt(model.noise), model.samples);
+    (void)fprintf(stream, "  %-24s %s hysteresis %.2fC and response time %.0fs, using %.2fC and %.0fs\n",
+                  "", model.apply ? "applied" : "suggests", model.hysteresis, model.response_time,
+                  curve->hysteresis[c], curve->response_time[c]);
+  }
+}
+
+size_t autotune_arena_size(const struct config *config)
+{
+  if (!uses_autotune(config)) return 0;
+
+  return arena_size(1, sizeof(struct autotune)) +
+         arena_size(config->num_curves, sizeof(struct curve_model)) +
+         arena_size(PATH_MAX, 1);
+}
@@ -0,0 +1,76 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+struct app_context;
+struct config;
+struct event_loop;
+
+// Least squares fit of a straight line to readings against time
+struct line_fit {
+  double weight;
+  double time;
+  double time_sq;
+  double value;
+  double product;
+};
+
+// First-order thermal model of one curve, tau*dT/dt = K*u + load - T with u
+// the curve's fan percent and an unknown heat load. The fans move because
+// the temperature did, so the model is learnt from the fan steps alone: the
+// change of slope over a short window after a step, against the step, is
+// the cooling rate K/tau, and the decay of the slope from that window to the
+// next gives the time constant. Both are incremental least squares fits
+// through the origin, with forgetting.
+struct curve_model {
+  bool enabled;
+  bool apply;
+  float overshoot;
+
+  double step_sq;
+  double step_change;
+  double slope_sq;
+  double slope_product;
+  // Variance of the sensor noise from one reading to the next
+  double noise;
+  unsigned long samples;
+
+  bool primed;
+  float last_input;
+  float last_percent;
+  struct timespec last_clock;
+
+  // Readings since the last step, weighted towards the latest
+  struct line_fit trend;
+  // Readings of the window after a step that is being measured
+  struct line_fit window;
+  int window_index;
+  struct timespec last_step;
+  float step;
+  double slope_before;
+  double slope_after;
+
+  float hysteresis;
+  float response_time;
+};
+
+struct autotune {
+  struct curve_model *model;
+  const char *path;
+
+  struct timespec updated;
+  int timer_fildes;
+};
+
+int autotune_init(const struct config *config, struct app_context *app_context, struct event_loop *loop);
+void autotune_destroy(struct app_context *app_context);
+void autotune_update(struct app_context *app_context);
+int autotune_save(const struct app_context *app_context);
+void autotune_print(const struct app_context *app_context, FILE *stream);
+size_t autotune_arena_size(const struct config *config);
+
+#endif
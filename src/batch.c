@@ -0,0 +1,333 @@
+#include <math.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BATCH_X86
+#endif
+
+#include "batch.h"
+#include "control.h"
+
+static void curve_lane(struct curve_state *curve, int i)
+{
+  curve->hold[i] = curve->hysteresis[i] > 0 &&
+                   fabsf(curve->hyst_val[i] - curve->input[i]) < curve->hysteresis[i] ? -1 : 0;
+  curve->target[i] = graph_lookup(curve->graph + curve->graph_base[i], curve->num_points[i],
+                                  curve->input[i]);
+}
+
+static int pwm_lane(struct fan_state *fan, int i, int num_changed)
+{
+  if (!fan->active[i]) return num_changed;
+
+  int pwm_value = scale_pwm(fan->target_percent[i], fan->min_pwm[i], fan->pwm_range[i],
+                            fan->zero_rpm[i]);
+  if (pwm_value != fan->pwm_value[i]) {
+    fan->pwm_value[i] = pwm_value;
+    fan->changed[num_changed++] = i;
+  }
+
+  return num_changed;
+}
+
+static void scalar_curves(struct curve_state *curve, int num_curves)
+{
+  for (int i = 0; i < num_curves; i++) {
+    curve_lane(curve, i);
+  }
+}
+
+static int scalar_pwm(struct fan_state *fan, int num_fans)
+{
+  int num_changed = 0;
+
+  for (int i = 0; i < num_fans; i++) {
+    num_changed = pwm_lane(fan, i, num_changed);
+  }
+
+  return num_changed;
+}
+
+#ifdef BATCH_X86
+
+#define SSE2_LANES 4
+#define AVX2_LANES 8
+
+static int append_changed(int *changed, int num_changed, int first, unsigned int mask)
+{
+  while (mask) {
+    changed[num_changed++] = first + __builtin_ctz(mask);
+    mask &= mask - 1;
+  }
+
+  return num_changed;
+}
+
+// The graph search below mirrors graph_lookup() lane by lane: the same
+// endpoint checks, the same binary search path and the same interpolation
+// order, so every lane rounds exactly as the scalar code does
+
+__attribute__((target("sse2")))
+static __m128 sse2_gather(const float *base, __m128i index)
+{
+  alignas(16) int32_t lane[SSE2_LANES];
+  _mm_store_si128((__m128i *)lane, index);
+
+  return _mm_setr_ps(base[lane[0]], base[lane[1]], base[lane[2]], base[lane[3]]);
+}
+
+__attribute__((target("sse2")))
+static __m128i sse2_select_epi32(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+__attribute__((target("sse2")))
+static __m128 sse2_select_ps(__m128 mask, __m128 a, __m128 b)
+{
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+__attribute__((target("sse2")))
+static void sse2_curves(struct curve_state *curve, int num_curves)
+{
+  const float *temp = &curve->graph[0].temp;
+  const float *percent = &curve->graph[0].fan_percent;
+  const __m128 sign = _mm_set1_ps(-0.0F);
+  const __m128 epsilon = _mm_set1_ps(EPSILON);
+  const __m128i one = _mm_set1_epi32(1);
+  int i = 0;
+
+  for (; i + SSE2_LANES <= num_curves; i += SSE2_LANES) {
+    __m128 input = _mm_loadu_ps(curve->input + i);
+    __m128 hyst_val = _mm_loadu_ps(curve->hyst_val + i);
+    __m128 hysteresis = _mm_loadu_ps(curve->hysteresis + i);
+
+    __m128 band = _mm_andnot_ps(sign, _mm_sub_ps(hyst_val, input));
+    __m128 hold = _mm_and_ps(_mm_cmpgt_ps(hysteresis, _mm_setzero_ps()), _mm_cmplt_ps(band, hysteresis));
+    _mm_storeu_si128((__m128i *)(curve->hold + i), _mm_castps_si128(hold));
+
+    // Graph points are interleaved, so indexes count floats
+    __m128i base = _mm_slli_epi32(_mm_loadu_si128((const __m128i *)(curve->graph_base + i)), 1);
+    __m128i last = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(curve->num_points + i)), one);
+
+    __m128 first_temp = sse2_gather(temp, base);
+    __m128 last_temp = sse2_gather(temp, _mm_add_epi32(base, _mm_slli_epi32(last, 1)));
+    __m128 below = _mm_cmple_ps(input, first_temp);
+    __m128 above = _mm_andnot_ps(below, _mm_cmpge_ps(input, last_temp));
+
+    __m128 result = sse2_select_ps(below, sse2_gather(percent, base),
+                                   sse2_gather(percent, _mm_add_epi32(base, _mm_slli_epi32(last, 1))));
+    __m128i done = _mm_castps_si128(_mm_or_ps(below, above));
+    __m128i found = _mm_setzero_si128();
+    __m128i low = _mm_setzero_si128();
+    __m128i high = last;
+
+    for (;;) {
+      __m128i active = _mm_andnot_si128(done, _mm_xor_si128(_mm_cmpgt_epi32(low, high), _mm_set1_epi32(-1)));
+      if (_mm_movemask_epi8(active) == 0) break;
+
+      __m128i mid = _mm_add_epi32(low, _mm_srai_epi32(_mm_sub_epi32(high, low), 1));
+      __m128i index = _mm_add_epi32(base, _mm_slli_epi32(mid, 1));
+      __m128 mid_temp = sse2_gather(temp, index);
+
+      __m128i hit = _mm_and_si128(active, _mm_castps_si128(
+        _mm_cmplt_ps(_mm_andnot_ps(sign, _mm_sub_ps(input, mid_temp)), epsilon)));
+      result = sse2_select_ps(_mm_castsi128_ps(hit), sse2_gather(percent, index), result);
+      found = _mm_or_si128(found, hit);
+      done = _mm_or_si128(done, hit);
+
+      __m128i step = _mm_andnot_si128(hit, active);
+      __m128i less = _mm_castps_si128(_mm_cmplt_ps(input, mid_temp));
+      high = sse2_select_epi32(_mm_and_si128(step, less), _mm_sub_epi32(mid, one), high);
+      low = sse2_select_epi32(_mm_andnot_si128(less, step), _mm_add_epi32(mid, one), low);
+    }
+
+    __m128i start = _mm_add_epi32(base, _mm_slli_epi32(high, 1));
+    __m128i end = _mm_add_epi32(base, _mm_slli_epi32(low, 1));
+    __m128 start_temp = sse2_gather(temp, start);
+    __m128 start_percent = sse2_gather(percent, start);
+    __m128 fan_speed_range = _mm_sub_ps(sse2_gather(percent, end), start_percent);
+    __m128 temp_range = _mm_sub_ps(sse2_gather(temp, end), start_temp);
+    __m128 offset_from_last = _mm_sub_ps(input, start_temp);
+    __m128 interpolated = _mm_add_ps(start_percent,
+                                     _mm_div_ps(_mm_mul_ps(offset_from_last, fan_speed_range), temp_range));
+
+    __m128 exact = _mm_castsi128_ps(_mm_or_si128(found, _mm_castps_si128(_mm_or_ps(below, above))));
+    _mm_storeu_ps(curve->target + i, sse2_select_ps(exact, result, interpolated));
+  }
+
+  for (; i < num_curves; i++) {
+    curve_lane(curve, i);
+  }
+}
+
+__attribute__((target("sse2")))
+static int sse2_pwm(struct fan_state *fan, int num_fans)
+{
+  const __m128 hundred = _mm_set1_ps(100.0F);
+  const __m128 rounding = _mm_set1_ps(ROUNDING_FLOAT);
+  int num_changed = 0;
+  int i = 0;
+
+  for (; i + SSE2_LANES <= num_fans; i += SSE2_LANES) {
+    __m128 percent = _mm_loadu_ps(fan->target_percent + i);
+    __m128 min_pwm = _mm_loadu_ps(fan->min_pwm + i);
+    __m128 pwm_range = _mm_loadu_ps(fan->pwm_range + i);
+
+    __m128i pwm = _mm_cvttps_epi32(_mm_add_ps(min_pwm, _mm_add_ps(_mm_mul_ps(pwm_range, _mm_div_ps(percent, hundred)), rounding)));
+    __m128i zero = _mm_and_si128(_mm_loadu_si128((const __m128i *)(fan->zero_rpm + i)),
+                                 _mm_castps_si128(_mm_cmpeq_ps(percent, _mm_setzero_ps())));
+    pwm = _mm_andnot_si128(zero, pwm);
+
+    __m128i old = _mm_loadu_si128((const __m128i *)(fan->pwm_value + i));
+    __m128i changed = _mm_andnot_si128(_mm_cmpeq_epi32(pwm, old),
+                                       _mm_loadu_si128((const __m128i *)(fan->active + i)));
+    _mm_storeu_si128((__m128i *)(fan->pwm_value + i), sse2_select_epi32(changed, pwm, old));
+
+    num_changed = append_changed(fan->changed, num_changed, i,
+                                 (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(changed)));
+  }
+
+  for (; i < num_fans; i++) {
+    num_changed = pwm_lane(fan, i, num_changed);
+  }
+
+  return num_changed;
+}
+
+__attribute__((target("avx2")))
+static void avx2_curves(struct curve_state *curve, int num_curves)
+{
+  const float *temp = &curve->graph[0].temp;
+  const float *percent = &curve->graph[0].fan_percent;
+  const __m256 sign = _mm256_set1_ps(-0.0F);
+  const __m256 epsilon = _mm256_set1_ps(EPSILON);
+  const __m256i one = _mm256_set1_epi32(1);
+  int i = 0;
+
+  for (; i + AVX2_LANES <= num_curves; i += AVX2_LANES) {
+    __m256 input = _mm256_loadu_ps(curve->input + i);
+    __m256 hyst_val = _mm256_loadu_ps(curve->hyst_val + i);
+    __m256 hysteresis = _mm256_loadu_ps(curve->hysteresis + i);
+
+    __m256 band = _mm256_andnot_ps(sign, _mm256_sub_ps(hyst_val, input));
+    __m256 hold = _mm256_and_ps(_mm256_cmp_ps(hysteresis, _mm256_setzero_ps(), _CMP_GT_OQ),
+                                _mm256_cmp_ps(band, hysteresis, _CMP_LT_OQ));
+    _mm256_storeu_si256((__m256i *)(curve->hold + i), _mm256_castps_si256(hold));
+
+    __m256i base = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *)(curve->graph_base + i)), 1);
+    __m256i last = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(curve->num_points + i)), one);
+    __m256i last_index = _mm256_add_epi32(base, _mm256_slli_epi32(last, 1));
+
+    __m256 below = _mm256_cmp_ps(input, _mm256_i32gather_ps(temp, base, 4), _CMP_LE_OQ);
+    __m256 above = _mm256_andnot_ps(below, _mm256_cmp_ps(input, _mm256_i32gather_ps(temp, last_index, 4),
+                                                         _CMP_GE_OQ));
+
+    __m256 result = _mm256_blendv_ps(_mm256_i32gather_ps(percent, last_index, 4),
+                                     _mm256_i32gather_ps(percent, base, 4), below);
+    __m256i done = _mm256_castps_si256(_mm256_or_ps(below, above));
+    __m256i found = _mm256_setzero_si256();
+    __m256i low = _mm256_setzero_si256();
+    __m256i high = last;
+
+    for (;;) {
+      __m256i active = _mm256_andnot_si256(done, _mm256_xor_si256(_mm256_cmpgt_epi32(low, high),
+                                                                  _mm256_set1_epi32(-1)));
+      if (_mm256_testz_si256(active, active)) break;
+
+      __m256i mid = _mm256_add_epi32(low, _mm256_srai_epi32(_mm256_sub_epi32(high, low), 1));
+      __m256i index = _mm256_add_epi32(base, _mm256_slli_epi32(mid, 1));
+      __m256 mid_temp = _mm256_i32gather_ps(temp, index, 4);
+
+      __m256i hit = _mm256_and_si256(active, _mm256_castps_si256(
+        _mm256_cmp_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(input, mid_temp)), epsilon, _CMP_LT_OQ)));
+      result = _mm256_blendv_ps(result, _mm256_i32gather_ps(percent, index, 4), _mm256_castsi256_ps(hit));
+      found = _mm256_or_si256(found, hit);
+      done = _mm256_or_si256(done, hit);
+
+      __m256i step = _mm256_andnot_si256(hit, active);
+      __m256i less = _mm256_castps_si256(_mm256_cmp_ps(input, mid_temp, _CMP_LT_OQ));
+      high = _mm256_blendv_epi8(high, _mm256_sub_epi32(mid, one), _mm256_and_si256(step, less));
+      low = _mm256_blendv_epi8(low, _mm256_add_epi32(mid, one), _mm256_andnot_si256(less, step));
+    }
+
+    __m256i start = _mm256_add_epi32(base, _mm256_slli_epi32(high, 1));
+    __m256i end = _mm256_add_epi32(base, _mm256_slli_epi32(low, 1));
+    __m256 start_temp = _mm256_i32gather_ps(temp, start, 4);
+    __m256 start_percent = _mm256_i32gather_ps(percent, start, 4);
+    __m256 fan_speed_range = _mm256_sub_ps(_mm256_i32gather_ps(percent, end, 4), start_percent);
+    __m256 temp_range = _mm256_sub_ps(_mm256_i32gather_ps(temp, end, 4), start_temp);
+    __m256 offset_from_last = _mm256_sub_ps(input, start_temp);
+    __m256 interpolated = _mm256_add_ps(start_percent, _mm256_div_ps(_mm256_mul_ps(offset_from_last, fan_speed_range),
+                                                                     temp_range));
+
+    __m256 exact = _mm256_or_ps(_mm256_castsi256_ps(found), _mm256_or_ps(below, above));
+    _mm256_storeu_ps(curve->target + i, _mm256_blendv_ps(interpolated, result, exact));
+  }
+
+  for (; i < num_curves; i++) {
+    curve_lane(curve, i);
+  }
+}
+
+__attribute__((target("avx2")))
+static int avx2_pwm(struct fan_state *fan, int num_fans)
+{
+  const __m256 hundred = _mm256_set1_ps(100.0F);
+  const __m256 rounding = _mm256_set1_ps(ROUNDING_FLOAT);
+  int num_changed = 0;
+  int i = 0;
+
+  for (; i + AVX2_LANES <= num_fans; i += AVX2_LANES) {
+    __m256 percent = _mm256_loadu_ps(fan->target_percent + i);
+    __m256 min_pwm = _mm256_loadu_ps(fan->min_pwm + i);
+    __m256 pwm_range = _mm256_loadu_ps(fan->pwm_range + i);
+
+    __m256i pwm = _mm256_cvttps_epi32(_mm256_add_ps(min_pwm, _mm256_add_ps(_mm256_mul_ps(pwm_range, _mm256_div_ps(percent, hundred)), rounding)));
+    __m256i zero = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(fan->zero_rpm + i)),
+                                    _mm256_castps_si256(_mm256_cmp_ps(percent, _mm256_setzero_ps(), _CMP_EQ_OQ)));
+    pwm = _mm256_andnot_si256(zero, pwm);
+
+    __m256i old = _mm256_loadu_si256((const __m256i *)(fan->pwm_value + i));
+    __m256i changed = _mm256_andnot_si256(_mm256_cmpeq_epi32(pwm, old),
+                                          _mm256_loadu_si256((const __m256i *)(fan->active + i)));
+    _mm256_storeu_si256((__m256i *)(fan->pwm_value + i), _mm256_blendv_epi8(old, pwm, changed));
+
+    num_changed = append_changed(fan->changed, num_changed, i,
+                                 (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(changed)));
+  }
+
+  for (; i < num_fans; i++) {
+    num_changed = pwm_lane(fan, i, num_changed);
+  }
+
+  return num_changed;
+}
+
+#endif // BATCH_X86
+
+static const struct batch_kernels scalar_kernels = {"scalar", scalar_curves, scalar_pwm};
+
+#ifdef BATCH_X86
+static const struct batch_kernels sse2_kernels = {"sse2", sse2_curves, sse2_pwm};
+static const struct batch_kernels avx2_kernels = {"avx2", avx2_curves, avx2_pwm};
+#endif // BATCH_X86
+
+const struct batch_kernels *batch_select(void)
+{
+#ifdef BATCH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &avx2_kernels;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &sse2_kernels;
+  }
+#endif // BATCH_X86
+
+  return &scalar_kernels;
+}
@@ -0,0 +1,25 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+struct curve_state;
+struct fan_state;
+
+// Per-tick arithmetic over the curve and fan arrays. Every implementation
+// produces bit-identical results, so the fastest one the CPU supports is
+// picked at startup
+struct batch_kernels {
+  const char *name;
+
+  // Sets curve->hold for curves within their hysteresis band and
+  // curve->target to the interpolated fan percent of curve->input
+  void (*curves)(struct curve_state *curve, int num_curves);
+
+  // Scales fan->target_percent to a pwm value for every active fan,
+  // updates fan->pwm_value and lists the fans whose value changed in
+  // fan->changed, returning their count
+  int (*pwm)(struct fan_state *fan, int num_fans);
+};
+
+const struct batch_kernels *batch_select(void);
+
+#endif
@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "benchmark.h"
+#include "batch.h"
+#include "config.h"
+#include "control.h"
+#include "hwmon.h"
+
+#define NS_PER_SEC 1000000000L
+#define NS_PER_USEC 1000.0
+#define PWM_INPUT_SIZE 16
+#define PWM_ENABLE_MANUAL 1
+
+struct benchmark {
+  long *sample;
+  int cycles;
+  int count;
+  int failures;
+  int error;
+};
+
+static long elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * NS_PER_SEC + (end->tv_nsec - start->tv_nsec);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+  long lhs = *(const long*)a;
+  long rhs = *(const long*)b;
+
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+static long percentile(const long *sorted, int count, int percent)
+{
+  int index = (count * percent + 99) / 100 - 1;
+
+  return sorted[index < 0 ? 0 : index];
+}
+
+static void print_row(const char *name, const char *device, struct benchmark *bench)
+{
+  (void)printf("%-28s %-20s", name, device);
+
+  int count = bench->count;
+  if (count == 0) {
+    (void)printf(" failed: %s\n", strerror(bench->error));
+    return;
+  }
+
+  qsort(bench->sample, count, sizeof(*bench->sample), compare_long);
+
+  (void)printf(" %9.1f %9.1f %9.1f %9.1f",
+               (double)bench->sample[0] / NS_PER_USEC,
+               (double)percentile(bench->sample, count, 50) / NS_PER_USEC,
+               (double)percentile(bench->sample, count, 99) / NS_PER_USEC,
+               (double)bench->sample[count - 1] / NS_PER_USEC);
+  if (bench->failures) {
+    (void)printf("  %d failed: %s", bench->failures, strerror(bench->error));
+  }
+  (void)printf("\n");
+}
+
+static void record(struct benchmark *bench, int status, const struct timespec *start,
+                   const struct timespec *end)
+{
+  if (status < 0) {
+    bench->error = errno;
+    bench->failures++;
+    return;
+  }
+
+  bench->sample[bench->count++] = elapsed_ns(start, end);
+}
+
+static void reset(struct benchmark *bench)
+{
+  bench->count = 0;
+  bench->failures = 0;
+}
+
+// Every cycle uses a fresh tick so derived sensors re-read their members
+// and the cost of the whole dependency chain is measured
+static int read_slots(struct app_context *app_context, const int *slot, int num_slots)
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+    return -1;
+  }
+  app_context->tick++;
+
+  int status = 0;
+  for (int i = 0; i < num_slots; i++) {
+    if (read_sensor(&app_context->sensor[slot[i]], app_context->tick, &now) < 0) {
+      errno = app_context->sensor[slot[i]].error;
+      status = -1;
+    }
+  }
+
+  return status;
+}
+
+static void bench_slots(struct app_context *app_context, const int *slot, int num_slots,
+                        struct benchmark *bench)
+{
+  reset(bench);
+
+  for (int i = 0; i < bench->cycles; i++) {
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = read_slots(app_context, slot, num_slots);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    record(bench, status, &start, &end);
+  }
+}
+
+static int read_pwm(int fildes, int *value)
+{
+  char input[PWM_INPUT_SIZE];
+  ssize_t nread = pread(fildes, input, sizeof(input) - 1, 0);
+  if (nread < 0) return -1;
+  input[nread] = '\0';
+
+  char *end;
+  *value = (int)strtol(input, &end, 10);
+  if (end == input) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int open_pwm(struct app_context *app_context, struct config *config, int index)
+{
+  const char *syspath = device_syspath(app_context->fan.hwmon[index].device);
+  if (!syspath) {
+    errno = ENODEV;
+    return -1;
+  }
+
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", syspath, config->fan[index].pwm_file) >= (int)sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// Each write puts back the value read just before it, and only while the
+// fan is already under manual control, so the fan speed never changes
+static void bench_pwm(struct app_context *app_context, struct config *config, int index,
+                      struct benchmark *read_bench, struct benchmark *write_bench)
+{
+  reset(read_bench);
+  reset(write_bench);
+
+  int fildes = open_pwm(app_context, config, index);
+  if (fildes < 0) {
+    read_bench->failures = write_bench->failures = read_bench->cycles;
+    read_bench->error = write_bench->error = errno;
+    return;
+  }
+
+  for (int i = 0; i < read_bench->cycles; i++) {
+    struct timespec start;
+    struct timespec end;
+    int value;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = read_pwm(fildes, &value);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    record(read_bench, status, &start, &end);
+
+    if (status < 0) {
+      write_bench->error = errno;
+      write_bench->failures++;
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = hwmon_set_pwm(app_context->fan.pwm_fildes[index], value);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    record(write_bench, status, &start, &end);
+  }
+
+  close(fildes);
+}
+
+static void print_header(const char *title)
+{
+  (void)printf("\n%-28s %-20s %9s %9s %9s %9s\n", title, "Device", "min us", "p50 us", "p99 us", "max us");
+}
+
+int benchmark_run(struct config *config, struct app_context *app_context, int cycles, bool pwm)
+{
+  struct benchmark bench = { .cycles = cycles };
+  struct benchmark write_bench = { .cycles = cycles };
+  int num_slots = app_context->num_sensors > app_context->num_curves ? app_context->num_sensors
+                                                                     : app_context->num_curves;
+  int *slot = calloc(num_slots + 1, sizeof(*slot));
+  bench.sample = calloc(cycles, sizeof(*bench.sample));
+  write_bench.sample = calloc(cycles, sizeof(*write_bench.sample));
+  if (!slot || !bench.sample || !write_bench.sample) {
+    perror("Failed to allocate benchmark samples");
+    free(slot);
+    free(bench.sample);
+    free(write_bench.sample);
+    return -1;
+  }
+
+  (void)printf("%d cycles per measurement, %s control kernels\n", cycles, app_context->kernels->name);
+
+  print_header("Sensor");
+  for (int i = 0; i < config->num_sources; i++) {
+    for (int j = 0; j < config->source[i].num_sensors; j++) {
+      bench_slots(app_context, &config->source[i].sensor[j].slot, 1, &bench);
+      print_row(config->source[i].sensor[j].name, config->source[i].name, &bench);
+    }
+  }
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    bench_slots(app_context, &config->custom_sensor[i].slot, 1, &bench);
+    print_row(config->custom_sensor[i].name, config->custom_sensor[i].type, &bench);
+  }
+
+  print_header("Source");
+  for (int i = 0; i < config->num_sources; i++) {
+    for (int j = 0; j < config->source[i].num_sensors; j++) {
+      slot[j] = config->source[i].sensor[j].slot;
+    }
+    bench_slots(app_context, slot, config->source[i].num_sensors, &bench);
+    print_row(config->source[i].name, config->source[i].type ? config->source[i].type : "hwmon", &bench);
+  }
+
+  if (pwm) {
+    print_header("Fan");
+    for (int i = 0; i < app_context->num_fans; i++) {
+      const char *enable = app_context->fan.hwmon[i].pwm_auto_control;
+      if (atoi(enable) != PWM_ENABLE_MANUAL) {
+        (void)printf("%-28s %-20s skipped: %s_enable is %s, not manual\n", config->fan[i].name,
+                     config->fan[i].device_id, config->fan[i].pwm_file, enable);
+        continue;
+      }
+
+      bench_pwm(app_context, config, i, &bench, &write_bench);
+      print_row(config->fan[i].name, "pwm read", &bench);
+      print_row(config->fan[i].name, "pwm write", &write_bench);
+    }
+  }
+
+  // One tick reads the sensor of every curve in use, as update_fans() does
+  for (int c = 0; c < app_context->num_curves; c++) {
+    slot[c] = app_context->curve.sensor[c];
+  }
+  bench_slots(app_context, slot, app_context->num_curves, &bench);
+
+  print_header("Tick");
+  print_row("Sensor reads", "all curves", &bench);
+
+  if (bench.count > 0) {
+    double busy = (double)percentile(bench.sample, bench.count, 99) / NS_PER_USEC / 1000.0 /
+                  config->interval * 100.0;
+    (void)printf("\np99 sensor cost per tick is %.3f%% of the %.0f ms interval\n", busy, config->interval);
+  }
+
+  free(slot);
+  free(bench.sample);
+  free(write_bench.sample);
+
+  return 0;
+}
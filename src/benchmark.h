@@ -0,0 +1,13 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdbool.h>
+
+#define BENCHMARK_DEFAULT_CYCLES 1000
+
+struct app_context;
+struct config;
+
+int benchmark_run(struct config *config, struct app_context *app_context, int cycles, bool pwm);
+
+#endif
@@ -1,4 +1,3 @@
-#include <cjson/cJSON.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -8,8 +7,15 @@
 #include <string.h>
 
 #include "config.h"
+#include "json.h"
+#include "template.h"
 
 #define DEFAULT_INTERVAL 1000.0F // 1000ms
+#define DEFAULT_PRESSURE_HOLD 10.0F // 10s
+#define DEFAULT_FAILSAFE_TICKS 3.0F
+#define DEFAULT_FAILSAFE_PERCENT 100.0F
+#define DEFAULT_OVERSHOOT 2.0F // 2C
+#define INITIAL_ARRAY_CAPACITY 4
 
 enum value_type {
   STRING,
@@ -34,7 +40,9 @@ struct config_layout {
   const struct config_option *opts;
   int num_opts;
 
-  int (*nested_conf_func)(void *userdata, cJSON *object, void *array_ptr);
+  // Called for each key that is not in opts, returning 1 if it consumed
+  // the value, and with a NULL key once the whole object has been read
+  int (*nested_conf_func)(void *userdata, struct json_reader *reader, const char *key, void *array_ptr);
   void *userdata;
 };
 
@@ -43,173 +51,167 @@ struct child_array_layout {
   size_t count_offset;
 };
 
-static void print_config_error(const char *buffer, const char *error_ptr)
-{
-  const char *target_ptr = error_ptr;
-
-  // error_ptr points to the token after the error; this backtracks to the 
-  // previous token so we can print the actual cause of the error
-  if (target_ptr > buffer) {
-    const char *prev = target_ptr - 1;
-    while (prev > buffer && (*prev == ' ' || *prev == '\t' || *prev == '\n' || *prev == '\r')) {
-      prev--;
-    }
-    target_ptr = prev + 1;
-  }
-
-  int line = 1;
-  const char *line_start = buffer;
-
-  for (const char *ptr = buffer; ptr < target_ptr; ptr++) {
-    if (*ptr == '\n') {
-      line++;
-      line_start = ptr + 1;
-    }
-  }
-
-  const char *line_end = target_ptr;
-  while (*line_end != '\0' && *line_end != '\n') {
-    line_end++;
-  }
-
-  int line_length = (int)(line_end - line_start);
-  int column = (int)(target_ptr - line_start);
-
-  (void)fprintf(stderr, "Config error: JSON syntax error on line %d:\n", line);
-  (void)fprintf(stderr, "    %.*s\n", line_length, line_start);
-  (void)fprintf(stderr, "    %*s^\n", column, "");
-}
-
-cJSON *parse_config(const char *path)
-{
-  cJSON *ret = NULL;
-
-  FILE *file = fopen(path, "r");
-
-  if (file == NULL) {
-    (void)fprintf(stderr, "Config error: Failed to open %s\n", path);
-    return ret;
-  }
-
-  char* buffer = NULL;
-  size_t len;
-  if (getdelim(&buffer, &len, '\0', file) != -1) {
-    ret = cJSON_Parse(buffer);
-    if (!ret) {
-      const char *error_ptr = cJSON_GetErrorPtr();
-      if (!error_ptr) {
-        (void)fprintf(stderr, "Config error: Unknown JSON parsing error\n");
-      }
-      else {
-        print_config_error(buffer, error_ptr);
-      }
-    }
-  }
-  else if (ferror(file)) {
-    perror("getdelim");
-  }
-
-  if (fclose(file) == EOF) {
-    perror("fclose");
-  }
-
-  free(buffer);
-  return ret;
-}
-
-int process_option(cJSON *item, struct config_option *opts)
+int process_option(struct json_reader *reader, enum json_token token, const struct config_option *opts)
 {
   switch (opts->type) {
     case STRING:
-      char *string = cJSON_GetStringValue(item);
-      if (string == NULL) {
+      if (token != JSON_STRING) {
         (void)fprintf(stderr, "\"%s\" value must be of string type\n", opts->key);
         return -1;
       }
 
-      *(char**)opts->struct_member = strdup(string);
-      if (*(char**)opts->struct_member == NULL) {
+      char *string = strdup(reader->string);
+      if (string == NULL) {
         perror("strdup");
         return -1;
       }
+      free(*(char**)opts->struct_member);
+      *(char**)opts->struct_member = string;
       break;
     case NUMBER:
     case ARRAY:
-      double number = cJSON_GetNumberValue(item);
-      if (number == NAN) {
+      if (token != JSON_NUMBER) {
         (void)fprintf(stderr, "\"%s\" value must be a number\n", opts->key);
         return -1;
       }
-      *(float*)opts->struct_member = (float)number;
+      *(float*)opts->struct_member = (float)reader->number;
       break;
     case BOOL:
-      if (!cJSON_IsBool(item)) {
+      if (token != JSON_TRUE && token != JSON_FALSE) {
         (void)fprintf(stderr, "\"%s\" value must be a boolean\n", opts->key);
         return -1;
       }
-      *(bool*)opts->struct_member = cJSON_IsTrue(item);
+      *(bool*)opts->struct_member = token == JSON_TRUE;
       break;
   }
 
   return 0;
 }
 
-int configure_opts(cJSON *json, struct config_option opts[], int num_opts)
+static int read_option(struct json_reader *reader, const struct config_option *opts)
 {
-  for (int i = 0; i < num_opts; i++) {
+  enum json_token token = json_next(reader);
+  if (token == JSON_ERROR) return -1;
 
-    cJSON *item = NULL;
+  return process_option(reader, token, opts);
+}
 
-    if (opts[i].type == ARRAY) {
-      item = cJSON_GetArrayItem(json, i);
-    }
-    else {
-      item = cJSON_GetObjectItem(json, opts[i].key);
+static int find_option(const struct config_option opts[], int num_opts, const char *key)
+{
+  for (int i = 0; i < num_opts; i++) {
+    if (opts[i].type != ARRAY && strcmp(opts[i].key, key) == 0) {
+      return i;
     }
+  }
+
+  return -1;
+}
+
+// Reads one object, or one array for positional ARRAY options, starting at
+// token; keys are matched as they stream past so no document is built
+int configure_opts(struct json_reader *reader, enum json_token token,
+                   const struct config_option opts[], int num_opts,
+                   const struct config_layout *layout, void *struct_ptr)
+{
+  bool seen[num_opts + 1];
+  memset(seen, 0, sizeof(seen));
+
+  if (token == JSON_ERROR) return -1;
+
+  if (token == JSON_BEGIN_ARRAY) {
+    for (int index = 0; (token = json_next(reader)) != JSON_END_ARRAY; index++) {
+      if (token == JSON_ERROR) return -1;
 
-    if (item == NULL) {
-      if (opts[i].required) {
-        (void)fprintf(stderr, "Config error: missing %s\n", opts[i].key);
+      if (index < num_opts) {
+        if (process_option(reader, token, &opts[index]) < 0) return -1;
+        seen[index] = true;
+      }
+      else if (json_skip(reader, token) < 0) {
         return -1;
       }
-      continue;
     }
+  }
+  else if (token == JSON_BEGIN_OBJECT) {
+    while ((token = json_next(reader)) != JSON_END_OBJECT) {
+      if (token == JSON_ERROR) return -1;
+
+      int index = find_option(opts, num_opts, reader->string);
+      if (index >= 0) {
+        if (read_option(reader, &opts[index]) < 0) return -1;
+        seen[index] = true;
+        continue;
+      }
+
+      int ret = 0;
+      if (layout && layout->nested_conf_func) {
+        ret = layout->nested_conf_func(layout->userdata, reader, reader->string, struct_ptr);
+        if (ret < 0) return -1;
+      }
+
+      // Unknown keys are ignored
+      if (ret == 0 && json_skip(reader, json_next(reader)) < 0) return -1;
+    }
+  }
+  else {
+    (void)fprintf(stderr, "Config error: expected an object in %s\n",
+                  layout && layout->array_name ? layout->array_name : "the config file");
+    return -1;
+  }
+
+  for (int i = 0; i < num_opts; i++) {
+    if (!seen[i] && opts[i].required) {
+      (void)fprintf(stderr, "Config error: missing %s\n", opts[i].key);
+      return -1;
+    }
+  }
 
-    process_option(item, &opts[i]);
+  if (layout && layout->nested_conf_func) {
+    if (layout->nested_conf_func(layout->userdata, reader, NULL, struct_ptr) < 0) return -1;
   }
 
   return 0;
 }
 
-int configure_config_object(cJSON *json, struct config_layout *sausage)
+int configure_config_object(struct json_reader *reader, struct config_layout *sausage)
 {
-  cJSON *array = NULL;
+  enum json_token token = json_next(reader);
+  if (token == JSON_ERROR) return -1;
 
-  if (sausage->array_name != NULL) {
-    array = cJSON_GetObjectItem(json, sausage->array_name);
-    if (array == NULL) {
-      (void)fprintf(stderr, "Config error: missing %s array\n", sausage->array_name);
-      return -1;
-    }
+  if (token != JSON_BEGIN_ARRAY) {
+    (void)fprintf(stderr, "Config error: %s must be an array\n", sausage->array_name);
+    return -1;
   }
-  else {
-    array = json;
+  if (*sausage->struct_array != NULL) {
+    (void)fprintf(stderr, "Config error: duplicate %s array\n", sausage->array_name);
+    return -1;
   }
 
-  *sausage->object_count = cJSON_GetArraySize(array);
-  *sausage->struct_array = calloc(*sausage->object_count, sausage->struct_size);
+  // The element count is not known up front, so grow geometrically and
+  // trim once the array is closed
+  int capacity = INITIAL_ARRAY_CAPACITY;
+  *sausage->struct_array = calloc(capacity, sausage->struct_size);
   if (*sausage->struct_array == NULL) {
     perror("calloc");
     return -1;
   }
+  *sausage->object_count = 0;
 
-  cJSON *object = NULL;
-  int count = 0;
-  char *base_ptr = (char*)*sausage->struct_array;
+  while ((token = json_next(reader)) != JSON_END_ARRAY) {
+    if (token == JSON_ERROR) return -1;
 
-  cJSON_ArrayForEach(object, array) {
+    int count = *sausage->object_count;
+    if (count == capacity) {
+      char *grown = reallocarray(*sausage->struct_array, capacity * 2, sausage->struct_size);
+      if (!grown) {
+        perror("reallocarray");
+        return -1;
+      }
+      memset(grown + capacity * sausage->struct_size, 0, capacity * sausage->struct_size);
+      *sausage->struct_array = grown;
+      capacity *= 2;
+    }
 
-    void *current_array_memb = base_ptr + count * sausage->struct_size;
+    void *current_array_memb = (char*)*sausage->struct_array + count * sausage->struct_size;
 
     struct config_option opts[sausage->num_opts];
 
@@ -220,58 +222,103 @@ int configure_config_object(cJSON *json, struct config_layout *sausage)
       opts[i].struct_member = (char*)current_array_memb + offset;
     }
 
-    if (configure_opts(object, opts, sausage->num_opts) < 0) return -1;
+    // Count the element first so free_config() sees partially read ones
+    (*sausage->object_count)++;
 
-    if (sausage->nested_conf_func) {
-      if (sausage->nested_conf_func(sausage->userdata, object, current_array_memb) > 0) return -1;
+    if (configure_opts(reader, token, opts, sausage->num_opts, sausage, current_array_memb) < 0) {
+      return -1;
     }
+  }
 
-    count++;
+  int count = *sausage->object_count;
+  if (count > 0 && count < capacity) {
+    void *trimmed = reallocarray(*sausage->struct_array, count, sausage->struct_size);
+    if (trimmed) {
+      *sausage->struct_array = trimmed;
+    }
   }
 
   return 0;
 }
 
-int configure_general(cJSON *json, struct config *config)
+static int require_array(const char *name, const void *array)
 {
-  struct config_option opts[] = {
-    {"interval", NUMBER, &config->interval, false}
-  };
+  if (array == NULL) {
+    (void)fprintf(stderr, "Config error: missing %s array\n", name);
+    return -1;
+  }
 
-  config->interval = DEFAULT_INTERVAL;
+  return 0;
+}
 
-  int num_opts = (sizeof(opts) / sizeof(opts[0]));
+int configure_sensors(void *layout_template, struct json_reader *reader, const char *key,
+                      void *parent_struct)
+{
+  struct child_array_layout *layout = layout_template;
+  char *base_ptr = parent_struct;
 
-  return configure_opts(json, opts, num_opts);
+  if (key == NULL) {
+    return require_array("sensors", *(void**)(base_ptr + layout->array_offset));
+  }
+  if (strcmp(key, "sensors") != 0) return 0;
+
+  // NOLINTBEGIN(performance-no-int-to-ptr)
+  static const struct config_option opts[] = {
+    {"name", STRING, (void*)offsetof(struct sensor_config, name), true},
+    {"offset", NUMBER, (void*)offsetof(struct sensor_config, offset), false}
+  };
+  // NOLINTEND(performance-no-int-to-ptr)
+
+  return configure_config_object(reader, &(struct config_layout) {
+    .array_name = "sensors",
+    .struct_array = (void**)(base_ptr + layout->array_offset),
+    .struct_size = sizeof(struct sensor_config),
+    .object_count = (int*)(base_ptr + layout->count_offset),
+    .opts = opts,
+    .num_opts = sizeof(opts) / sizeof(opts[0]),
+  }) < 0 ? -1 : 1;
 }
 
-int configure_sensors(void *layout_template, cJSON *json, void *parent_struct)
+int configure_source_sensors(void *layout_template, struct json_reader *reader, const char *key,
+                             void *parent_struct)
 {
   struct child_array_layout *layout = layout_template;
   char *base_ptr = parent_struct;
 
+  if (key == NULL) {
+    return require_array("sensors", *(void**)(base_ptr + layout->array_offset));
+  }
+  if (strcmp(key, "sensors") != 0) return 0;
+
   // NOLINTBEGIN(performance-no-int-to-ptr)
   static const struct config_option opts[] = {
     {"name", STRING, (void*)offsetof(struct sensor_config, name), true},
-    {"offset", NUMBER, (void*)offsetof(struct sensor_config, offset), false}
+    {"label", STRING, (void*)offsetof(struct sensor_config, label), false},
+    {"offset", NUMBER, (void*)offsetof(struct sensor_config, offset), false},
+    {"ema alpha", NUMBER, (void*)offsetof(struct sensor_config, filter.ema_alpha), false},
+    {"median window", NUMBER, (void*)offsetof(struct sensor_config, filter.median_window), false},
+    {"max slew", NUMBER, (void*)offsetof(struct sensor_config, filter.max_slew), false}
   };
   // NOLINTEND(performance-no-int-to-ptr)
 
-  return configure_config_object(json, &(struct config_layout) {
+  return configure_config_object(reader, &(struct config_layout) {
     .array_name = "sensors",
     .struct_array = (void**)(base_ptr + layout->array_offset),
     .struct_size = sizeof(struct sensor_config),
     .object_count = (int*)(base_ptr + layout->count_offset),
     .opts = opts,
     .num_opts = sizeof(opts) / sizeof(opts[0]),
-  });
+  }) < 0 ? -1 : 1;
 }
 
-int configure_sources(cJSON *json, struct config *config)
+int configure_sources(struct json_reader *reader, struct config *config)
 {
   // NOLINTBEGIN(performance-no-int-to-ptr)
   static const struct config_option opts[] = {
     {"name", STRING, (void*)offsetof(struct source_config, name), true},
+    {"type", STRING, (void*)offsetof(struct source_config, type), false},
+    {"driver", STRING, (void*)offsetof(struct source_config, driver), false},
+    {"pci id", STRING, (void*)offsetof(struct source_config, pci_id), false},
     {"device id", STRING, (void*)offsetof(struct source_config, device_id), false}
   };
   // NOLINTEND(performance-no-int-to-ptr)
@@ -281,24 +328,37 @@ int configure_sources(cJSON *json, struct config *config)
     .count_offset = offsetof(struct source_config, num_sensors)
   };
 
-  return configure_config_object(json, &(struct config_layout) {
+  return configure_config_object(reader, &(struct config_layout) {
     .array_name = "sources",
     .struct_array = (void**)&config->source,
     .struct_size = sizeof(struct source_config),
     .object_count = &config->num_sources,
     .opts = opts,
     .num_opts = sizeof(opts) / sizeof(opts[0]),
-    .nested_conf_func = configure_sensors,
+    .nested_conf_func = configure_source_sensors,
     .userdata = &layout
   });
 }
 
-int configure_graph(void *userdata, cJSON *json, void *curve_struct)
+int configure_graph(void *userdata, struct json_reader *reader, const char *key, void *curve_struct)
 {
   (void)userdata;
 
   struct curve_config *curve = curve_struct;
 
+  if (key == NULL) return require_array("graph", curve->graph_point);
+
+  // Read here rather than in the curve options so that an explicit 0 can be
+  // told apart from an absent key
+  if (strcmp(key, "failsafe ticks") == 0) {
+    struct config_option opts = {"failsafe ticks", NUMBER, &curve->failsafe_ticks, false};
+
+    curve->has_failsafe_ticks = true;
+    return read_option(reader, &opts) < 0 ? -1 : 1;
+  }
+
+  if (strcmp(key, "graph") != 0) return 0;
+
   // NOLINTBEGIN(performance-no-int-to-ptr)
   static const struct config_option opts[] = {
     {"temp", ARRAY, (void*)offsetof(struct graph_point, temp), true},
@@ -306,28 +366,32 @@ int configure_graph(void *userdata, cJSON *json, void *curve_struct)
   };
   // NOLINTEND(performance-no-int-to-ptr)
 
-  return configure_config_object(json, &(struct config_layout) {
+  return configure_config_object(reader, &(struct config_layout) {
     .array_name = "graph",
     .struct_array = (void**)&curve->graph_point,
     .struct_size = sizeof(struct graph_point),
     .object_count = &curve->num_points,
     .opts = opts,
     .num_opts = sizeof(opts) / sizeof(opts[0]),
-  });
+  }) < 0 ? -1 : 1;
 }
 
-int configure_curves(cJSON *json, struct config *config)
+int configure_curves(struct json_reader *reader, struct config *config)
 {
   // NOLINTBEGIN(performance-no-int-to-ptr)
   static const struct config_option opts[] = {
     {"name", STRING, (void*)offsetof(struct curve_config, name), true},
+    {"template", STRING, (void*)offsetof(struct curve_config, template), false},
     {"sensor", STRING, (void*)offsetof(struct curve_config, sensor), true},
     {"hysteresis", NUMBER, (void*)offsetof(struct curve_config, hysteresis), false},
     {"response time", NUMBER, (void*)offsetof(struct curve_config, response_time), false},
+    {"failsafe percent", NUMBER, (void*)offsetof(struct curve_config, failsafe_percent), false},
+    {"autotune", STRING, (void*)offsetof(struct curve_config, autotune), false},
+    {"overshoot", NUMBER, (void*)offsetof(struct curve_config, overshoot), false},
   };
   // NOLINTEND(performance-no-int-to-ptr)
 
-  return configure_config_object(json, &(struct config_layout) {
+  return configure_config_object(reader, &(struct config_layout) {
     .array_name = "curves",
     .struct_array = (void**)&config->curve,
     .struct_size = sizeof(struct curve_config),
@@ -338,98 +402,150 @@ int configure_curves(cJSON *json, struct config *config)
   });
 }
 
-int link_fan_curves(void *userdata, cJSON *json, void *fan_struct)
-{
-  struct fan_config *fan = fan_struct;
-  struct config *config = userdata;
-
-  cJSON *curve = cJSON_GetObjectItem(json, "curve");
-  if (curve == NULL) {
-    (void)fprintf(stderr, "Config error: \"%s\" has no curve selected\n", fan->name);
-    return -1;
-  }
-
-  char *name = cJSON_GetStringValue(curve);
-  if (name == NULL) {
-    (void)fprintf(stderr, "\"curve\" value must be of string type\n");
-    return -1;
-  }
-  
-  for (int i = 0; i < config->num_curves; i++) {
-    if (strcmp(name, config->curve[i].name) == 0) {
-      fan->curve = &config->curve[i];
-      return 0;
-    }
-  }
-
-  (void)fprintf(stderr, "Config error: curve \"%s\" not found for fan \"%s\"", name, fan->name);
-
-  return -1;
-}
-
-int configure_fans(cJSON *json, struct config *config)
+int configure_fans(struct json_reader *reader, struct config *config)
 {
   // NOLINTBEGIN(performance-no-int-to-ptr)
   static const struct config_option opts[] = {
     {"name", STRING, (void*)offsetof(struct fan_config, name), true},
-    {"device id", STRING, (void*)offsetof(struct fan_config, device_id), true},
+    {"template", STRING, (void*)offsetof(struct fan_config, template), false},
+    {"device id", STRING, (void*)offsetof(struct fan_config, device_id), false},
     {"pwm file", STRING, (void*)offsetof(struct fan_config, pwm_file), true},
     {"min pwm", NUMBER, (void*)offsetof(struct fan_config, min_pwm), true},
     {"max pwm", NUMBER, (void*)offsetof(struct fan_config, max_pwm), true},
     {"zero rpm", BOOL, (void*)offsetof(struct fan_config, zero_rpm), false},
+    {"pwm deadband", NUMBER, (void*)offsetof(struct fan_config, pwm_deadband), false},
+    {"curve", STRING, (void*)offsetof(struct fan_config, curve_name), true},
   };
   // NOLINTEND(performance-no-int-to-ptr)
 
-  return configure_config_object(json, &(struct config_layout) {
+  return configure_config_object(reader, &(struct config_layout) {
     .array_name = "fans",
     .struct_array = (void**)&config->fan,
     .struct_size = sizeof(struct fan_config),
     .object_count = &config->num_fans,
     .opts = opts,
     .num_opts = sizeof(opts) / sizeof(opts[0]),
-    .nested_conf_func = link_fan_curves,
-    .userdata = config
   });
 }
 
-int configure_custom_sensor_type(void *userdata, cJSON *json, void *custom_sensor_struct)
+// Keys that fill the type_opts union; file and power sensors share the
+// path layout
+static const struct {
+  const char *type;
+  const char *key;
+  bool required;
+} custom_type_key[] = {
+  {"max", "sensors", true},
+  {"file", "path", true},
+  {"power", "path", true},
+  {"expr", "formula", true},
+  {"push", "max age", false},
+  {"exec", "command", true},
+};
+
+static int check_custom_sensor_type(struct custom_sensor_config *struct_ptr)
+{
+  for (int i = 0; i < (int)(sizeof(custom_type_key) / sizeof(custom_type_key[0])); i++) {
+    if (strcmp(struct_ptr->type, custom_type_key[i].type) != 0) continue;
+
+    if (struct_ptr->type_opts_key != NULL &&
+        strcmp(struct_ptr->type_opts_key, custom_type_key[i].key) != 0)
+    {
+      (void)fprintf(stderr, "Config error: \"%s\" does not apply to %s sensor \"%s\"\n",
+                    struct_ptr->type_opts_key, struct_ptr->type, struct_ptr->name);
+      return -1;
+    }
+    if (struct_ptr->type_opts_key == NULL && custom_type_key[i].required) {
+      (void)fprintf(stderr, "Config error: missing %s for \"%s\"\n",
+                    custom_type_key[i].key, struct_ptr->name);
+      return -1;
+    }
+
+    if (strcmp(struct_ptr->type, "expr") == 0 &&
+        expr_compile(struct_ptr->type_opts.expr.formula, &struct_ptr->type_opts.expr.program) < 0)
+    {
+      (void)fprintf(stderr, "Config error: invalid formula for \"%s\"\n", struct_ptr->name);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  (void)fprintf(stderr, "Config error: unknown type \"%s\"\n", struct_ptr->type);
+  return -1;
+}
+
+// The "type" key may follow the type specific keys, so those are matched
+// by name and checked against the type once the object is complete
+int configure_custom_sensor_type(void *userdata, struct json_reader *reader, const char *key,
+                                 void *custom_sensor_struct)
 {
   (void)userdata;
   struct custom_sensor_config *struct_ptr = custom_sensor_struct;
 
-  if (strcmp(struct_ptr->type, "max") == 0) {
+  if (key == NULL) return check_custom_sensor_type(struct_ptr);
+
+  int index = -1;
+  for (int i = 0; i < (int)(sizeof(custom_type_key) / sizeof(custom_type_key[0])); i++) {
+    if (strcmp(key, custom_type_key[i].key) == 0) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) return 0;
+
+  if (struct_ptr->type_opts_key != NULL) {
+    (void)fprintf(stderr, "Config error: \"%s\" and \"%s\" given for the same custom sensor\n",
+                  struct_ptr->type_opts_key, key);
+    return -1;
+  }
+  struct_ptr->type_opts_key = custom_type_key[index].key;
+
+  if (strcmp(key, "sensors") == 0) {
     static struct child_array_layout layout = {
       .array_offset = offsetof(struct custom_sensor_config, type_opts.max.sensor),
       .count_offset = offsetof(struct custom_sensor_config, type_opts.max.num_sensors)
     };
 
-    return configure_sensors(&layout, json, struct_ptr);
+    return configure_sensors(&layout, reader, key, struct_ptr);
   }
 
-  if (strcmp(struct_ptr->type, "file") == 0) {
-    // NOLINTBEGIN(performance-no-int-to-ptr)
-    struct config_option opts[] = {
-      {"path", STRING, (char*)struct_ptr + offsetof(struct custom_sensor_config, type_opts.file.path), true},
-    };
-    // NOLINTEND(performance-no-int-to-ptr)
+  if (strcmp(key, "path") == 0) {
+    struct config_option opts = {"path", STRING, &struct_ptr->type_opts.file.path, true};
 
-    return configure_opts(json, opts, sizeof(opts) / sizeof(opts[0]));
+    return read_option(reader, &opts) < 0 ? -1 : 1;
   }
 
-  (void)fprintf(stderr, "Config error: unknown type \"%s\"\n", struct_ptr->type);
-  return -1;
+  if (strcmp(key, "command") == 0) {
+    struct config_option opts = {"command", STRING, &struct_ptr->type_opts.exec.command, true};
+
+    return read_option(reader, &opts) < 0 ? -1 : 1;
+  }
+
+  if (strcmp(key, "max age") == 0) {
+    struct config_option opts = {"max age", NUMBER, &struct_ptr->type_opts.push.max_age, false};
+
+    return read_option(reader, &opts) < 0 ? -1 : 1;
+  }
+
+  struct config_option opts = {"formula", STRING, &struct_ptr->type_opts.expr.formula, true};
+
+  return read_option(reader, &opts) < 0 ? -1 : 1;
 }
 
-int configure_custom_sensors(cJSON *json, struct config *config)
+int configure_custom_sensors(struct json_reader *reader, struct config *config)
 {
   // NOLINTBEGIN(performance-no-int-to-ptr)
   static const struct config_option opts[] = {
     {"name", STRING, (void*)offsetof(struct custom_sensor_config, name), true},
-    {"type", STRING, (void*)offsetof(struct custom_sensor_config, type), true}
+    {"type", STRING, (void*)offsetof(struct custom_sensor_config, type), true},
+    {"ema alpha", NUMBER, (void*)offsetof(struct custom_sensor_config, filter.ema_alpha), false},
+    {"median window", NUMBER, (void*)offsetof(struct custom_sensor_config, filter.median_window), false},
+    {"max slew", NUMBER, (void*)offsetof(struct custom_sensor_config, filter.max_slew), false}
   };
   // NOLINTEND(performance-no-int-to-ptr)
 
-  return configure_config_object(json, &(struct config_layout) {
+  return configure_config_object(reader, &(struct config_layout) {
     .array_name = "custom sensors",
     .struct_array = (void**)&config->custom_sensor,
     .struct_size = sizeof(struct custom_sensor_config),
@@ -440,15 +556,385 @@ int configure_custom_sensors(cJSON *json, struct config *config)
   });
 }
 
+static int insert_name(struct config *config, enum name_kind kind, const char *name, int index)
+{
+  static const char *kind_name[] = {
+    [NAME_SENSOR] = "sensor",
+    [NAME_CURVE] = "curve",
+    [NAME_FAN] = "fan"
+  };
+
+  if (name_table_insert(&config->names, kind, name, index) < 0) {
+    (void)fprintf(stderr, "Config error: duplicate %s name \"%s\"\n", kind_name[kind], name);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int resolve_sensor(struct config *config, const char *name, const char *user, int *slot)
+{
+  *slot = name_table_lookup(&config->names, NAME_SENSOR, name);
+  if (*slot < 0) {
+    (void)fprintf(stderr, "Config error: sensor \"%s\" not found for \"%s\"\n", name, user);
+    return -1;
+  }
+
+  return 0;
+}
+
+int link_config(struct config *config)
+{
+  int num_sensors = 0;
+  for (int i = 0; i < config->num_sources; i++) {
+    num_sensors += config->source[i].num_sensors;
+  }
+  config->num_source_sensors = num_sensors;
+  config->num_sensor_slots = num_sensors + config->num_custom_sensors;
+
+  if (name_table_init(&config->names,
+                      config->num_sensor_slots + config->num_curves + config->num_fans) < 0)
+  {
+    return -1;
+  }
+
+  int errors = 0;
+  int slot = 0;
+
+  for (int i = 0; i < config->num_sources; i++) {
+    const struct source_config *source = &config->source[i];
+    bool hwmon = source->type == NULL || strcmp(source->type, "hwmon") == 0;
+    if (hwmon && source->num_sensors > 0 && source->device_id == NULL) {
+      (void)fprintf(stderr, "Config error: source \"%s\" has no device id\n", source->name);
+      errors++;
+    }
+
+    for (int j = 0; j < config->source[i].num_sensors; j++) {
+      struct sensor_config *sensor = &config->source[i].sensor[j];
+      sensor->slot = slot++;
+      errors += insert_name(config, NAME_SENSOR, sensor->name, sensor->slot) < 0;
+    }
+  }
+
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    config->custom_sensor[i].slot = slot++;
+    errors += insert_name(config, NAME_SENSOR, config->custom_sensor[i].name, config->custom_sensor[i].slot) < 0;
+  }
+
+  for (int i = 0; i < config->num_curves; i++) {
+    errors += insert_name(config, NAME_CURVE, config->curve[i].name, i) < 0;
+  }
+
+  for (int i = 0; i < config->num_fans; i++) {
+    errors += insert_name(config, NAME_FAN, config->fan[i].name, i) < 0;
+  }
+
+  for (int i = 0; i < config->num_curves; i++) {
+    struct curve_config *curve = &config->curve[i];
+    errors += resolve_sensor(config, curve->sensor, curve->name, &curve->sensor_slot) < 0;
+
+    if (!curve->has_failsafe_ticks) {
+      curve->failsafe_ticks = DEFAULT_FAILSAFE_TICKS;
+    }
+    if (curve->failsafe_ticks < 0) {
+      (void)fprintf(stderr, "Config error: failsafe ticks of curve \"%s\" is negative\n", curve->name);
+      errors++;
+    }
+    if (curve->failsafe_percent <= 0) {
+      curve->failsafe_percent = DEFAULT_FAILSAFE_PERCENT;
+    }
+    if (curve->failsafe_percent > 100) {
+      (void)fprintf(stderr, "Config error: failsafe percent of curve \"%s\" is above 100\n", curve->name);
+      errors++;
+    }
+    if (curve->overshoot <= 0) {
+      curve->overshoot = DEFAULT_OVERSHOOT;
+    }
+    if (curve->autotune && strcmp(curve->autotune, "suggest") != 0 && strcmp(curve->autotune, "apply") != 0) {
+      (void)fprintf(stderr, "Config error: autotune of curve \"%s\" must be \"suggest\" or \"apply\"\n",
+                    curve->name);
+      errors++;
+    }
+  }
+
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    struct custom_sensor_config *custom = &config->custom_sensor[i];
+
+    if (strcmp(custom->type, "max") == 0) {
+      for (int j = 0; j < custom->type_opts.max.num_sensors; j++) {
+        struct sensor_config *member = &custom->type_opts.max.sensor[j];
+        errors += resolve_sensor(config, member->name, custom->name, &member->slot) < 0;
+      }
+    }
+    else if (strcmp(custom->type, "expr") == 0) {
+      struct expr_sensor_config *expr = &custom->type_opts.expr;
+
+      expr->slot = calloc(expr->program.num_names, sizeof(*expr->slot));
+      if (expr->program.num_names && !expr->slot) {
+        perror("Failed to allocate expression slots");
+        return -1;
+      }
+
+      for (int j = 0; j < expr->program.num_names; j++) {
+        errors += resolve_sensor(config, expr->program.name[j], custom->name, &expr->slot[j]) < 0;
+      }
+    }
+  }
+
+  for (int i = 0; i < config->num_fans; i++) {
+    if (config->fan[i].device_id == NULL) {
+      (void)fprintf(stderr, "Config error: fan \"%s\" has no device id\n", config->fan[i].name);
+      errors++;
+    }
+
+    int index = name_table_lookup(&config->names, NAME_CURVE, config->fan[i].curve_name);
+    if (index < 0) {
+      (void)fprintf(stderr, "Config error: curve \"%s\" not found for fan \"%s\"\n",
+                    config->fan[i].curve_name, config->fan[i].name);
+      errors++;
+      continue;
+    }
+    config->fan[i].curve = &config->curve[index];
+  }
+
+  for (int i = 0; i < config->num_pressure_triggers; i++) {
+    struct pressure_config *trigger = &config->pressure_trigger[i];
+
+    if (trigger->hold <= 0) {
+      trigger->hold = DEFAULT_PRESSURE_HOLD;
+    }
+
+    for (int j = 0; j < trigger->num_fans; j++) {
+      trigger->fan[j].index = name_table_lookup(&config->names, NAME_FAN, trigger->fan[j].name);
+      if (trigger->fan[j].index < 0) {
+        (void)fprintf(stderr, "Config error: fan \"%s\" not found for pressure trigger \"%s\"\n",
+                      trigger->fan[j].name, trigger->path);
+        errors++;
+      }
+    }
+  }
+
+  return errors ? -1 : 0;
+}
+
+int configure_fan_refs(void *userdata, struct json_reader *reader, const char *key,
+                       void *trigger_struct)
+{
+  (void)userdata;
+
+  struct pressure_config *trigger = trigger_struct;
+
+  if (key == NULL || strcmp(key, "fans") != 0) return 0;
+
+  // NOLINTBEGIN(performance-no-int-to-ptr)
+  static const struct config_option opts[] = {
+    {"name", STRING, (void*)offsetof(struct fan_ref, name), true}
+  };
+  // NOLINTEND(performance-no-int-to-ptr)
+
+  return configure_config_object(reader, &(struct config_layout) {
+    .array_name = "fans",
+    .struct_array = (void**)&trigger->fan,
+    .struct_size = sizeof(struct fan_ref),
+    .object_count = &trigger->num_fans,
+    .opts = opts,
+    .num_opts = sizeof(opts) / sizeof(opts[0]),
+  }) < 0 ? -1 : 1;
+}
+
+int configure_pressure_triggers(struct json_reader *reader, struct config *config)
+{
+  // NOLINTBEGIN(performance-no-int-to-ptr)
+  static const struct config_option opts[] = {
+    {"path", STRING, (void*)offsetof(struct pressure_config, path), true},
+    {"type", STRING, (void*)offsetof(struct pressure_config, type), false},
+    {"stall", NUMBER, (void*)offsetof(struct pressure_config, stall), true},
+    {"window", NUMBER, (void*)offsetof(struct pressure_config, window), true},
+    {"fan percent", NUMBER, (void*)offsetof(struct pressure_config, fan_percent), false},
+    {"hold", NUMBER, (void*)offsetof(struct pressure_config, hold), false},
+  };
+  // NOLINTEND(performance-no-int-to-ptr)
+
+  return configure_config_object(reader, &(struct config_layout) {
+    .array_name = "pressure triggers",
+    .struct_array = (void**)&config->pressure_trigger,
+    .struct_size = sizeof(struct pressure_config),
+    .object_count = &config->num_pressure_triggers,
+    .opts = opts,
+    .num_opts = sizeof(opts) / sizeof(opts[0]),
+    .nested_conf_func = configure_fan_refs,
+  });
+}
+
+int configure_realtime(struct json_reader *reader, struct config *config)
+{
+  struct config_option opts[] = {
+    {"scheduler", STRING, &config->realtime.scheduler, false},
+    {"priority", NUMBER, &config->realtime.priority, false},
+    {"runtime", NUMBER, &config->realtime.runtime, false},
+    {"cpu affinity", STRING, &config->realtime.cpu_affinity, false},
+    {"lock memory", BOOL, &config->realtime.lock_memory, false}
+  };
+
+  return configure_opts(reader, json_next(reader), opts, sizeof(opts) / sizeof(opts[0]),
+                        &(struct config_layout) { .array_name = "realtime" }, NULL);
+}
+
+static const struct {
+  const char *key;
+  int (*function)(struct json_reader *reader, struct config *config);
+  bool required;
+} section[] = {
+  {"realtime", configure_realtime, false},
+  {"sources", configure_sources, true},
+  {"curves", configure_curves, true},
+  {"custom sensors", configure_custom_sensors, true},
+  {"fans", configure_fans, true},
+  {"pressure triggers", configure_pressure_triggers, false},
+};
+
+int configure_section(void *userdata, struct json_reader *reader, const char *key, void *config_struct)
+{
+  (void)userdata;
+
+  struct config *config = config_struct;
+  int num_sections = sizeof(section) / sizeof(section[0]);
+
+  if (key == NULL) {
+    const void *array[] = {
+      NULL, config->source, config->curve, config->custom_sensor, config->fan, NULL
+    };
+
+    for (int i = 0; i < num_sections; i++) {
+      if (section[i].required && require_array(section[i].key, array[i]) < 0) return -1;
+    }
+    return 0;
+  }
+
+  for (int i = 0; i < num_sections; i++) {
+    if (strcmp(key, section[i].key) == 0) {
+      return section[i].function(reader, config) < 0 ? -1 : 1;
+    }
+  }
+
+  return 0;
+}
+
+int configure_general(struct json_reader *reader, struct config *config)
+{
+  struct config_option opts[] = {
+    {"interval", NUMBER, &config->interval, false},
+    {"push socket", STRING, &config->push_socket, false},
+    {"pwm writes per second", NUMBER, &config->pwm_writes_per_second, false},
+    {"state directory", STRING, &config->state_directory, false}
+  };
+
+  config->interval = DEFAULT_INTERVAL;
+
+  int num_opts = (sizeof(opts) / sizeof(opts[0]));
+
+  return configure_opts(reader, json_next(reader), opts, num_opts,
+                        &(struct config_layout) { .nested_conf_func = configure_section }, config);
+}
+
+const char *sensor_label(const struct sensor_config *sensor)
+{
+  return sensor->label ? sensor->label : sensor->name;
+}
+
+static void release_string(char **string)
+{
+  free(*string);
+  *string = NULL;
+}
+
+void config_release_strings(struct config *config)
+{
+  release_string(&config->realtime.scheduler);
+  release_string(&config->realtime.cpu_affinity);
+  release_string(&config->push_socket);
+  release_string(&config->state_directory);
+
+  for (int i = 0; i < config->num_sources; i++) {
+    release_string(&config->source[i].name);
+    release_string(&config->source[i].type);
+    release_string(&config->source[i].driver);
+    release_string(&config->source[i].pci_id);
+    release_string(&config->source[i].device_id);
+
+    for (int j = 0; j < config->source[i].num_sensors; j++) {
+      release_string(&config->source[i].sensor[j].name);
+      release_string(&config->source[i].sensor[j].label);
+    }
+  }
+
+  for (int i = 0; i < config->num_fans; i++) {
+    release_string(&config->fan[i].name);
+    release_string(&config->fan[i].template);
+    release_string(&config->fan[i].device_id);
+    release_string(&config->fan[i].pwm_file);
+    release_string(&config->fan[i].curve_name);
+  }
+
+  for (int i = 0; i < config->num_curves; i++) {
+    release_string(&config->curve[i].name);
+    release_string(&config->curve[i].template);
+    release_string(&config->curve[i].sensor);
+    release_string(&config->curve[i].autotune);
+  }
+
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    struct custom_sensor_config *custom = &config->custom_sensor[i];
+
+    release_string(&custom->name);
+    release_string(&custom->type);
+    if (custom->type_opts_key == NULL) continue;
+
+    if (strcmp(custom->type_opts_key, "sensors") == 0) {
+      for (int j = 0; j < custom->type_opts.max.num_sensors; j++) {
+        release_string(&custom->type_opts.max.sensor[j].name);
+      }
+    }
+    else if (strcmp(custom->type_opts_key, "path") == 0) {
+      release_string(&custom->type_opts.file.path);
+    }
+    else if (strcmp(custom->type_opts_key, "formula") == 0) {
+      release_string(&custom->type_opts.expr.formula);
+    }
+    else if (strcmp(custom->type_opts_key, "command") == 0) {
+      release_string(&custom->type_opts.exec.command);
+    }
+  }
+
+  for (int i = 0; i < config->num_pressure_triggers; i++) {
+    release_string(&config->pressure_trigger[i].path);
+    release_string(&config->pressure_trigger[i].type);
+    for (int j = 0; j < config->pressure_trigger[i].num_fans; j++) {
+      release_string(&config->pressure_trigger[i].fan[j].name);
+    }
+  }
+
+  // Entries point at the names released above
+  name_table_free(&config->names);
+}
+
 void free_config(struct config *config)
 {
+  free(config->realtime.scheduler);
+  free(config->realtime.cpu_affinity);
+  free(config->push_socket);
+  free(config->state_directory);
+
   for (int i = 0; i < config->num_sources; i++) {
     free(config->source[i].name);
+    free(config->source[i].type);
     free(config->source[i].driver);
+    free(config->source[i].pci_id);
     free(config->source[i].device_id);
 
     for (int j = 0; j < config->source[i].num_sensors; j++) {
       free(config->source[i].sensor[j].name);
+      free(config->source[i].sensor[j].label);
     }
     free(config->source[i].sensor);
   }
@@ -456,57 +942,76 @@ void free_config(struct config *config)
 
   for (int i = 0; i < config->num_fans; i++) {
     free(config->fan[i].name);
+    free(config->fan[i].template);
     free(config->fan[i].device_id);
     free(config->fan[i].pwm_file);
+    free(config->fan[i].curve_name);
   }
   free(config->fan);
 
   for (int i = 0; i < config->num_curves; i++) {
     free(config->curve[i].name);
+    free(config->curve[i].template);
     free(config->curve[i].graph_point);
     free(config->curve[i].sensor);
+    free(config->curve[i].autotune);
   }
   free(config->curve);
 
   for (int i = 0; i < config->num_custom_sensors; i++) {
-    free(config->custom_sensor[i].name);
-    if (strcmp(config->custom_sensor[i].type, "max") == 0) {
-      for (int j = 0; j < config->custom_sensor[i].type_opts.max.num_sensors; j++) {
-        free(config->custom_sensor[i].type_opts.max.sensor[j].name);
+    struct custom_sensor_config *custom = &config->custom_sensor[i];
+
+    free(custom->name);
+    free(custom->type);
+    if (custom->type_opts_key == NULL) continue;
+
+    if (strcmp(custom->type_opts_key, "sensors") == 0) {
+      for (int j = 0; j < custom->type_opts.max.num_sensors; j++) {
+        free(custom->type_opts.max.sensor[j].name);
       }
-      free(config->custom_sensor[i].type_opts.max.sensor);
+      free(custom->type_opts.max.sensor);
+    }
+    else if (strcmp(custom->type_opts_key, "path") == 0) {
+      free(custom->type_opts.file.path);
+    }
+    else if (strcmp(custom->type_opts_key, "formula") == 0) {
+      free(custom->type_opts.expr.formula);
+      expr_free(&custom->type_opts.expr.program);
+      free(custom->type_opts.expr.slot);
     }
-    else if (strcmp(config->custom_sensor[i].type, "file") == 0) {
-      free(config->custom_sensor[i].type_opts.file.path);
+    else if (strcmp(custom->type_opts_key, "command") == 0) {
+      free(custom->type_opts.exec.command);
     }
-    free(config->custom_sensor[i].type);
   }
   free(config->custom_sensor);
+
+  for (int i = 0; i < config->num_pressure_triggers; i++) {
+    free(config->pressure_trigger[i].path);
+    free(config->pressure_trigger[i].type);
+    for (int j = 0; j < config->pressure_trigger[i].num_fans; j++) {
+      free(config->pressure_trigger[i].fan[j].name);
+    }
+    free(config->pressure_trigger[i].fan);
+  }
+  free(config->pressure_trigger);
+
+  name_table_free(&config->names);
 }
 
 int load_config(const char *path, struct config *config)
 {
-  cJSON *json = parse_config(path);
-  if (!json) return -1;
-
-  int (*function[])(cJSON*, struct config*) = {
-    configure_general,
-    configure_sources,
-    configure_curves,
-    configure_custom_sensors,
-    configure_fans,
-  };
+  struct json_reader reader;
+  if (json_open(&reader, path) < 0) return -1;
 
-  int num_funcs = sizeof(function) / sizeof(function[0]);
-
-  for (int i = 0; i < num_funcs; i++) {
-    if (function[i](json, config)) {
-      cJSON_Delete(json);
-      return -1;
-    }
+  int ret = configure_general(&reader, config);
+  if (ret == 0 && json_next(&reader) != JSON_EOF) {
+    ret = -1;
   }
 
-  cJSON_Delete(json);
+  json_close(&reader);
+  if (ret < 0) return -1;
 
-  return 0;
+  if (expand_templates(config) < 0) return -1;
+
+  return link_config(config);
 }
@@ -3,14 +3,30 @@
 
 #include <stdbool.h>
 
+#include "expr.h"
+#include "names.h"
+
+struct filter_config {
+  float ema_alpha;
+  float median_window;
+  float max_slew;
+};
+
 struct sensor_config {
   char *name;
+  // hwmon label or gpu_metrics field, when it differs from the name
+  char *label;
   float offset;
+  int slot;
+
+  struct filter_config filter;
 };
 
 struct source_config {
   char *name;
+  char *type;
   char *driver;
+  char *pci_id;
   char *device_id;
   float scale;
 
@@ -20,12 +36,15 @@ struct source_config {
 
 struct fan_config {
   char *name;
+  char *template;
   char *device_id;
   char *pwm_file;
   float min_pwm;
   float max_pwm;
   bool zero_rpm;
+  float pwm_deadband;
 
+  char *curve_name;
   struct curve_config *curve;
 };
 
@@ -36,37 +55,104 @@ struct graph_point {
 
 struct curve_config {
   char *name;
+  char *template;
 
   struct graph_point *graph_point;
   int num_points;
 
   char *sensor;
+  int sensor_slot;
 
   float hysteresis;
   float response_time;
+
+  float failsafe_ticks;
+  bool has_failsafe_ticks;
+  float failsafe_percent;
+
+  // "suggest" or "apply" hysteresis and response time from a fitted model
+  char *autotune;
+  float overshoot;
 };
 
 struct file_sensor_config {
   char *path;
 };
 
+struct power_sensor_config {
+  char *path;
+};
+
+struct exec_sensor_config {
+  char *command;
+};
+
+struct push_sensor_config {
+  float max_age;
+};
+
 struct max_sensor_config {
   struct sensor_config *sensor;
   int num_sensors;
 };
 
+struct expr_sensor_config {
+  char *formula;
+  struct expr_program program;
+  int *slot;
+};
+
 struct custom_sensor_config {
   char *name;
   char *type;
+  int slot;
 
+  struct filter_config filter;
+
+  // Key that filled type_opts, which may be read before the type itself
+  const char *type_opts_key;
   union {
     struct file_sensor_config file; 
     struct max_sensor_config max; 
+    struct expr_sensor_config expr;
+    struct power_sensor_config power;
+    struct push_sensor_config push;
+    struct exec_sensor_config exec;
   } type_opts;
 };
 
+struct fan_ref {
+  char *name;
+  int index;
+};
+
+struct pressure_config {
+  char *path;
+  char *type;
+  float stall;
+  float window;
+
+  float fan_percent;
+  float hold;
+
+  struct fan_ref *fan;
+  int num_fans;
+};
+
+struct realtime_config {
+  char *scheduler;
+  float priority;
+  float runtime;
+  char *cpu_affinity;
+  bool lock_memory;
+};
+
 struct config {
   float interval;
+  char *push_socket;
+  float pwm_writes_per_second;
+  char *state_directory;
+  struct realtime_config realtime;
 
   struct source_config *source;
   int num_sources;
@@ -79,9 +165,18 @@ struct config {
 
   struct custom_sensor_config *custom_sensor;
   int num_custom_sensors;
+
+  struct pressure_config *pressure_trigger;
+  int num_pressure_triggers;
+
+  struct name_table names;
+  int num_source_sensors;
+  int num_sensor_slots;
 };
 
 int load_config(const char *path, struct config *config);
+void config_release_strings(struct config *config);
+const char *sensor_label(const struct sensor_config *sensor);
 void free_config(struct config *config);
 
 #endif
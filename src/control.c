@@ -7,61 +7,113 @@
 #include <unistd.h>
 
 #include "control.h"
+#include "autotune.h"
+#include "batch.h"
 #include "config.h"
+#include "exec.h"
+#include "expr.h"
+#include "guardian.h"
+#include "hotplug.h"
+#include "hwmon.h"
+#include "power.h"
+#include "psi.h"
+#include "push.h"
+#include "suspend.h"
+#include "writer.h"
 
-#define ROUNDING_FLOAT 0.5F
-#define EPSILON 0.0001F
 #define TEMP_INPUT_SIZE 32
+#define NS_PER_SEC 1000000000L
 
 struct custom_sensor_data {
-  struct app_sensor *sensor;
+  struct app_sensor **sensor;
   float *offset;
   int num_sensors;
 };
 
 struct file_sensor_data {
-  char *path;
   int fildes;
 };
 
+struct expr_sensor_data {
+  const struct expr_program *program;
+  struct app_sensor **sensor;
+  float *input;
+  float *stack;
+  struct expr_ddt *ddt;
+};
+
+// Derived sensors fail with the first input that fails, keeping their last
+// good value, so the curves using them see the failure too
+static int read_input(struct app_sensor *self, struct app_sensor *input)
+{
+  if (read_sensor(input, self->tick, &self->timestamp) < 0) {
+    errno = input->error;
+    return -1;
+  }
+
+  return 0;
+}
+
 static int get_max_temp(struct app_sensor *self)
 {
   struct custom_sensor_data *data = self->sensor_data;
 
-  data->sensor[0].get_temp_func(&data->sensor[0]);
-  self->current_value = data->sensor[0].current_value + data->offset[0];
+  if (read_input(self, data->sensor[0]) < 0) return -1;
+  float value = data->sensor[0]->current_value + data->offset[0];
 
   for (int i = 1; i < data->num_sensors; i++) {
-    data->sensor[i].get_temp_func(&data->sensor[i]);
-    self->current_value = data->sensor[i].current_value + data->offset[i] > self->current_value
-      ? data->sensor[i].current_value + data->offset[i]
-      : self->current_value;
+    if (read_input(self, data->sensor[i]) < 0) return -1;
+    value = data->sensor[i]->current_value + data->offset[i] > value
+      ? data->sensor[i]->current_value + data->offset[i]
+      : value;
   }
 
+  self->current_value = value;
+
   return 0;
 }
 
-int link_curve_sensors(struct app_context *app_context)
+static int get_expr_temp(struct app_sensor *self)
 {
-  for (int i = 0; i < app_context->num_fans; i++) {
-    for (int j = 0; j < app_context->num_sensors; j++) {
-      if (strcmp(app_context->fan[i].curve->config->sensor, app_context->sensor[j].name) != 0) {
-        if (j == app_context->num_sensors - 1) {
-          (void)fprintf(stderr, "No sensor \"%s\" found for curve \"%s\"\n",
-                        app_context->fan[i].curve->config->sensor,
-                        app_context->fan[i].curve->config->name);
-          return -1;
-        }
-        continue;
-      }
-      app_context->fan[i].curve->sensor = &app_context->sensor[j];
-      break;
-    }
+  struct expr_sensor_data *data = self->sensor_data;
+
+  for (int i = 0; i < data->program->num_names; i++) {
+    if (read_input(self, data->sensor[i]) < 0) return -1;
+    data->input[i] = data->sensor[i]->current_value;
   }
 
+  float value = expr_eval(data->program, data->input, data->stack, data->ddt, &self->timestamp);
+  if (!isfinite(value)) {
+    errno = EDOM;
+    return -1;
+  }
+
+  self->current_value = value;
+
   return 0;
 }
 
+int read_sensor(struct app_sensor *sensor, unsigned int tick, const struct timespec *now)
+{
+  if (sensor->tick == tick) {
+    return sensor->status;
+  }
+
+  sensor->tick = tick;
+  sensor->timestamp = *now;
+  sensor->status = sensor->get_temp_func(sensor);
+  if (sensor->status < 0) {
+    sensor->error = errno;
+    return sensor->status;
+  }
+
+  if (sensor->filter.config) {
+    sensor->current_value = filter_apply(&sensor->filter, sensor->current_value, now);
+  }
+
+  return sensor->status;
+}
+
 int file_read_temp(struct app_sensor *self)
 {
   struct file_sensor_data *data = self->sensor_data;
@@ -69,7 +121,6 @@ int file_read_temp(struct app_sensor *self)
   char temp_input_string[TEMP_INPUT_SIZE];
   ssize_t nread = pread(data->fildes, temp_input_string, TEMP_INPUT_SIZE - 1, 0);
   if (nread < 0) {
-    (void)fprintf(stderr, "Error: couldn't read %s: %s\n", data->path, strerror(errno));
     return -1;
   }
   
@@ -80,107 +131,175 @@ int file_read_temp(struct app_sensor *self)
   return 0;
 }
 
-static int link_sensor_array(struct app_context *app_context,
-                      struct custom_sensor_config *config)
+static int link_sensor_array(struct app_context *app_context, struct app_sensor *sensor,
+                             struct custom_sensor_config *config)
 {
-  struct custom_sensor_data *data = malloc(sizeof(*data));
-  if (!data) {
-    perror("Failed to allocate custom_sensor_data");
-    return -1;
-  }
-  data->sensor = calloc(config->type_opts.max.num_sensors, sizeof(*data->sensor));
-  if (!data->sensor) {
-    perror("Failed to allocate sensor_config array");
-    return -1;
-  }
-  data->offset = calloc(config->type_opts.max.num_sensors, sizeof(*data->offset));
-  if (!data->offset) {
-    perror("Failed to allocate offset array");
-    return -1;
-  }
-  data->num_sensors = config->type_opts.max.num_sensors;
+  struct arena *arena = &app_context->arena;
+  int num_sensors = config->type_opts.max.num_sensors;
 
-  int count = 0;
-  for (int i = 0; i < config->type_opts.max.num_sensors; i++) {
-    for (int j = 0; j < app_context->num_sensors; j++) {
-      if (strcmp(config->type_opts.max.sensor[i].name, app_context->sensor[j].name) != 0) {
-        if (j == app_context->num_sensors - 1) {
-          (void)fprintf(stderr, "Couldn't find sensor \"%s\" for \"%s\"\n",
-                        config->type_opts.max.sensor[i].name, config->name);
-          return -1;
-        }
-        continue;
-      }
-      data->sensor[count] = app_context->sensor[j];
-      data->offset[count] = config->type_opts.max.sensor[i].offset;
-      count++;
+  struct custom_sensor_data *data = arena_alloc(arena, 1, sizeof(*data));
+  if (!data) return -1;
+  sensor->sensor_data = data;
 
-      break;
-    }
-  }
+  data->sensor = arena_alloc(arena, num_sensors, sizeof(*data->sensor));
+  data->offset = arena_alloc(arena, num_sensors, sizeof(*data->offset));
+  if (!data->sensor || !data->offset) return -1;
+  data->num_sensors = num_sensors;
 
-  app_context->sensor[app_context->num_sensors].sensor_data = data;
+  for (int i = 0; i < num_sensors; i++) {
+    data->sensor[i] = &app_context->sensor[config->type_opts.max.sensor[i].slot];
+    data->offset[i] = config->type_opts.max.sensor[i].offset;
+  }
 
   return 0;
 }
 
-int link_file_path(struct app_context *app_context,
+static size_t max_arena_size(const struct custom_sensor_config *config)
+{
+  int num_sensors = config->type_opts.max.num_sensors;
+
+  return arena_size(1, sizeof(struct custom_sensor_data)) +
+         arena_size(num_sensors, sizeof(struct app_sensor *)) +
+         arena_size(num_sensors, sizeof(float));
+}
+
+static void destroy_file_sensor(struct app_sensor *self)
+{
+  struct file_sensor_data *data = self->sensor_data;
+
+  if (close(data->fildes) == -1) {
+    perror("close");
+  }
+}
+
+int link_file_path(struct app_context *app_context, struct app_sensor *sensor,
                    struct custom_sensor_config *config)
 {
-  struct file_sensor_data *data = malloc(sizeof(*data));
+  const char *path = config->type_opts.file.path;
 
-  data->path = config->type_opts.file.path;
+  struct file_sensor_data *data = arena_alloc(&app_context->arena, 1, sizeof(*data));
+  if (!data) return -1;
 
-  data->fildes = open(data->path, O_RDONLY);
+  data->fildes = open(path, O_RDONLY | O_CLOEXEC);
   if (data->fildes < 0) {
-    (void)fprintf(stderr, "Failed to open %s: %s\n", data->path, strerror(errno));
+    (void)fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
     return -1;
   }
 
-  app_context->sensor[app_context->num_sensors].sensor_data = data;
+  sensor->sensor_data = data;
+  sensor->destroy_func = destroy_file_sensor;
 
   return 0;
 }
 
-static int match_sensor_type(struct custom_sensor_config *config, struct app_context *app_context)
+static size_t file_arena_size(const struct custom_sensor_config *config)
 {
-  struct {
-    const char *name;
-    int (*get_temp_func)(struct app_sensor *self);
-    int (*setup_func)(struct app_context *app_context, struct custom_sensor_config *config);
+  (void)config;
+
+  return arena_size(1, sizeof(struct file_sensor_data));
+}
+
+static int link_expr_sensors(struct app_context *app_context, struct app_sensor *sensor,
+                             struct custom_sensor_config *config)
+{
+  struct arena *arena = &app_context->arena;
+  const struct expr_program *program = &config->type_opts.expr.program;
+
+  struct expr_sensor_data *data = arena_alloc(arena, 1, sizeof(*data));
+  if (!data) return -1;
+  sensor->sensor_data = data;
+
+  data->program = program;
+  data->sensor = arena_alloc(arena, program->num_names, sizeof(*data->sensor));
+  data->input = arena_alloc(arena, program->num_names, sizeof(*data->input));
+  data->stack = arena_alloc(arena, program->max_depth, sizeof(*data->stack));
+  data->ddt = arena_alloc(arena, program->num_ddt, sizeof(*data->ddt));
+  if ((program->num_names && (!data->sensor || !data->input)) ||
+      !data->stack || (program->num_ddt && !data->ddt))
+  {
+    return -1;
+  }
+
+  for (int i = 0; i < program->num_names; i++) {
+    data->sensor[i] = &app_context->sensor[config->type_opts.expr.slot[i]];
   }
-  type[] = {
-    {"max", get_max_temp, link_sensor_array},
-    {"file", file_read_temp, link_file_path},
-  };
 
-  for (int i = 0; i < (int)(sizeof(type) / sizeof(type[i])); i++) {
-    if (strcmp(config->type, type[i].name) == 0) {
-      app_context->sensor[app_context->num_sensors].get_temp_func = type[i].get_temp_func;
-      return type[i].setup_func(app_context, config);
+  return 0;
+}
+
+static size_t expr_arena_size(const struct custom_sensor_config *config)
+{
+  const struct expr_program *program = &config->type_opts.expr.program;
+
+  return arena_size(1, sizeof(struct expr_sensor_data)) +
+         arena_size(program->num_names, sizeof(struct app_sensor *)) +
+         arena_size(program->num_names, sizeof(float)) +
+         arena_size(program->max_depth, sizeof(float)) +
+         arena_size(program->num_ddt, sizeof(struct expr_ddt));
+}
+
+static const struct {
+  const char *name;
+  int (*get_temp_func)(struct app_sensor *self);
+  int (*setup_func)(struct app_context *app_context, struct app_sensor *sensor,
+                    struct custom_sensor_config *config);
+  size_t (*size_func)(const struct custom_sensor_config *config);
+}
+sensor_type[] = {
+  {"max", get_max_temp, link_sensor_array, max_arena_size},
+  {"file", file_read_temp, link_file_path, file_arena_size},
+  {"expr", get_expr_temp, link_expr_sensors, expr_arena_size},
+  {"power", power_read_watts, link_power_sensor, power_arena_size},
+  {"push", push_read_temp, link_push_sensor, push_sensor_arena_size},
+  {"exec", exec_read_temp, link_exec_sensor, exec_arena_size},
+};
+
+static int find_sensor_type(const struct custom_sensor_config *config)
+{
+  for (int i = 0; i < (int)(sizeof(sensor_type) / sizeof(sensor_type[i])); i++) {
+    if (strcmp(config->type, sensor_type[i].name) == 0) {
+      return i;
     }
   }
 
-  (void)fprintf(stderr, "No custom sensor type \"%s\"\n", config->type);
   return -1;
 }
 
-int init_custom_sensors(struct config *config, struct app_context *app_context)
+static int match_sensor_type(struct custom_sensor_config *config, struct app_sensor *sensor,
+                             struct app_context *app_context)
 {
-  void *new_array = reallocarray(app_context->sensor,
-                                     app_context->num_sensors + config->num_custom_sensors,
-                                     sizeof(struct app_sensor));
-  if (!new_array) {
-    perror("Failed to reallocate app_sensor array");
+  int type = find_sensor_type(config);
+  if (type < 0) {
+    (void)fprintf(stderr, "No custom sensor type \"%s\"\n", config->type);
     return -1;
   }
-  app_context->sensor = new_array;
+
+  sensor->get_temp_func = sensor_type[type].get_temp_func;
+  return sensor_type[type].setup_func(app_context, sensor, config);
+}
+
+static size_t custom_sensors_arena_size(const struct config *config)
+{
+  size_t size = 0;
 
   for (int i = 0; i < config->num_custom_sensors; i++) {
-    app_context->sensor[app_context->num_sensors].name = config->custom_sensor[i].name;
-    app_context->sensor[app_context->num_sensors].config = &config->custom_sensor[i];
-    if (match_sensor_type(&config->custom_sensor[i], app_context) < 0) return -1;
-    app_context->num_sensors++;
+    int type = find_sensor_type(&config->custom_sensor[i]);
+    if (type >= 0) {
+      size += sensor_type[type].size_func(&config->custom_sensor[i]);
+    }
+  }
+
+  return size;
+}
+
+int init_custom_sensors(struct config *config, struct app_context *app_context)
+{
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    struct app_sensor *sensor = &app_context->sensor[config->custom_sensor[i].slot];
+
+    sensor->config = &config->custom_sensor[i];
+    if (filter_init(&sensor->filter, &config->custom_sensor[i].filter, sensor->name) < 0) return -1;
+    if (match_sensor_type(&config->custom_sensor[i], sensor, app_context) < 0) return -1;
   }
 
   return 0;
@@ -189,16 +308,257 @@ int init_custom_sensors(struct config *config, struct app_context *app_context)
 void destroy_custom_sensors(struct app_context *app_context)
 {
   for (int i = app_context->num_hwmon_sensors; i < app_context->num_sensors; i++) {
-    if (strcmp(((struct custom_sensor_config*)app_context->sensor[i].config)->type, "max") == 0) {
-      free(((struct custom_sensor_data*)app_context->sensor[i].sensor_data)->sensor);
-      free(((struct custom_sensor_data*)app_context->sensor[i].sensor_data)->offset);
+    if (app_context->sensor[i].sensor_data == NULL) continue;
+
+    if (app_context->sensor[i].destroy_func) {
+      app_context->sensor[i].destroy_func(&app_context->sensor[i]);
     }
-    free(app_context->sensor[i].sensor_data);
   }
-  free(app_context->sensor);
 }
 
-float linearly_interpolate(float temperature, struct graph_point *start, struct graph_point *end)
+static size_t names_arena_size(const struct config *config)
+{
+  size_t size = 0;
+
+  for (int i = 0; i < config->num_sources; i++) {
+    for (int j = 0; j < config->source[i].num_sensors; j++) {
+      size += arena_string_size(config->source[i].sensor[j].name);
+    }
+  }
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    size += arena_string_size(config->custom_sensor[i].name);
+  }
+  for (int i = 0; i < config->num_fans; i++) {
+    size += arena_string_size(config->fan[i].name);
+  }
+  for (int i = 0; i < config->num_curves; i++) {
+    size += arena_string_size(config->curve[i].name);
+  }
+
+  return size;
+}
+
+static int total_graph_points(const struct config *config)
+{
+  int num_points = 0;
+
+  for (int i = 0; i < config->num_curves; i++) {
+    num_points += config->curve[i].num_points;
+  }
+
+  return num_points;
+}
+
+static size_t state_arena_size(const struct config *config)
+{
+  size_t num_curves = config->num_curves;
+  size_t num_fans = config->num_fans;
+
+  return arena_size(config->num_sensor_slots, sizeof(struct app_sensor)) +
+         arena_size(num_curves, sizeof(struct curve_config *)) +
+         arena_size(num_curves, sizeof(char *)) +
+         arena_size(num_curves, sizeof(int)) * 4 +
+         arena_size(total_graph_points(config) + 1, sizeof(struct graph_point)) +
+         arena_size(num_curves, sizeof(int32_t)) * 3 +
+         arena_size(num_curves, sizeof(float)) * 6 +
+         arena_size(num_curves, sizeof(struct timespec)) +
+         arena_size(num_curves, sizeof(unsigned int)) +
+         arena_size(num_curves, sizeof(bool)) * 2 +
+         arena_size(num_curves, sizeof(struct log_bucket)) +
+         arena_size(num_fans, sizeof(struct fan_config *)) +
+         arena_size(num_fans, sizeof(char *)) +
+         arena_size(num_fans, sizeof(struct hwmon_fan)) +
+         arena_size(num_fans, sizeof(int)) * 5 +
+         arena_size(num_fans, sizeof(struct log_bucket)) +
+         arena_size(num_fans, sizeof(int32_t)) * 2 +
+         arena_size(num_fans, sizeof(float)) * 5 +
+         arena_size(num_fans, sizeof(struct timespec)) +
+         arena_size(num_fans, sizeof(bool));
+}
+
+static int alloc_state(struct config *config, struct app_context *app_context)
+{
+  struct arena *arena = &app_context->arena;
+  struct curve_state *curve = &app_context->curve;
+  struct fan_state *fan = &app_context->fan;
+  int num_curves = config->num_curves;
+  int num_fans = config->num_fans;
+
+  app_context->sensor = arena_alloc(arena, config->num_sensor_slots, sizeof(*app_context->sensor));
+
+  curve->config = arena_alloc(arena, num_curves, sizeof(*curve->config));
+  curve->name = arena_alloc(arena, num_curves, sizeof(*curve->name));
+  curve->sensor = arena_alloc(arena, num_curves, sizeof(*curve->sensor));
+  curve->graph = arena_alloc(arena, total_graph_points(config) + 1, sizeof(*curve->graph));
+  curve->graph_base = arena_alloc(arena, num_curves, sizeof(*curve->graph_base));
+  curve->num_points = arena_alloc(arena, num_curves, sizeof(*curve->num_points));
+  curve->hysteresis = arena_alloc(arena, num_curves, sizeof(*curve->hysteresis));
+  curve->response_time = arena_alloc(arena, num_curves, sizeof(*curve->response_time));
+  curve->input = arena_alloc(arena, num_curves, sizeof(*curve->input));
+  curve->target = arena_alloc(arena, num_curves, sizeof(*curve->target));
+  curve->hold = arena_alloc(arena, num_curves, sizeof(*curve->hold));
+  curve->hyst_val = arena_alloc(arena, num_curves, sizeof(*curve->hyst_val));
+  curve->fan_percent = arena_alloc(arena, num_curves, sizeof(*curve->fan_percent));
+  curve->timer = arena_alloc(arena, num_curves, sizeof(*curve->timer));
+  curve->tick = arena_alloc(arena, num_curves, sizeof(*curve->tick));
+  curve->ready = arena_alloc(arena, num_curves, sizeof(*curve->ready));
+  curve->failures = arena_alloc(arena, num_curves, sizeof(*curve->failures));
+  curve->failsafe = arena_alloc(arena, num_curves, sizeof(*curve->failsafe));
+  curve->event = arena_alloc(arena, num_curves, sizeof(*curve->event));
+  curve->event_failures = arena_alloc(arena, num_curves, sizeof(*curve->event_failures));
+  curve->log = arena_alloc(arena, num_curves, sizeof(*curve->log));
+
+  fan->config = arena_alloc(arena, num_fans, sizeof(*fan->config));
+  fan->name = arena_alloc(arena, num_fans, sizeof(*fan->name));
+  fan->hwmon = arena_alloc(arena, num_fans, sizeof(*fan->hwmon));
+  fan->curve = arena_alloc(arena, num_fans, sizeof(*fan->curve));
+  fan->min_pwm = arena_alloc(arena, num_fans, sizeof(*fan->min_pwm));
+  fan->pwm_range = arena_alloc(arena, num_fans, sizeof(*fan->pwm_range));
+  fan->zero_rpm = arena_alloc(arena, num_fans, sizeof(*fan->zero_rpm));
+  fan->pwm_fildes = arena_alloc(arena, num_fans, sizeof(*fan->pwm_fildes));
+  fan->pwm_value = arena_alloc(arena, num_fans, sizeof(*fan->pwm_value));
+  fan->fan_percent = arena_alloc(arena, num_fans, sizeof(*fan->fan_percent));
+  fan->target_percent = arena_alloc(arena, num_fans, sizeof(*fan->target_percent));
+  fan->active = arena_alloc(arena, num_fans, sizeof(*fan->active));
+  fan->changed = arena_alloc(arena, num_fans, sizeof(*fan->changed));
+  fan->error = arena_alloc(arena, num_fans, sizeof(*fan->error));
+  fan->log = arena_alloc(arena, num_fans, sizeof(*fan->log));
+  fan->floor_percent = arena_alloc(arena, num_fans, sizeof(*fan->floor_percent));
+  fan->floor_until = arena_alloc(arena, num_fans, sizeof(*fan->floor_until));
+  fan->floor_applied = arena_alloc(arena, num_fans, sizeof(*fan->floor_applied));
+
+  if ((config->num_sensor_slots && !app_context->sensor) || !curve->graph ||
+      (num_curves && (!curve->config || !curve->name || !curve->sensor || !curve->graph_base ||
+                      !curve->num_points || !curve->hysteresis || !curve->response_time ||
+                      !curve->input ||
+                      !curve->target || !curve->hold || !curve->hyst_val ||
+                      !curve->fan_percent || !curve->timer || !curve->tick || !curve->ready ||
+                      !curve->failures || !curve->failsafe || !curve->event ||
+                      !curve->event_failures || !curve->log)) ||
+      (num_fans && (!fan->config || !fan->name || !fan->hwmon || !fan->curve ||
+                    !fan->min_pwm || !fan->pwm_range || !fan->zero_rpm ||
+                    !fan->pwm_fildes || !fan->pwm_value || !fan->fan_percent ||
+                    !fan->target_percent || !fan->active || !fan->changed || !fan->error ||
+                    !fan->log || !fan->floor_percent || !fan->floor_until || !fan->floor_applied)))
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int intern_names(struct config *config, struct app_context *app_context)
+{
+  struct arena *arena = &app_context->arena;
+
+  for (int i = 0; i < config->num_sources; i++) {
+    for (int j = 0; j < config->source[i].num_sensors; j++) {
+      struct sensor_config *sensor = &config->source[i].sensor[j];
+
+      app_context->sensor[sensor->slot].name = arena_strdup(arena, sensor->name);
+      if (!app_context->sensor[sensor->slot].name) return -1;
+    }
+  }
+
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    struct custom_sensor_config *sensor = &config->custom_sensor[i];
+
+    app_context->sensor[sensor->slot].name = arena_strdup(arena, sensor->name);
+    if (!app_context->sensor[sensor->slot].name) return -1;
+  }
+
+  for (int i = 0; i < config->num_fans; i++) {
+    app_context->fan.name[i] = arena_strdup(arena, config->fan[i].name);
+    if (!app_context->fan.name[i]) return -1;
+  }
+
+  for (int i = 0; i < config->num_curves; i++) {
+    app_context->curve.name[i] = arena_strdup(arena, config->curve[i].name);
+    if (!app_context->curve.name[i]) return -1;
+  }
+
+  return 0;
+}
+
+static void link_curves(struct config *config, struct app_context *app_context)
+{
+  struct curve_state *curve = &app_context->curve;
+  struct fan_state *fan = &app_context->fan;
+
+  int graph_base = 0;
+
+  for (int i = 0; i < config->num_curves; i++) {
+    const struct curve_config *curve_config = &config->curve[i];
+
+    curve->config[i] = curve_config;
+    curve->sensor[i] = curve_config->sensor_slot;
+    curve->hysteresis[i] = curve_config->hysteresis;
+    curve->response_time[i] = curve_config->response_time;
+
+    curve->graph_base[i] = graph_base;
+    curve->num_points[i] = curve_config->num_points;
+    memcpy(curve->graph + graph_base, curve_config->graph_point,
+           curve_config->num_points * sizeof(*curve->graph));
+    graph_base += curve_config->num_points;
+  }
+  app_context->num_curves = config->num_curves;
+
+  for (int i = 0; i < config->num_fans; i++) {
+    const struct fan_config *fan_config = &config->fan[i];
+
+    fan->config[i] = fan_config;
+    fan->curve[i] = (int)(fan_config->curve - config->curve);
+    fan->min_pwm[i] = fan_config->min_pwm;
+    fan->pwm_range[i] = fan_config->max_pwm - fan_config->min_pwm;
+    fan->zero_rpm[i] = fan_config->zero_rpm ? -1 : 0;
+    fan->pwm_fildes[i] = -1;
+    fan->hwmon[i].pwm_enable_fildes = -1;
+    fan->pwm_value[i] = -1;
+  }
+  app_context->num_fans = config->num_fans;
+}
+
+int init_app_context(struct config *config, struct app_context *app_context)
+{
+  size_t size = state_arena_size(config) +
+                names_arena_size(config) +
+                hwmon_arena_size(config) +
+                custom_sensors_arena_size(config) +
+                psi_arena_size(config) +
+                push_arena_size(config) +
+                hotplug_arena_size() +
+                suspend_arena_size() +
+                guardian_arena_size() +
+                writer_arena_size(config) +
+                autotune_arena_size(config);
+
+  if (arena_init(&app_context->arena, size) < 0) return -1;
+
+  if (alloc_state(config, app_context) < 0 || intern_names(config, app_context) < 0) {
+    (void)fprintf(stderr, "Failed to allocate runtime state\n");
+    return -1;
+  }
+
+  app_context->num_sensors = config->num_sensor_slots;
+  app_context->num_hwmon_sensors = config->num_source_sensors;
+  app_context->kernels = batch_select();
+  link_curves(config, app_context);
+
+  if (writer_init(config, app_context) < 0) {
+    (void)fprintf(stderr, "Failed to allocate runtime state\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void destroy_app_context(struct app_context *app_context)
+{
+  arena_free(&app_context->arena);
+  *app_context = (struct app_context) {0};
+}
+
+float linearly_interpolate(float temperature, const struct graph_point *start, const struct graph_point *end)
 {
   float fan_speed_range = end->fan_percent - start->fan_percent;
   float temp_range = end->temp - start->temp;
@@ -207,24 +567,24 @@ float linearly_interpolate(float temperature, struct graph_point *start, struct
   return start->fan_percent + (offset_from_last * fan_speed_range / temp_range);
 }
 
-float calculate_fan_percent(struct curve_config *curve, float temperature)
+float graph_lookup(const struct graph_point *graph_point, int num_points, float temperature)
 {
-  int high = curve->num_points - 1;
+  int high = num_points - 1;
   int low = 0;
 
-  if (temperature <= curve->graph_point[0].temp) {
-    return curve->graph_point[0].fan_percent;
+  if (temperature <= graph_point[0].temp) {
+    return graph_point[0].fan_percent;
   }
-  if (temperature >= curve->graph_point[curve->num_points - 1].temp) {
-    return curve->graph_point[curve->num_points - 1].fan_percent;
+  if (temperature >= graph_point[num_points - 1].temp) {
+    return graph_point[num_points - 1].fan_percent;
   }
 
   while (low <= high) {
     int mid = low + (high - low) / 2;
-    if (fabsf(temperature - curve->graph_point[mid].temp) < EPSILON) {
-      return curve->graph_point[mid].fan_percent;
+    if (fabsf(temperature - graph_point[mid].temp) < EPSILON) {
+      return graph_point[mid].fan_percent;
     }
-    if (temperature < curve->graph_point[mid].temp) {
+    if (temperature < graph_point[mid].temp) {
       high = mid - 1;
     }
     else {
@@ -233,17 +593,174 @@ float calculate_fan_percent(struct curve_config *curve, float temperature)
   }
 
   return
-  linearly_interpolate(temperature, &curve->graph_point[high], &curve->graph_point[low]);
+  linearly_interpolate(temperature, &graph_point[high], &graph_point[low]);
+}
+
+float calculate_fan_percent(const struct curve_config *curve, float temperature)
+{
+  return graph_lookup(curve->graph_point, curve->num_points, temperature);
 }
 
-int calculate_pwm_value(float fan_percent, struct fan_config *config)
+int scale_pwm(float fan_percent, float min_pwm, float pwm_range, bool zero_rpm)
 {
-  if (config->zero_rpm && fan_percent == 0) {
+  if (zero_rpm && fan_percent == 0) {
     return 0;
   }
 
   float percent_decimal = fan_percent / 100.0F;
-  float pwm_range = config->max_pwm - config->min_pwm;
 
-  return (int)(config->min_pwm + ((pwm_range * percent_decimal) + ROUNDING_FLOAT));
+  return (int)(min_pwm + ((pwm_range * percent_decimal) + ROUNDING_FLOAT));
+}
+
+int calculate_pwm_value(float fan_percent, const struct fan_config *config)
+{
+  return scale_pwm(fan_percent, config->min_pwm, config->max_pwm - config->min_pwm, config->zero_rpm);
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void record_event(struct curve_state *curve, int index, enum curve_event event, int failures)
+{
+  curve->event[index] = event;
+  curve->event_failures[index] = failures;
+}
+
+// Keeps the last good reading for up to "failsafe ticks" failed reads of the
+// curve's sensor, then commits the failsafe percent in the same tick,
+// bypassing hysteresis and response time. Returns true when it has set the
+// curve's fan percent.
+static bool apply_failure_policy(struct app_context *app_context, int index)
+{
+  struct curve_state *curve = &app_context->curve;
+  const struct curve_config *config = curve->config[index];
+  const struct app_sensor *sensor = &app_context->sensor[curve->sensor[index]];
+  int failures = curve->failures[index];
+
+  if (sensor->status >= 0) {
+    if (failures == 0) return false;
+
+    curve->failures[index] = 0;
+    record_event(curve, index, CURVE_SENSOR_RECOVERED, failures);
+    if (!curve->failsafe[index]) return false;
+
+    // Hysteresis around the reading from before the failure could otherwise
+    // hold the fans at the failsafe percent
+    curve->failsafe[index] = false;
+    curve->hyst_val[index] = curve->input[index];
+    curve->fan_percent[index] = curve->target[index];
+    curve->timer[index].tv_sec = 0;
+    return true;
+  }
+
+  curve->failures[index] = ++failures;
+  if ((float)failures <= config->failsafe_ticks) {
+    if (failures == 1) {
+      record_event(curve, index, CURVE_SENSOR_FAILED, failures);
+    }
+    return false;
+  }
+
+  if (!curve->failsafe[index]) {
+    record_event(curve, index, CURVE_FAILSAFE, failures);
+    curve->failsafe[index] = true;
+  }
+  curve->fan_percent[index] = config->failsafe_percent;
+  curve->timer[index].tv_sec = 0;
+
+  return true;
+}
+
+// Applies the response time to a curve whose new fan percent the batch
+// kernel has already computed
+static bool settle_curve(struct app_context *app_context, int index)
+{
+  struct curve_state *curve = &app_context->curve;
+  const struct timespec *clock = &app_context->clock;
+
+  if (curve->hold[index]) {
+    curve->timer[index].tv_sec = 0;
+    return false;
+  }
+
+  if (curve->response_time[index] > 0) {
+    if (curve->timer[index].tv_sec == 0) {
+      curve->timer[index] = *clock;
+      return false;
+    }
+
+    long elapsed = (clock->tv_sec - curve->timer[index].tv_sec) +
+                   (clock->tv_nsec - curve->timer[index].tv_nsec) / NS_PER_SEC;
+
+    if ((long)curve->response_time[index] > elapsed) {
+      return false;
+    }
+  }
+
+  curve->hyst_val[index] = curve->input[index];
+  curve->fan_percent[index] = curve->target[index];
+  curve->timer[index].tv_sec = 0;
+
+  return true;
+}
+
+// Runs one tick of the curves and fans at app_context->tick and ->clock,
+// leaving the fans to write in fan->changed after the writer has had its
+// say. Returns their number.
+int control_evaluate(struct app_context *app_context)
+{
+  struct curve_state *curve = &app_context->curve;
+  struct fan_state *fan = &app_context->fan;
+  const struct timespec *clock = &app_context->clock;
+  unsigned int tick = app_context->tick;
+
+  // Curves are evaluated at most once per tick, however many fans use them
+  for (int i = 0; i < app_context->num_fans; i++) {
+    int c = fan->curve[i];
+    if (curve->tick[c] == tick) continue;
+
+    struct app_sensor *sensor = &app_context->sensor[curve->sensor[c]];
+    read_sensor(sensor, tick, clock);
+    curve->input[c] = sensor->current_value;
+    curve->tick[c] = tick;
+  }
+
+  app_context->kernels->curves(curve, app_context->num_curves);
+
+  for (int c = 0; c < app_context->num_curves; c++) {
+    if (curve->tick[c] == tick) {
+      curve->ready[c] = apply_failure_policy(app_context, c) || settle_curve(app_context, c);
+    }
+  }
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    int c = fan->curve[i];
+
+    bool ready = curve->ready[c];
+    if (ready) {
+      fan->fan_percent[i] = curve->fan_percent[c];
+    }
+
+    bool floor = fan->floor_until[i].tv_sec != 0 && timespec_before(clock, &fan->floor_until[i]);
+    if (!floor) {
+      fan->floor_until[i].tv_sec = 0;
+    }
+    fan->active[i] = ready || floor || fan->floor_applied[i] ? -1 : 0;
+    if (!fan->active[i]) {
+      continue;
+    }
+    fan->floor_applied[i] = floor;
+
+    float fan_percent = fan->fan_percent[i];
+    if (floor && fan->floor_percent[i] > fan_percent) {
+      fan_percent = fan->floor_percent[i];
+    }
+    fan->target_percent[i] = fan_percent;
+  }
+
+  int num_changed = app_context->kernels->pwm(fan, app_context->num_fans);
+
+  return writer_schedule(app_context, num_changed);
 }
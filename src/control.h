@@ -2,60 +2,171 @@
 #define CONTROL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "arena.h"
 #include "config.h"
+#include "filter.h"
+#include "log.h"
+
+#define ROUNDING_FLOAT 0.5F
+#define EPSILON 0.0001F
 
 struct sensor_config;
 struct curve_config;
+struct batch_kernels;
 
 struct hwmon_fan;
+struct hwmon_source;
+struct psi_trigger;
+struct push_server;
+struct guardian;
+struct hotplug;
+struct suspend_monitor;
+struct handover;
+struct shadow;
+struct writer;
+struct autotune;
 
 struct app_sensor {
   const char *name;
   const void *config;
 
   int (*get_temp_func)(struct app_sensor *self);
+  void (*destroy_func)(struct app_sensor *self);
   void *sensor_data;
 
   float current_value;
   float target_value;
+
+  struct sensor_filter filter;
+
+  unsigned int tick;
+  int status;
+  int error;
+  struct timespec timestamp;
+
+  struct log_bucket log;
 };
 
-struct app_curve {
-  struct curve_config *config;
-  struct app_sensor *sensor;
+// A change in how a curve handles its sensor's failures, made during
+// evaluation and logged by report_errors() once the fans are written
+enum curve_event {
+  CURVE_EVENT_NONE,
+  CURVE_SENSOR_FAILED,
+  CURVE_FAILSAFE,
+  CURVE_SENSOR_RECOVERED
+};
 
-  float hyst_val;
-  struct timespec timer;
+// Curve and fan state is kept as parallel arrays indexed by curve and fan
+// number so the per-tick loops walk contiguous memory
+struct curve_state {
+  const struct curve_config **config;
+  const char **name;
+  int *sensor;
+
+  // Every graph back to back, with one spare point at the end, so the
+  // batch kernels can gather points by index
+  struct graph_point *graph;
+  int32_t *graph_base;
+  int32_t *num_points;
+  float *hysteresis;
+  float *response_time;
+
+  float *input;
+  float *target;
+  int32_t *hold;
+
+  float *hyst_val;
+  float *fan_percent;
+  struct timespec *timer;
+  unsigned int *tick;
+  bool *ready;
+
+  // Consecutive failed reads of the curve's sensor
+  int *failures;
+  bool *failsafe;
+  int *event;
+  // Failed reads when the event happened
+  int *event_failures;
+  struct log_bucket *log;
 };
 
-struct app_fan {
+struct fan_state {
+  const struct fan_config **config;
+  const char **name;
   struct hwmon_fan *hwmon;
-  struct fan_config *config;
-  struct app_curve *curve;
-
-  float fan_percent;
-  int pwm_value;
+  int *curve;
+
+  float *min_pwm;
+  float *pwm_range;
+  int32_t *zero_rpm;
+
+  int *pwm_fildes;
+  int *pwm_value;
+  float *fan_percent;
+  float *target_percent;
+  int32_t *active;
+  int *changed;
+  int *error;
+  struct log_bucket *log;
+
+  float *floor_percent;
+  struct timespec *floor_until;
+  bool *floor_applied;
 };
 
 struct app_context {
+  struct arena arena;
+  const struct batch_kernels *kernels;
+
   struct app_sensor *sensor;
   int num_sensors;
   int num_hwmon_sensors;
 
-  struct app_fan *fan;
+  struct hwmon_source *source;
+  int num_sources;
+
+  struct curve_state curve;
+  int num_curves;
+
+  struct fan_state fan;
   int num_fans;
 
+  struct psi_trigger *trigger;
+  int num_triggers;
+
+  struct push_server *push;
+  struct hotplug *hotplug;
+
+  struct suspend_monitor *suspend;
+  bool suspended;
+
+  // Only set while starting up from a previous instance's state
+  struct handover *handover;
+
+  struct shadow *shadow;
+  struct guardian *guardian;
+  struct writer *writer;
+  struct autotune *autotune;
+
+  unsigned int tick;
   struct timespec clock;
 };
 
+int init_app_context(struct config *config, struct app_context *app_context);
 int init_custom_sensors(struct config *config, struct app_context *app_context);
-int link_curve_sensors(struct app_context *app_context);
 
-float calculate_fan_percent(struct curve_config *curve, float temperature);
-int calculate_pwm_value(float fan_percent, struct fan_config *config);
+int read_sensor(struct app_sensor *sensor, unsigned int tick, const struct timespec *now);
+int control_evaluate(struct app_context *app_context);
+
+float graph_lookup(const struct graph_point *graph_point, int num_points, float temperature);
+float calculate_fan_percent(const struct curve_config *curve, float temperature);
+int scale_pwm(float fan_percent, float min_pwm, float pwm_range, bool zero_rpm);
+int calculate_pwm_value(float fan_percent, const struct fan_config *config);
 
 void destroy_custom_sensors(struct app_context *app_context);
+void destroy_app_context(struct app_context *app_context);
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Discovery of hwmon devices and their attributes. Backed by sd_device in
+// the default build and by plain sysfs walks with BACKEND=sysfs.
+
+// A hwmon class device
+struct device;
+struct device_monitor;
+
+enum device_action {
+  DEVICE_ADD,
+  DEVICE_REMOVE,
+  DEVICE_OTHER
+};
+
+// Collects the "+subsystem:sysname" ids of the devices bound to driver,
+// with the PCI "vendor:device" id pci_id and whose id matches the glob
+// device_id. NULL criteria match anything. Returns the number of ids, in
+// no particular order, which the caller frees along with the array.
+int device_enumerate(const char *driver, const char *pci_id, const char *device_id,
+                     char ***device_ids);
+
+struct device *device_find_hwmon(const char *device_id);
+int device_resolve_id(const char *device_id, char *syspath, size_t size);
+struct device *device_unref(struct device *device);
+void device_unrefp(struct device **device);
+
+const char *device_syspath(struct device *device);
+bool device_parent_matches(struct device *device, const char *device_id);
+
+// Attribute names and values are valid until the next call on the same
+// device
+const char *device_attr_first(struct device *device);
+const char *device_attr_next(struct device *device);
+int device_attr_read(struct device *device, const char *attr, const char **value);
+
+// Reports hwmon add and remove events; the device passed to the callback
+// is only valid during the call
+int device_monitor_new(struct device_monitor **monitor);
+int device_monitor_fd(struct device_monitor *monitor);
+int device_monitor_receive(struct device_monitor *monitor,
+                           void (*callback)(void *userdata, enum device_action action,
+                                            struct device *device),
+                           void *userdata);
+void device_monitor_free(struct device_monitor *monitor);
+
+#endif
@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <linux/limits.h>
+#include <linux/netlink.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "device.h"
+
+#define SYSFS_HWMON "/sys/class/hwmon"
+#define ATTR_VALUE_SIZE 4096
+#define UEVENT_BUFFER_SIZE 8192
+
+// Multicast groups of kernel uevents and of the ones udev re-sends after
+// running its rules, which is when the pwm files become writable for us
+#define UEVENT_GROUP_KERNEL 1
+#define UEVENT_GROUP_UDEV 2
+#define UDEV_PREFIX "libudev"
+// Offset of the properties offset in udev's message header
+#define UDEV_PROPERTIES_OFF 16
+
+struct device {
+  char syspath[PATH_MAX];
+
+  DIR *dir;
+  char value[ATTR_VALUE_SIZE];
+};
+
+struct device_monitor {
+  int fildes;
+};
+
+static struct device *device_new(const char *syspath)
+{
+  struct device *device = calloc(1, sizeof(*device));
+  if (!device) {
+    perror("Failed to allocate device");
+    return NULL;
+  }
+
+  if (snprintf(device->syspath, sizeof(device->syspath), "%s", syspath) >= (int)sizeof(device->syspath)) {
+    (void)fprintf(stderr, "Path truncated: %s\n", syspath);
+    free(device);
+    return NULL;
+  }
+
+  return device;
+}
+
+// Only "+subsystem:sysname" ids are supported, which covers the "+pci:"
+// and "+platform:" devices hwmon chips hang off
+int device_resolve_id(const char *device_id, char *syspath, size_t size)
+{
+  const char *sysname = device_id[0] == '+' ? strchr(device_id, ':') : NULL;
+  if (!sysname) {
+    (void)fprintf(stderr, "Unsupported device ID \"%s\", expected \"+subsystem:sysname\"\n", device_id);
+    return -1;
+  }
+
+  int subsystem_len = (int)(sysname - device_id - 1);
+  sysname++;
+
+  static const char *const formats[] = {"/sys/bus/%.*s/devices/%s", "/sys/class/%.*s/%s"};
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    char link[PATH_MAX];
+    if (snprintf(link, sizeof(link), formats[i], subsystem_len, device_id + 1, sysname) >= (int)sizeof(link)) {
+      continue;
+    }
+
+    char path[PATH_MAX];
+    if (realpath(link, path) == NULL) continue;
+
+    if (snprintf(syspath, size, "%s", path) >= (int)size) {
+      (void)fprintf(stderr, "Path truncated: %s\n", path);
+      return -1;
+    }
+    return 0;
+  }
+
+  (void)fprintf(stderr, "failed to find device ID \"%s\": %s\n", device_id, strerror(ENODEV));
+  return -1;
+}
+
+static bool pci_id_matches(const char *syspath, unsigned int vendor, unsigned int product)
+{
+  static const char *const attrs[] = {"vendor", "device"};
+  const unsigned int wanted[] = {vendor, product};
+
+  for (int k = 0; k < 2; k++) {
+    char path[PATH_MAX];
+    char value[sizeof("0xffff\n")] = {0};
+    if (snprintf(path, sizeof(path), "%s/%s", syspath, attrs[k]) >= (int)sizeof(path)) return false;
+
+    int fildes = open(path, O_RDONLY | O_CLOEXEC);
+    if (fildes < 0) return false;
+    ssize_t nread = read(fildes, value, sizeof(value) - 1);
+    (void)close(fildes);
+
+    if (nread <= 0 || strtoul(value, NULL, 16) != wanted[k]) return false;
+  }
+
+  return true;
+}
+
+static bool driver_matches(const char *syspath, const char *driver)
+{
+  char path[PATH_MAX];
+  char target[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/driver", syspath) >= (int)sizeof(path)) return false;
+
+  ssize_t len = readlink(path, target, sizeof(target) - 1);
+  if (len < 0) return false;
+  target[len] = '\0';
+
+  const char *name = strrchr(target, '/');
+  return strcmp(name ? name + 1 : target, driver) == 0;
+}
+
+static int add_device_id(char ***device_ids, int *count, const char *subsystem, const char *sysname)
+{
+  char **grown = reallocarray(*device_ids, *count + 1, sizeof(**device_ids));
+  if (!grown) {
+    perror("reallocarray");
+    return -1;
+  }
+  *device_ids = grown;
+
+  if (asprintf(&grown[*count], "+%s:%s", subsystem, sysname) < 0) {
+    perror("asprintf");
+    return -1;
+  }
+  (*count)++;
+
+  return 0;
+}
+
+// Scans one bus, or class for subsystems that are not buses
+static int enumerate_subsystem(const char *subsystem, const char *pattern, const char *driver,
+                               const unsigned int *pci_id, char ***device_ids, int *count)
+{
+  char dir_path[PATH_MAX];
+  (void)snprintf(dir_path, sizeof(dir_path), "/sys/bus/%s/devices", subsystem);
+
+  DIR *dir = opendir(dir_path);
+  if (!dir) {
+    (void)snprintf(dir_path, sizeof(dir_path), "/sys/class/%s", subsystem);
+    dir = opendir(dir_path);
+  }
+  if (!dir) return 0;
+
+  int ret = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    if (pattern && fnmatch(pattern, entry->d_name, 0) != 0) continue;
+
+    char syspath[PATH_MAX];
+    if (snprintf(syspath, sizeof(syspath), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(syspath)) {
+      continue;
+    }
+    if (pci_id && !pci_id_matches(syspath, pci_id[0], pci_id[1])) continue;
+    if (driver && !driver_matches(syspath, driver)) continue;
+
+    ret = add_device_id(device_ids, count, subsystem, entry->d_name);
+    if (ret < 0) break;
+  }
+
+  (void)closedir(dir);
+  return ret;
+}
+
+static int enumerate(const char *driver, const char *pci_id, const char *device_id,
+                     char ***device_ids, int *count)
+{
+  unsigned int ids[2];
+  const char *subsystem = NULL;
+  const char *pattern = NULL;
+  char subsystem_buffer[NAME_MAX];
+
+  if (pci_id) {
+    if (sscanf(pci_id, "%x:%x", &ids[0], &ids[1]) != 2) {
+      (void)fprintf(stderr, "Config error: invalid pci id \"%s\"\n", pci_id);
+      return -1;
+    }
+    subsystem = "pci";
+  }
+
+  if (device_id) {
+    pattern = device_id[0] == '+' ? strchr(device_id, ':') : NULL;
+    if (!pattern) {
+      (void)fprintf(stderr, "Config error: device id pattern \"%s\" is not \"+subsystem:sysname\"\n",
+                    device_id);
+      return -1;
+    }
+
+    if (snprintf(subsystem_buffer, sizeof(subsystem_buffer), "%.*s",
+                 (int)(pattern - device_id - 1), device_id + 1) >= (int)sizeof(subsystem_buffer))
+    {
+      (void)fprintf(stderr, "Config error: device id pattern \"%s\" is too long\n", device_id);
+      return -1;
+    }
+    pattern++;
+
+    // A pci id only ever matches pci devices
+    if (subsystem && strcmp(subsystem, subsystem_buffer) != 0) return 0;
+    subsystem = subsystem_buffer;
+  }
+
+  const unsigned int *pci_ids = pci_id ? ids : NULL;
+  if (subsystem) {
+    return enumerate_subsystem(subsystem, pattern, driver, pci_ids, device_ids, count);
+  }
+
+  // Only a driver was given, so look at every bus
+  DIR *dir = opendir("/sys/bus");
+  if (!dir) {
+    perror("Failed to read /sys/bus");
+    return -1;
+  }
+
+  int ret = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL && ret == 0) {
+    if (entry->d_name[0] == '.') continue;
+    ret = enumerate_subsystem(entry->d_name, NULL, driver, NULL, device_ids, count);
+  }
+
+  (void)closedir(dir);
+  return ret;
+}
+
+int device_enumerate(const char *driver, const char *pci_id, const char *device_id,
+                     char ***device_ids)
+{
+  *device_ids = NULL;
+  int count = 0;
+
+  if (enumerate(driver, pci_id, device_id, device_ids, &count) < 0) {
+    for (int k = 0; k < count; k++) {
+      free((*device_ids)[k]);
+    }
+    free(*device_ids);
+    *device_ids = NULL;
+    return -1;
+  }
+
+  return count;
+}
+
+// True when the hwmon device's "device" link points at the parent or
+// one of its children
+static bool below_parent(const char *syspath, const char *parent)
+{
+  char link[PATH_MAX];
+  char path[PATH_MAX];
+
+  if (snprintf(link, sizeof(link), "%s/device", syspath) >= (int)sizeof(link)) return false;
+  if (realpath(link, path) == NULL) return false;
+
+  size_t len = strlen(parent);
+  return strncmp(path, parent, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+struct device *device_find_hwmon(const char *device_id)
+{
+  char parent[PATH_MAX];
+  if (device_resolve_id(device_id, parent, sizeof(parent)) < 0) return NULL;
+
+  struct dirent **entries;
+  int num_entries = scandir(SYSFS_HWMON, &entries, NULL, versionsort);
+  if (num_entries < 0) {
+    (void)fprintf(stderr, "Failed to read %s: %s\n", SYSFS_HWMON, strerror(errno));
+    return NULL;
+  }
+
+  struct device *device = NULL;
+  for (int i = 0; i < num_entries; i++) {
+    char link[PATH_MAX];
+    char syspath[PATH_MAX];
+
+    if (!device && entries[i]->d_name[0] != '.' &&
+        snprintf(link, sizeof(link), SYSFS_HWMON "/%s", entries[i]->d_name) < (int)sizeof(link) &&
+        realpath(link, syspath) != NULL && below_parent(syspath, parent))
+    {
+      device = device_new(syspath);
+    }
+    free(entries[i]);
+  }
+  free(entries);
+
+  if (!device) {
+    (void)fprintf(stderr, "Error: no hwmon device for PCI device \"%s\"\n", device_id);
+  }
+
+  return device;
+}
+
+struct device *device_unref(struct device *device)
+{
+  if (!device) return NULL;
+
+  if (device->dir) (void)closedir(device->dir);
+  free(device);
+
+  return NULL;
+}
+
+void device_unrefp(struct device **device)
+{
+  device_unref(*device);
+}
+
+const char *device_syspath(struct device *device)
+{
+  return device ? device->syspath : NULL;
+}
+
+bool device_parent_matches(struct device *device, const char *device_id)
+{
+  char parent[PATH_MAX];
+
+  if (device_id == NULL || device_resolve_id(device_id, parent, sizeof(parent)) < 0) return false;
+
+  return below_parent(device->syspath, parent);
+}
+
+const char *device_attr_next(struct device *device)
+{
+  if (!device->dir) return NULL;
+
+  struct dirent *entry;
+  while ((entry = readdir(device->dir)) != NULL) {
+    if (entry->d_type == DT_REG) return entry->d_name;
+  }
+
+  (void)closedir(device->dir);
+  device->dir = NULL;
+
+  return NULL;
+}
+
+const char *device_attr_first(struct device *device)
+{
+  if (device->dir) {
+    rewinddir(device->dir);
+  }
+  else {
+    device->dir = opendir(device->syspath);
+    if (!device->dir) return NULL;
+  }
+
+  return device_attr_next(device);
+}
+
+int device_attr_read(struct device *device, const char *attr, const char **value)
+{
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", device->syspath, attr) >= (int)sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  int fildes = open(path, O_RDONLY | O_CLOEXEC);
+  if (fildes < 0) return -1;
+
+  ssize_t nread = read(fildes, device->value, sizeof(device->value) - 1);
+  int saved_errno = errno;
+  (void)close(fildes);
+  if (nread < 0) {
+    errno = saved_errno;
+    return -1;
+  }
+
+  // Drop the trailing newline like sd_device does
+  while (nread > 0 && device->value[nread - 1] == '\n') nread--;
+  device->value[nread] = '\0';
+  *value = device->value;
+
+  return 0;
+}
+
+int device_monitor_new(struct device_monitor **monitor_out)
+{
+  struct device_monitor *monitor = calloc(1, sizeof(*monitor));
+  if (!monitor) {
+    perror("Failed to allocate device monitor");
+    return -1;
+  }
+  *monitor_out = monitor;
+
+  monitor->fildes = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           NETLINK_KOBJECT_UEVENT);
+  if (monitor->fildes < 0) {
+    perror("Failed to create uevent socket");
+    return -1;
+  }
+
+  int on = 1;
+  if (setsockopt(monitor->fildes, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+    perror("Failed to enable uevent credentials");
+    return -1;
+  }
+
+  // Without udev there is nobody to re-send the events, so take the
+  // kernel's own
+  struct sockaddr_nl addr = {
+    .nl_family = AF_NETLINK,
+    .nl_groups = access("/run/udev/control", F_OK) == 0 ? UEVENT_GROUP_UDEV : UEVENT_GROUP_KERNEL,
+  };
+  if (bind(monitor->fildes, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("Failed to bind uevent socket");
+    return -1;
+  }
+
+  return 0;
+}
+
+int device_monitor_fd(struct device_monitor *monitor)
+{
+  return monitor->fildes;
+}
+
+// Returns the NUL separated KEY=value properties of a kernel or udev
+// uevent and their length
+static const char *uevent_properties(const char *buffer, size_t len, size_t *props_len)
+{
+  if (len > sizeof(UDEV_PREFIX) && memcmp(buffer, UDEV_PREFIX, sizeof(UDEV_PREFIX)) == 0) {
+    uint32_t offset;
+    if (len < UDEV_PROPERTIES_OFF + sizeof(offset)) return NULL;
+    memcpy(&offset, buffer + UDEV_PROPERTIES_OFF, sizeof(offset));
+    if (offset >= len) return NULL;
+
+    *props_len = len - offset;
+    return buffer + offset;
+  }
+
+  // Kernel events start with "action@devpath"
+  size_t header_len = strnlen(buffer, len);
+  if (header_len >= len || memchr(buffer, '@', header_len) == NULL) return NULL;
+
+  *props_len = len - header_len - 1;
+  return buffer + header_len + 1;
+}
+
+static const char *uevent_get(const char *props, size_t len, const char *key)
+{
+  size_t key_len = strlen(key);
+
+  for (const char *prop = props; prop < props + len; prop += strlen(prop) + 1) {
+    if (strncmp(prop, key, key_len) == 0 && prop[key_len] == '=') return prop + key_len + 1;
+  }
+
+  return NULL;
+}
+
+static void dispatch_uevent(const char *buffer, size_t len,
+                            void (*callback)(void *userdata, enum device_action action,
+                                             struct device *device),
+                            void *userdata)
+{
+  size_t props_len;
+  const char *props = uevent_properties(buffer, len, &props_len);
+  if (!props) return;
+
+  const char *subsystem = uevent_get(props, props_len, "SUBSYSTEM");
+  const char *action_name = uevent_get(props, props_len, "ACTION");
+  const char *devpath = uevent_get(props, props_len, "DEVPATH");
+  if (!subsystem || !action_name || !devpath || strcmp(subsystem, "hwmon") != 0) return;
+
+  enum device_action action = strcmp(action_name, "add") == 0 ? DEVICE_ADD
+                            : strcmp(action_name, "remove") == 0 ? DEVICE_REMOVE
+                            : DEVICE_OTHER;
+
+  struct device device = {0};
+  if (snprintf(device.syspath, sizeof(device.syspath), "/sys%s", devpath) >= (int)sizeof(device.syspath)) {
+    return;
+  }
+
+  callback(userdata, action, &device);
+}
+
+int device_monitor_receive(struct device_monitor *monitor,
+                           void (*callback)(void *userdata, enum device_action action,
+                                            struct device *device),
+                           void *userdata)
+{
+  for (;;) {
+    char buffer[UEVENT_BUFFER_SIZE];
+    char control[CMSG_SPACE(sizeof(struct ucred))];
+    struct iovec iov = {.iov_base = buffer, .iov_len = sizeof(buffer) - 1};
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+    };
+
+    ssize_t len = recvmsg(monitor->fildes, &msg, 0);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      if (errno == EINTR) continue;
+      perror("Failed to receive uevent");
+      return -1;
+    }
+    buffer[len] = '\0';
+
+    // Anyone may send to the uevent groups; only trust root
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS) continue;
+
+    struct ucred cred;
+    memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+    if (cred.uid != 0) continue;
+
+    dispatch_uevent(buffer, (size_t)len, callback, userdata);
+  }
+}
+
+void device_monitor_free(struct device_monitor *monitor)
+{
+  if (!monitor) return;
+
+  if (monitor->fildes >= 0 && close(monitor->fildes) == -1) {
+    perror("close");
+  }
+  free(monitor);
+}
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-device.h>
+#include <systemd/sd-event.h>
+
+#include "device.h"
+
+// struct device is never defined here; it is an sd_device
+static sd_device *to_sd(struct device *device)
+{
+  return (sd_device *)device;
+}
+
+struct device_monitor {
+  sd_event *event;
+  sd_device_monitor *monitor;
+
+  void (*callback)(void *userdata, enum device_action action, struct device *device);
+  void *userdata;
+};
+
+static int add_device_id(char ***device_ids, int *count, const char *subsystem, const char *sysname)
+{
+  char **grown = reallocarray(*device_ids, *count + 1, sizeof(**device_ids));
+  if (!grown) {
+    perror("reallocarray");
+    return -1;
+  }
+  *device_ids = grown;
+
+  if (asprintf(&grown[*count], "+%s:%s", subsystem, sysname) < 0) {
+    perror("asprintf");
+    return -1;
+  }
+  (*count)++;
+
+  return 0;
+}
+
+static int add_enumerate_matches(sd_device_enumerator *enumerator, const char *pci_id,
+                                 const char *device_id)
+{
+  int ret = 0;
+
+  if (pci_id) {
+    unsigned int vendor;
+    unsigned int product;
+    if (sscanf(pci_id, "%x:%x", &vendor, &product) != 2) {
+      (void)fprintf(stderr, "Config error: invalid pci id \"%s\"\n", pci_id);
+      return -1;
+    }
+
+    // The kernel prints both ids as lower case "0x%04x"
+    char vendor_value[sizeof("0xffff")];
+    char product_value[sizeof("0xffff")];
+    (void)snprintf(vendor_value, sizeof(vendor_value), "0x%04x", vendor & 0xffff);
+    (void)snprintf(product_value, sizeof(product_value), "0x%04x", product & 0xffff);
+
+    if ((ret = sd_device_enumerator_add_match_subsystem(enumerator, "pci", 1)) < 0 ||
+        (ret = sd_device_enumerator_add_match_sysattr(enumerator, "vendor", vendor_value, 1)) < 0 ||
+        (ret = sd_device_enumerator_add_match_sysattr(enumerator, "device", product_value, 1)) < 0)
+    {
+      (void)fprintf(stderr, "failed to add pci id match: %s\n", strerror(-ret));
+      return -1;
+    }
+  }
+
+  if (device_id) {
+    const char *sysname = device_id[0] == '+' ? strchr(device_id, ':') : NULL;
+    if (!sysname) {
+      (void)fprintf(stderr, "Config error: device id pattern \"%s\" is not \"+subsystem:sysname\"\n",
+                    device_id);
+      return -1;
+    }
+
+    char subsystem[NAME_MAX];
+    if (snprintf(subsystem, sizeof(subsystem), "%.*s", (int)(sysname - device_id - 1), device_id + 1) >=
+        (int)sizeof(subsystem))
+    {
+      (void)fprintf(stderr, "Config error: device id pattern \"%s\" is too long\n", device_id);
+      return -1;
+    }
+
+    if ((ret = sd_device_enumerator_add_match_subsystem(enumerator, subsystem, 1)) < 0 ||
+        (ret = sd_device_enumerator_add_match_sysname(enumerator, sysname + 1)) < 0)
+    {
+      (void)fprintf(stderr, "failed to add device id match: %s\n", strerror(-ret));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int device_enumerate(const char *driver, const char *pci_id, const char *device_id,
+                     char ***device_ids)
+{
+  sd_device_enumerator *enumerator [[gnu::cleanup(sd_device_enumerator_unrefp)]] = NULL;
+
+  *device_ids = NULL;
+  int count = 0;
+
+  int ret = sd_device_enumerator_new(&enumerator);
+  if (ret < 0) {
+    (void)fprintf(stderr, "failed to create enumerator: %s\n", strerror(-ret));
+    return -1;
+  }
+
+  if (add_enumerate_matches(enumerator, pci_id, device_id) < 0) return -1;
+
+  for (sd_device *device = sd_device_enumerator_get_device_first(enumerator);
+       device;
+       device = sd_device_enumerator_get_device_next(enumerator))
+  {
+    const char *device_driver;
+    if (driver && (sd_device_get_driver(device, &device_driver) < 0 ||
+                   strcmp(device_driver, driver) != 0))
+    {
+      continue;
+    }
+
+    const char *subsystem;
+    const char *sysname;
+    if (sd_device_get_subsystem(device, &subsystem) < 0 || sd_device_get_sysname(device, &sysname) < 0) {
+      continue;
+    }
+
+    if (add_device_id(device_ids, &count, subsystem, sysname) < 0) {
+      for (int k = 0; k < count; k++) {
+        free((*device_ids)[k]);
+      }
+      free(*device_ids);
+      *device_ids = NULL;
+      return -1;
+    }
+  }
+
+  return count;
+}
+
+struct device *device_find_hwmon(const char *device_id)
+{
+  sd_device_enumerator *enumerator [[gnu::cleanup(sd_device_enumerator_unrefp)]] = NULL;
+  sd_device *parent [[gnu::cleanup(sd_device_unrefp)]] = NULL;
+
+  int ret = sd_device_new_from_device_id(&parent, device_id);
+  if (ret < 0) {
+    (void)fprintf(stderr, "failed to find device ID \"%s\": %s\n", device_id, strerror(-ret));
+    return NULL;
+  }
+
+  ret = sd_device_enumerator_new(&enumerator);
+  if (ret < 0) {
+    (void)fprintf(stderr, "failed to create enumerator: %s\n", strerror(-ret));
+    return NULL;
+  }
+
+  ret = sd_device_enumerator_add_match_parent(enumerator, parent);
+  if (ret < 0) {
+    (void)fprintf(stderr, "failed to add parent match: %s\n", strerror(-ret));
+    return NULL;
+  }
+
+  ret = sd_device_enumerator_add_match_subsystem(enumerator, "hwmon", 1);
+  if (ret < 0) {
+    (void)fprintf(stderr, "failed to add subsystem match: %s\n", strerror(-ret));
+    return NULL;
+  }
+
+  sd_device *child = sd_device_enumerator_get_device_first(enumerator);
+  if (child == NULL) {
+    (void)fprintf(stderr, "Error: no hwmon device for PCI device \"%s\"\n", device_id);
+    return NULL;
+  }
+
+  const char *devpath;
+  ret = sd_device_get_devpath(child, &devpath);
+  if (ret < 0) {
+    (void)fprintf(stderr, "failed to get hwmon devpath for PCI device \"%s\": %s\n", device_id, strerror(-ret));
+    return NULL;
+  }
+
+  return (struct device *)sd_device_ref(child);
+}
+
+int device_resolve_id(const char *device_id, char *syspath, size_t size)
+{
+  sd_device *device [[gnu::cleanup(sd_device_unrefp)]] = NULL;
+
+  int ret = sd_device_new_from_device_id(&device, device_id);
+  if (ret < 0) {
+    (void)fprintf(stderr, "failed to find device ID \"%s\": %s\n", device_id, strerror(-ret));
+    return -1;
+  }
+
+  const char *path;
+  ret = sd_device_get_syspath(device, &path);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to get path for \"%s\": %s\n", device_id, strerror(-ret));
+    return -1;
+  }
+
+  if (snprintf(syspath, size, "%s", path) >= (int)size) {
+    (void)fprintf(stderr, "Path truncated: %s\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+struct device *device_unref(struct device *device)
+{
+  return (struct device *)sd_device_unref(to_sd(device));
+}
+
+void device_unrefp(struct device **device)
+{
+  device_unref(*device);
+}
+
+const char *device_syspath(struct device *device)
+{
+  const char *syspath = NULL;
+
+  if (device && sd_device_get_syspath(to_sd(device), &syspath) < 0) {
+    return NULL;
+  }
+
+  return syspath;
+}
+
+// True when the hwmon device belongs to the configured parent device
+bool device_parent_matches(struct device *device, const char *device_id)
+{
+  sd_device *parent;
+  sd_device *config_device [[gnu::cleanup(sd_device_unrefp)]] = NULL;
+
+  if (device_id == NULL || sd_device_get_parent(to_sd(device), &parent) < 0) return false;
+  if (sd_device_new_from_device_id(&config_device, device_id) < 0) return false;
+
+  const char *parent_syspath = device_syspath((struct device *)parent);
+  const char *config_syspath = device_syspath((struct device *)config_device);
+
+  return parent_syspath && config_syspath && strcmp(parent_syspath, config_syspath) == 0;
+}
+
+const char *device_attr_first(struct device *device)
+{
+  return sd_device_get_sysattr_first(to_sd(device));
+}
+
+const char *device_attr_next(struct device *device)
+{
+  return sd_device_get_sysattr_next(to_sd(device));
+}
+
+int device_attr_read(struct device *device, const char *attr, const char **value)
+{
+  int ret = sd_device_get_sysattr_value(to_sd(device), attr, value);
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int handle_uevent(sd_device_monitor *sd_monitor, sd_device *device, void *userdata)
+{
+  (void)sd_monitor;
+  struct device_monitor *monitor = userdata;
+
+  sd_device_action_t sd_action;
+  if (sd_device_get_action(device, &sd_action) < 0) return 0;
+
+  enum device_action action = sd_action == SD_DEVICE_ADD ? DEVICE_ADD
+                            : sd_action == SD_DEVICE_REMOVE ? DEVICE_REMOVE
+                            : DEVICE_OTHER;
+
+  monitor->callback(monitor->userdata, action, (struct device *)device);
+
+  return 0;
+}
+
+int device_monitor_new(struct device_monitor **monitor_out)
+{
+  struct device_monitor *monitor = calloc(1, sizeof(*monitor));
+  if (!monitor) {
+    perror("Failed to allocate device monitor");
+    return -1;
+  }
+  *monitor_out = monitor;
+
+  int ret = sd_event_new(&monitor->event);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to create event loop: %s\n", strerror(-ret));
+    return -1;
+  }
+
+  ret = sd_device_monitor_new(&monitor->monitor);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to create device monitor: %s\n", strerror(-ret));
+    return -1;
+  }
+
+  ret = sd_device_monitor_filter_add_match_subsystem_devtype(monitor->monitor, "hwmon", NULL);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to add hwmon match: %s\n", strerror(-ret));
+    return -1;
+  }
+
+  ret = sd_device_monitor_attach_event(monitor->monitor, monitor->event);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to attach device monitor: %s\n", strerror(-ret));
+    return -1;
+  }
+
+  ret = sd_device_monitor_start(monitor->monitor, handle_uevent, monitor);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to start device monitor: %s\n", strerror(-ret));
+    return -1;
+  }
+
+  return 0;
+}
+
+int device_monitor_fd(struct device_monitor *monitor)
+{
+  int fildes = sd_event_get_fd(monitor->event);
+  if (fildes < 0) {
+    (void)fprintf(stderr, "Failed to get event loop fd: %s\n", strerror(-fildes));
+    return -1;
+  }
+
+  return fildes;
+}
+
+int device_monitor_receive(struct device_monitor *monitor,
+                           void (*callback)(void *userdata, enum device_action action,
+                                            struct device *device),
+                           void *userdata)
+{
+  monitor->callback = callback;
+  monitor->userdata = userdata;
+
+  int ret;
+  while ((ret = sd_event_run(monitor->event, 0)) > 0) {
+  }
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to process device events: %s\n", strerror(-ret));
+    return -1;
+  }
+
+  return 0;
+}
+
+void device_monitor_free(struct device_monitor *monitor)
+{
+  if (!monitor) return;
+
+  sd_device_monitor_unref(monitor->monitor);
+  sd_event_unref(monitor->event);
+  free(monitor);
+}
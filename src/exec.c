@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exec.h"
+#include "arena.h"
+#include "config.h"
+#include "control.h"
+#include "loop.h"
+
+#define EXEC_MIN_BACKOFF 1
+#define EXEC_MAX_BACKOFF 60
+#define EXEC_STOP_POLLS 100
+#define EXEC_STOP_POLL_NS 10000000L
+
+extern char **environ;
+
+int exec_read_temp(struct app_sensor *self)
+{
+  struct exec_sensor_data *data = self->sensor_data;
+
+  if (!data->valid) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  self->current_value = data->value;
+
+  return 0;
+}
+
+// Children run under the normal scheduler in their own process group so
+// they can be stopped together with anything the shell started
+static int spawn_child(struct exec_sensor_data *data)
+{
+  int pipe_fildes[2];
+  if (pipe2(pipe_fildes, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("pipe2");
+    return -1;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, pipe_fildes[1], STDOUT_FILENO);
+
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  sigaddset(&default_signals, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &default_signals);
+
+  struct sched_param param = { .sched_priority = 0 };
+  posix_spawnattr_setschedpolicy(&attr, SCHED_OTHER);
+  posix_spawnattr_setschedparam(&attr, &param);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSCHEDULER |
+                                  POSIX_SPAWN_SETPGROUP);
+
+  char *argv[] = {"sh", "-c", (char *)data->command, NULL};
+  int ret = posix_spawn(&data->pid, "/bin/sh", &actions, &attr, argv, environ);
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  close(pipe_fildes[1]);
+
+  if (ret != 0) {
+    (void)fprintf(stderr, "Failed to start \"%s\" for %s: %s\n", data->command, data->name, strerror(ret));
+    close(pipe_fildes[0]);
+    data->pid = -1;
+    return -1;
+  }
+
+  data->fildes = pipe_fildes[0];
+  data->line_len = 0;
+  data->discard = false;
+
+  return 0;
+}
+
+static void parse_line(struct exec_sensor_data *data)
+{
+  data->line[data->line_len] = '\0';
+
+  char *end;
+  float value = strtof(data->line, &end);
+  if (end == data->line || (*end != '\0' && *end != '\r') || !isfinite(value)) {
+    log_entity(&data->log, LOG_WARNING, LOG_SENSOR, data->name, 0,
+               "Invalid value from %s: \"%s\"", data->name, data->line);
+    return;
+  }
+
+  data->value = value;
+  data->valid = true;
+  data->backoff = EXEC_MIN_BACKOFF;
+}
+
+static void schedule_restart(struct exec_sensor_data *data)
+{
+  struct itimerspec timer = { .it_value = { .tv_sec = data->backoff } };
+  if (timerfd_settime(data->timer_fildes, 0, &timer, NULL) == -1) {
+    perror("timerfd_settime");
+  }
+
+  data->backoff = data->backoff * 2 > EXEC_MAX_BACKOFF ? EXEC_MAX_BACKOFF : data->backoff * 2;
+}
+
+// Returns false while a killed child has yet to exit. It is left for the
+// restart timer to reap, since a child stuck in the kernel would otherwise
+// hold up the control loop.
+static bool reap_child(struct exec_sensor_data *data, int delay)
+{
+  int status = 0;
+  pid_t ret = waitpid(data->pid, &status, WNOHANG);
+
+  // The child closed its output without exiting
+  if (ret == 0) {
+    kill(-data->pid, SIGKILL);
+    return false;
+  }
+
+  if (ret < 0) {
+    perror("waitpid");
+  }
+  else if (WIFSIGNALED(status)) {
+    log_entity(&data->log, LOG_WARNING, LOG_SENSOR, data->name, 0,
+               "Command for %s killed by signal %d, restarting in %d s",
+               data->name, WTERMSIG(status), delay);
+  }
+  else {
+    log_entity(&data->log, LOG_WARNING, LOG_SENSOR, data->name, 0,
+               "Command for %s exited with status %d, restarting in %d s",
+               data->name, WEXITSTATUS(status), delay);
+  }
+  data->pid = -1;
+
+  return true;
+}
+
+static void child_exited(struct exec_sensor_data *data)
+{
+  loop_remove(data->loop, data->fildes);
+  if (close(data->fildes) == -1) {
+    perror("close");
+  }
+  data->fildes = -1;
+  data->valid = false;
+
+  (void)reap_child(data, data->backoff);
+  schedule_restart(data);
+}
+
+static void handle_output(void *userdata, short revents)
+{
+  struct exec_sensor_data *data = userdata;
+  (void)revents;
+
+  for (;;) {
+    char buffer[EXEC_LINE_SIZE * 4];
+    ssize_t nread = read(data->fildes, buffer, sizeof(buffer));
+    if (nread == 0) {
+      child_exited(data);
+      return;
+    }
+    if (nread < 0) {
+      if (errno == EAGAIN || errno == EINTR) return;
+      perror("read");
+      child_exited(data);
+      return;
+    }
+
+    // Only complete lines are parsed and a line too long for the buffer
+    // is dropped up to its newline
+    for (ssize_t i = 0; i < nread; i++) {
+      if (buffer[i] == '\n') {
+        if (!data->discard) {
+          parse_line(data);
+        }
+        data->line_len = 0;
+        data->discard = false;
+      }
+      else if (data->line_len == EXEC_LINE_SIZE - 1) {
+        data->discard = true;
+      }
+      else if (!data->discard) {
+        data->line[data->line_len++] = buffer[i];
+      }
+    }
+  }
+}
+
+static int start_child(struct exec_sensor_data *data)
+{
+  if (spawn_child(data) < 0) return -1;
+
+  if (loop_add(data->loop, data->fildes, POLLIN, handle_output, data) < 0) {
+    kill(-data->pid, SIGKILL);
+    (void)reap_child(data, data->backoff);
+    close(data->fildes);
+    data->fildes = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void handle_restart(void *userdata, short revents)
+{
+  struct exec_sensor_data *data = userdata;
+  (void)revents;
+
+  uint64_t expirations;
+  if (read(data->timer_fildes, &expirations, sizeof(expirations)) < 0) {
+    if (errno != EAGAIN) {
+      perror("read");
+    }
+    return;
+  }
+
+  // The last child has to be gone before the next one is started
+  if ((data->pid > 0 && !reap_child(data, 0)) || start_child(data) < 0) {
+    schedule_restart(data);
+  }
+}
+
+static void destroy_exec_sensor(struct app_sensor *self)
+{
+  struct exec_sensor_data *data = self->sensor_data;
+
+  if (data->pid > 0) {
+    kill(-data->pid, SIGTERM);
+
+    int polls = 0;
+    while (waitpid(data->pid, NULL, WNOHANG) == 0 && polls++ < EXEC_STOP_POLLS) {
+      nanosleep(&(struct timespec) { .tv_nsec = EXEC_STOP_POLL_NS }, NULL);
+    }
+    if (polls > EXEC_STOP_POLLS) {
+      kill(-data->pid, SIGKILL);
+      waitpid(data->pid, NULL, 0);
+    }
+  }
+
+  if (data->fildes >= 0 && close(data->fildes) == -1) {
+    perror("close");
+  }
+  if (data->timer_fildes >= 0 && close(data->timer_fildes) == -1) {
+    perror("close");
+  }
+}
+
+int link_exec_sensor(struct app_context *app_context, struct app_sensor *sensor,
+                     struct custom_sensor_config *config)
+{
+  struct exec_sensor_data *data = arena_alloc(&app_context->arena, 1, sizeof(*data));
+  if (!data) return -1;
+
+  data->name = sensor->name;
+  data->command = arena_strdup(&app_context->arena, config->type_opts.exec.command);
+  if (!data->command) return -1;
+
+  data->pid = -1;
+  data->fildes = -1;
+  data->timer_fildes = -1;
+  data->backoff = EXEC_MIN_BACKOFF;
+
+  sensor->sensor_data = data;
+  sensor->destroy_func = destroy_exec_sensor;
+
+  return 0;
+}
+
+size_t exec_arena_size(const struct custom_sensor_config *config)
+{
+  return arena_size(1, sizeof(struct exec_sensor_data)) +
+         arena_string_size(config->type_opts.exec.command);
+}
+
+int exec_start_sensors(struct config *config, struct app_context *app_context, struct event_loop *loop)
+{
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    if (strcmp(config->custom_sensor[i].type, "exec") != 0) continue;
+
+    struct exec_sensor_data *data = app_context->sensor[config->custom_sensor[i].slot].sensor_data;
+    data->loop = loop;
+
+    data->timer_fildes = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (data->timer_fildes < 0) {
+      perror("timerfd_create");
+      return -1;
+    }
+
+    if (loop_add(loop, data->timer_fildes, POLLIN, handle_restart, data) < 0) return -1;
+    if (start_child(data) < 0) return -1;
+  }
+
+  return 0;
+}
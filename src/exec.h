@@ -0,0 +1,45 @@
+#ifndef EXEC_H
+#define EXEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "log.h"
+
+#define EXEC_LINE_SIZE 64
+
+struct event_loop;
+
+struct exec_sensor_data {
+  const char *name;
+  const char *command;
+  pid_t pid;
+  int fildes;
+  int timer_fildes;
+  int backoff;
+  struct event_loop *loop;
+
+  char line[EXEC_LINE_SIZE];
+  size_t line_len;
+  bool discard;
+
+  float value;
+  bool valid;
+
+  struct log_bucket log;
+};
+
+struct app_context;
+struct app_sensor;
+struct config;
+struct custom_sensor_config;
+
+int exec_read_temp(struct app_sensor *self);
+int link_exec_sensor(struct app_context *app_context, struct app_sensor *sensor,
+                     struct custom_sensor_config *config);
+size_t exec_arena_size(const struct custom_sensor_config *config);
+
+int exec_start_sensors(struct config *config, struct app_context *app_context, struct event_loop *loop);
+
+#endif
@@ -0,0 +1,400 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "expr.h"
+
+#define NS_PER_SEC 1000000000.0F
+#define EXPR_MAX_ARGS UINT16_MAX
+
+struct parser {
+  const char *formula;
+  const char *pos;
+  const char *error;
+
+  struct expr_program *program;
+  int ops_capacity;
+  int depth;
+};
+
+static const struct {
+  const char *name;
+  enum expr_opcode opcode;
+  int min_args;
+  int max_args;
+} function[] = {
+  {"min", EXPR_MIN, 1, EXPR_MAX_ARGS},
+  {"max", EXPR_MAX, 1, EXPR_MAX_ARGS},
+  {"avg", EXPR_AVG, 1, EXPR_MAX_ARGS},
+  {"clamp", EXPR_CLAMP, 3, 3},
+  {"ddt", EXPR_DDT, 1, 1},
+};
+
+static int parse_expression(struct parser *parser);
+
+static void skip_space(struct parser *parser)
+{
+  while (isspace((unsigned char)*parser->pos)) {
+    parser->pos++;
+  }
+}
+
+static bool accept(struct parser *parser, char c)
+{
+  skip_space(parser);
+  if (*parser->pos != c) return false;
+
+  parser->pos++;
+  return true;
+}
+
+static int fail(struct parser *parser, const char *error)
+{
+  if (parser->error == NULL) {
+    parser->error = error;
+  }
+  return -1;
+}
+
+static int emit(struct parser *parser, enum expr_opcode opcode, int arg, float value)
+{
+  struct expr_program *program = parser->program;
+
+  if (program->num_ops == parser->ops_capacity) {
+    int capacity = parser->ops_capacity ? parser->ops_capacity * 2 : 16;
+    struct expr_op *new_array = reallocarray(program->op, capacity, sizeof(*program->op));
+    if (!new_array) {
+      perror("Failed to allocate expression");
+      return -1;
+    }
+    program->op = new_array;
+    parser->ops_capacity = capacity;
+  }
+
+  switch (opcode) {
+    case EXPR_CONST:
+    case EXPR_SENSOR:
+      parser->depth++;
+      break;
+    case EXPR_ADD:
+    case EXPR_SUB:
+    case EXPR_MUL:
+    case EXPR_DIV:
+      parser->depth--;
+      break;
+    case EXPR_MIN:
+    case EXPR_MAX:
+    case EXPR_AVG:
+    case EXPR_CLAMP:
+      parser->depth -= arg - 1;
+      break;
+    case EXPR_NEG:
+    case EXPR_DDT:
+      break;
+  }
+
+  if (parser->depth > program->max_depth) {
+    program->max_depth = parser->depth;
+  }
+
+  program->op[program->num_ops++] = (struct expr_op) {
+    .opcode = opcode,
+    .arg = (uint16_t)arg,
+    .value = value
+  };
+
+  return 0;
+}
+
+static int intern_name(struct parser *parser, const char *start, size_t len)
+{
+  struct expr_program *program = parser->program;
+
+  for (int i = 0; i < program->num_names; i++) {
+    if (strlen(program->name[i]) == len && strncmp(program->name[i], start, len) == 0) {
+      return i;
+    }
+  }
+
+  if (program->num_names == EXPR_MAX_ARGS) {
+    return fail(parser, "too many sensors");
+  }
+
+  char **new_array = reallocarray(program->name, program->num_names + 1, sizeof(*program->name));
+  if (!new_array) {
+    perror("Failed to allocate expression");
+    return -1;
+  }
+  program->name = new_array;
+
+  program->name[program->num_names] = strndup(start, len);
+  if (!program->name[program->num_names]) {
+    perror("strndup");
+    return -1;
+  }
+
+  return program->num_names++;
+}
+
+static int parse_call(struct parser *parser, const char *start, size_t len)
+{
+  int func = -1;
+  for (int i = 0; i < (int)(sizeof(function) / sizeof(function[0])); i++) {
+    if (strlen(function[i].name) == len && strncmp(function[i].name, start, len) == 0) {
+      func = i;
+      break;
+    }
+  }
+  if (func < 0) return fail(parser, "unknown function");
+
+  int argc = 0;
+  if (!accept(parser, ')')) {
+    do {
+      if (parse_expression(parser) < 0) return -1;
+      argc++;
+    } while (accept(parser, ','));
+
+    if (!accept(parser, ')')) return fail(parser, "expected ')'");
+  }
+
+  if (argc < function[func].min_args || argc > function[func].max_args) {
+    return fail(parser, "wrong number of arguments");
+  }
+
+  int arg = argc;
+  if (function[func].opcode == EXPR_DDT) {
+    arg = parser->program->num_ddt++;
+  }
+
+  return emit(parser, function[func].opcode, arg, 0);
+}
+
+static int parse_primary(struct parser *parser)
+{
+  skip_space(parser);
+
+  const char *start = parser->pos;
+
+  if (accept(parser, '(')) {
+    if (parse_expression(parser) < 0) return -1;
+    if (!accept(parser, ')')) return fail(parser, "expected ')'");
+    return 0;
+  }
+
+  if (accept(parser, '\'')) {
+    const char *end = strchr(parser->pos, '\'');
+    if (end == NULL) return fail(parser, "unterminated sensor name");
+
+    int index = intern_name(parser, parser->pos, end - parser->pos);
+    if (index < 0) return -1;
+
+    parser->pos = end + 1;
+    return emit(parser, EXPR_SENSOR, index, 0);
+  }
+
+  if (isdigit((unsigned char)*start) || *start == '.') {
+    char *end;
+    float value = strtof(start, &end);
+    if (end == start) return fail(parser, "invalid number");
+
+    parser->pos = end;
+    return emit(parser, EXPR_CONST, 0, value);
+  }
+
+  if (isalpha((unsigned char)*start) || *start == '_') {
+    while (isalnum((unsigned char)*parser->pos) || *parser->pos == '_' || *parser->pos == '.') {
+      parser->pos++;
+    }
+    size_t len = parser->pos - start;
+
+    if (accept(parser, '(')) {
+      return parse_call(parser, start, len);
+    }
+
+    int index = intern_name(parser, start, len);
+    if (index < 0) return -1;
+
+    return emit(parser, EXPR_SENSOR, index, 0);
+  }
+
+  return fail(parser, "expected a number, sensor or function");
+}
+
+static int parse_unary(struct parser *parser)
+{
+  if (accept(parser, '-')) {
+    if (parse_unary(parser) < 0) return -1;
+    return emit(parser, EXPR_NEG, 0, 0);
+  }
+
+  return parse_primary(parser);
+}
+
+static int parse_term(struct parser *parser)
+{
+  if (parse_unary(parser) < 0) return -1;
+
+  for (;;) {
+    enum expr_opcode opcode;
+    if (accept(parser, '*')) {
+      opcode = EXPR_MUL;
+    }
+    else if (accept(parser, '/')) {
+      opcode = EXPR_DIV;
+    }
+    else {
+      return 0;
+    }
+
+    if (parse_unary(parser) < 0) return -1;
+    if (emit(parser, opcode, 0, 0) < 0) return -1;
+  }
+}
+
+static int parse_expression(struct parser *parser)
+{
+  if (parse_term(parser) < 0) return -1;
+
+  for (;;) {
+    enum expr_opcode opcode;
+    if (accept(parser, '+')) {
+      opcode = EXPR_ADD;
+    }
+    else if (accept(parser, '-')) {
+      opcode = EXPR_SUB;
+    }
+    else {
+      return 0;
+    }
+
+    if (parse_term(parser) < 0) return -1;
+    if (emit(parser, opcode, 0, 0) < 0) return -1;
+  }
+}
+
+int expr_compile(const char *formula, struct expr_program *program)
+{
+  memset(program, 0, sizeof(*program));
+
+  struct parser parser = {
+    .formula = formula,
+    .pos = formula,
+    .program = program
+  };
+
+  if (parse_expression(&parser) == 0) {
+    skip_space(&parser);
+    if (*parser.pos == '\0') return 0;
+    fail(&parser, "unexpected character");
+  }
+
+  if (parser.error) {
+    int column = (int)(parser.pos - formula);
+    (void)fprintf(stderr, "Config error: %s in formula:\n", parser.error);
+    (void)fprintf(stderr, "    %s\n", formula);
+    (void)fprintf(stderr, "    %*s^\n", column, "");
+  }
+
+  expr_free(program);
+  return -1;
+}
+
+float expr_eval(const struct expr_program *program, const float input[], float stack[],
+                struct expr_ddt ddt[], const struct timespec *now)
+{
+  int top = -1;
+
+  for (int i = 0; i < program->num_ops; i++) {
+    const struct expr_op *op = &program->op[i];
+
+    switch (op->opcode) {
+      case EXPR_CONST:
+        stack[++top] = op->value;
+        break;
+      case EXPR_SENSOR:
+        stack[++top] = input[op->arg];
+        break;
+      case EXPR_ADD:
+        top--;
+        stack[top] += stack[top + 1];
+        break;
+      case EXPR_SUB:
+        top--;
+        stack[top] -= stack[top + 1];
+        break;
+      case EXPR_MUL:
+        top--;
+        stack[top] *= stack[top + 1];
+        break;
+      case EXPR_DIV:
+        top--;
+        stack[top] /= stack[top + 1];
+        break;
+      case EXPR_NEG:
+        stack[top] = -stack[top];
+        break;
+      case EXPR_MIN:
+        top -= op->arg - 1;
+        for (int j = 1; j < op->arg; j++) {
+          stack[top] = stack[top + j] < stack[top] ? stack[top + j] : stack[top];
+        }
+        break;
+      case EXPR_MAX:
+        top -= op->arg - 1;
+        for (int j = 1; j < op->arg; j++) {
+          stack[top] = stack[top + j] > stack[top] ? stack[top + j] : stack[top];
+        }
+        break;
+      case EXPR_AVG:
+        top -= op->arg - 1;
+        for (int j = 1; j < op->arg; j++) {
+          stack[top] += stack[top + j];
+        }
+        stack[top] /= (float)op->arg;
+        break;
+      case EXPR_CLAMP:
+        top -= 2;
+        if (stack[top] < stack[top + 1]) {
+          stack[top] = stack[top + 1];
+        }
+        else if (stack[top] > stack[top + 2]) {
+          stack[top] = stack[top + 2];
+        }
+        break;
+      case EXPR_DDT: {
+        struct expr_ddt *state = &ddt[op->arg];
+        float value = stack[top];
+
+        if (state->primed) {
+          float elapsed = (float)(now->tv_sec - state->timestamp.tv_sec) +
+                          (float)(now->tv_nsec - state->timestamp.tv_nsec) / NS_PER_SEC;
+          stack[top] = elapsed > 0 ? (value - state->value) / elapsed : 0;
+        }
+        else {
+          stack[top] = 0;
+        }
+
+        state->value = value;
+        state->timestamp = *now;
+        state->primed = true;
+        break;
+      }
+    }
+  }
+
+  return stack[0];
+}
+
+void expr_free(struct expr_program *program)
+{
+  for (int i = 0; i < program->num_names; i++) {
+    free(program->name[i]);
+  }
+  free(program->name);
+  free(program->op);
+  memset(program, 0, sizeof(*program));
+}
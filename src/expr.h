@@ -0,0 +1,51 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum expr_opcode {
+  EXPR_CONST,
+  EXPR_SENSOR,
+  EXPR_ADD,
+  EXPR_SUB,
+  EXPR_MUL,
+  EXPR_DIV,
+  EXPR_NEG,
+  EXPR_MIN,
+  EXPR_MAX,
+  EXPR_AVG,
+  EXPR_CLAMP,
+  EXPR_DDT
+};
+
+struct expr_op {
+  uint8_t opcode;
+  uint16_t arg;
+  float value;
+};
+
+struct expr_program {
+  struct expr_op *op;
+  int num_ops;
+
+  char **name;
+  int num_names;
+
+  int num_ddt;
+  int max_depth;
+};
+
+struct expr_ddt {
+  float value;
+  struct timespec timestamp;
+  bool primed;
+};
+
+int expr_compile(const char *formula, struct expr_program *program);
+float expr_eval(const struct expr_program *program, const float input[], float stack[],
+                struct expr_ddt ddt[], const struct timespec *now);
+void expr_free(struct expr_program *program);
+
+#endif
@@ -0,0 +1,108 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "filter.h"
+#include "config.h"
+
+#define NS_PER_SEC 1000000000.0F
+
+static float window_median(const float window[], int len)
+{
+  float sorted[FILTER_MEDIAN_MAX];
+
+  for (int i = 0; i < len; i++) {
+    float value = window[i];
+    int j = i;
+    while (j > 0 && sorted[j - 1] > value) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = value;
+  }
+
+  if (len % 2 == 0) {
+    return (sorted[len / 2 - 1] + sorted[len / 2]) / 2.0F;
+  }
+
+  return sorted[len / 2];
+}
+
+bool filter_enabled(const struct filter_config *config)
+{
+  return config->ema_alpha > 0 || config->median_window > 1 || config->max_slew > 0;
+}
+
+int filter_init(struct sensor_filter *filter, const struct filter_config *config, const char *name)
+{
+  if (config->ema_alpha < 0 || config->ema_alpha > 1) {
+    (void)fprintf(stderr, "Config error: \"ema alpha\" for \"%s\" must be between 0 and 1\n", name);
+    return -1;
+  }
+  if (config->median_window < 0 || config->median_window > FILTER_MEDIAN_MAX ||
+      config->median_window != floorf(config->median_window))
+  {
+    (void)fprintf(stderr,
+                  "Config error: \"median window\" for \"%s\" must be a whole number between 0 and %d\n",
+                  name, FILTER_MEDIAN_MAX);
+    return -1;
+  }
+  if (config->max_slew < 0) {
+    (void)fprintf(stderr, "Config error: \"max slew\" for \"%s\" can't be negative\n", name);
+    return -1;
+  }
+
+  memset(filter, 0, sizeof(*filter));
+  if (!filter_enabled(config)) return 0;
+
+  filter->config = config;
+  filter->window_size = (int)config->median_window;
+
+  return 0;
+}
+
+float filter_apply(struct sensor_filter *filter, float sample, const struct timespec *now)
+{
+  const struct filter_config *config = filter->config;
+  float value = sample;
+
+  if (filter->window_size > 1) {
+    filter->window[filter->window_pos] = sample;
+    filter->window_pos = (filter->window_pos + 1) % filter->window_size;
+    if (filter->window_len < filter->window_size) {
+      filter->window_len++;
+    }
+    value = window_median(filter->window, filter->window_len);
+  }
+
+  if (!filter->primed) {
+    filter->primed = true;
+    filter->value = value;
+    filter->timestamp = *now;
+    return value;
+  }
+
+  if (config->ema_alpha > 0) {
+    value = filter->value + config->ema_alpha * (value - filter->value);
+  }
+
+  if (config->max_slew > 0) {
+    float elapsed = (float)(now->tv_sec - filter->timestamp.tv_sec) +
+                    (float)(now->tv_nsec - filter->timestamp.tv_nsec) / NS_PER_SEC;
+    float max_step = config->max_slew * elapsed;
+
+    if (value > filter->value + max_step) {
+      value = filter->value + max_step;
+    }
+    else if (value < filter->value - max_step) {
+      value = filter->value - max_step;
+    }
+  }
+
+  filter->value = value;
+  filter->timestamp = *now;
+
+  return value;
+}
@@ -0,0 +1,28 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#define FILTER_MEDIAN_MAX 9
+
+struct filter_config;
+
+struct sensor_filter {
+  const struct filter_config *config;
+
+  float window[FILTER_MEDIAN_MAX];
+  int window_size;
+  int window_len;
+  int window_pos;
+
+  float value;
+  struct timespec timestamp;
+  bool primed;
+};
+
+bool filter_enabled(const struct filter_config *config);
+int filter_init(struct sensor_filter *filter, const struct filter_config *config, const char *name);
+float filter_apply(struct sensor_filter *filter, float sample, const struct timespec *now);
+
+#endif
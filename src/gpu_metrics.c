@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gpu_metrics.h"
+#include "arena.h"
+#include "control.h"
+#include "config.h"
+
+#define GPU_METRICS_HEADER_SIZE 4
+#define GPU_METRICS_INVALID 0xFFFF
+
+enum metrics_layout {
+  LAYOUT_V1_0,
+  LAYOUT_V1_1,
+  NUM_LAYOUTS
+};
+
+// Byte offsets of the fields shared by the dGPU gpu_metrics_v1_0..v1_3
+// structs in the kernel's kgd_pp_interface.h; temperatures are in degrees
+// Celsius, socket power in watts and fan speed in RPM
+static const struct {
+  const char *name;
+  size_t offset[NUM_LAYOUTS];
+} field[] = {
+  {"edge", {16, 4}},
+  {"hotspot", {18, 6}},
+  {"junction", {18, 6}},
+  {"mem", {20, 8}},
+  {"vrgfx", {22, 10}},
+  {"vrsoc", {24, 12}},
+  {"vrmem", {26, 14}},
+  {"power", {34, 22}},
+  {"fan", {72, 72}},
+};
+
+static int refresh_metrics(struct gpu_metrics *metrics)
+{
+  ssize_t nread = pread(metrics->fildes, metrics->blob, sizeof(metrics->blob), 0);
+  if (nread < 0) {
+    return -1;
+  }
+  if (nread < GPU_METRICS_HEADER_SIZE) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  memcpy(&metrics->structure_size, metrics->blob, sizeof(metrics->structure_size));
+  metrics->format_revision = metrics->blob[2];
+  metrics->content_revision = metrics->blob[3];
+
+  if (metrics->structure_size > nread) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  return 0;
+}
+
+static enum metrics_layout get_layout(const struct gpu_metrics *metrics)
+{
+  return metrics->content_revision == 0 ? LAYOUT_V1_0 : LAYOUT_V1_1;
+}
+
+int gpu_metrics_read_temp(struct app_sensor *app_sensor)
+{
+  struct gpu_metrics_sensor *sensor = app_sensor->sensor_data;
+  struct gpu_metrics *metrics = sensor->metrics;
+
+  if (metrics->tick != app_sensor->tick) {
+    metrics->tick = app_sensor->tick;
+    metrics->status = refresh_metrics(metrics);
+    metrics->error = errno;
+  }
+
+  if (metrics->status < 0) {
+    errno = metrics->error;
+    return -1;
+  }
+
+  if (sensor->field_offset + sizeof(uint16_t) > metrics->structure_size) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  uint16_t value;
+  memcpy(&value, metrics->blob + sensor->field_offset, sizeof(value));
+  if (value == GPU_METRICS_INVALID) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  app_sensor->current_value = (float)value + sensor->offset;
+
+  return 0;
+}
+
+static void destroy_sensor(struct app_sensor *app_sensor)
+{
+  struct gpu_metrics_sensor *sensor = app_sensor->sensor_data;
+
+  if (--sensor->metrics->refs == 0 && close(sensor->metrics->fildes) == -1) {
+    perror("close");
+  }
+}
+
+static int find_field(const char *name, enum metrics_layout layout, size_t *offset)
+{
+  for (int i = 0; i < (int)(sizeof(field) / sizeof(field[0])); i++) {
+    if (strcmp(name, field[i].name) == 0) {
+      *offset = field[i].offset[layout];
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static int init_metrics(const char *syspath, struct gpu_metrics *metrics)
+{
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/gpu_metrics", syspath) >= (int)sizeof(path)) {
+    (void)fprintf(stderr, "Path truncated: %s\n", path);
+    return -1;
+  }
+
+  metrics->fildes = open(path, O_RDONLY | O_CLOEXEC);
+  if (metrics->fildes < 0) {
+    (void)fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (refresh_metrics(metrics) < 0) {
+    (void)fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (metrics->format_revision != 1 || metrics->content_revision > 3) {
+    (void)fprintf(stderr, "Unsupported gpu_metrics version %u.%u in %s\n",
+                  metrics->format_revision, metrics->content_revision, path);
+    return -1;
+  }
+
+  return 0;
+}
+
+int gpu_metrics_init_sensors(const char *syspath, struct source_config *source_config,
+                             struct app_context *app_context)
+{
+  struct gpu_metrics *metrics = arena_alloc(&app_context->arena, 1, sizeof(*metrics));
+  if (!metrics) return -1;
+  metrics->fildes = -1;
+
+  if (init_metrics(syspath, metrics) < 0) {
+    if (metrics->fildes >= 0) {
+      close(metrics->fildes);
+    }
+    return -1;
+  }
+
+  for (int i = 0; i < source_config->num_sensors; i++) {
+    struct sensor_config *config = &source_config->sensor[i];
+    struct app_sensor *app_sensor = &app_context->sensor[config->slot];
+
+    size_t field_offset;
+    if (find_field(sensor_label(config), get_layout(metrics), &field_offset) < 0) {
+      (void)fprintf(stderr, "Error: no gpu_metrics field \"%s\" for \"%s\"\n",
+                    sensor_label(config), source_config->name);
+      break;
+    }
+
+    if (filter_init(&app_sensor->filter, &config->filter, config->name) < 0) break;
+
+    struct gpu_metrics_sensor *sensor = arena_alloc(&app_context->arena, 1, sizeof(*sensor));
+    if (!sensor) break;
+    sensor->metrics = metrics;
+    sensor->field_offset = field_offset;
+    sensor->offset = config->offset;
+    metrics->refs++;
+
+    app_sensor->config = config;
+    app_sensor->sensor_data = sensor;
+    app_sensor->get_temp_func = gpu_metrics_read_temp;
+    app_sensor->destroy_func = destroy_sensor;
+  }
+
+  if (metrics->refs < source_config->num_sensors) {
+    if (metrics->refs == 0) {
+      close(metrics->fildes);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+size_t gpu_metrics_arena_size(const struct source_config *source_config)
+{
+  return arena_size(1, sizeof(struct gpu_metrics)) +
+         arena_size(source_config->num_sensors, sizeof(struct gpu_metrics_sensor));
+}
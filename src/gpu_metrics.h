@@ -0,0 +1,38 @@
+#ifndef GPU_METRICS_H
+#define GPU_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GPU_METRICS_MAX_SIZE 1024
+
+struct gpu_metrics {
+  int fildes;
+  int refs;
+
+  unsigned int tick;
+  int status;
+  int error;
+
+  uint16_t structure_size;
+  uint8_t format_revision;
+  uint8_t content_revision;
+  unsigned char blob[GPU_METRICS_MAX_SIZE];
+};
+
+struct gpu_metrics_sensor {
+  struct gpu_metrics *metrics;
+  size_t field_offset;
+  float offset;
+};
+
+struct app_context;
+struct app_sensor;
+struct source_config;
+
+int gpu_metrics_init_sensors(const char *syspath, struct source_config *source_config,
+                             struct app_context *app_context);
+int gpu_metrics_read_temp(struct app_sensor *app_sensor);
+size_t gpu_metrics_arena_size(const struct source_config *source_config);
+
+#endif
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "guardian.h"
+#include "arena.h"
+#include "control.h"
+#include "hwmon.h"
+
+#define GUARDIAN_NAME "cfans-guardian"
+#define GUARDIAN_RELEASE -1
+
+struct guardian_message {
+  // Fan whose pwm_enable file is passed along, or GUARDIAN_RELEASE
+  int32_t index;
+  char pwm_auto_control[HWMON_MAX_PWM_VALUE];
+};
+
+static bool guarded_fd(const struct app_context *app_context, int fildes, int worker)
+{
+  if (fildes == worker) return true;
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    if (app_context->fan.hwmon[i].pwm_enable_fildes == fildes) return true;
+  }
+
+  return false;
+}
+
+// Sensor inputs, pwm files, sockets and exec sensor pipes all belong to the
+// worker; holding on to them would keep pipes from reporting EOF
+static void close_worker_fds(const struct app_context *app_context, int worker)
+{
+  long max_fd = sysconf(_SC_OPEN_MAX);
+
+  for (int fildes = STDERR_FILENO + 1; fildes < max_fd; fildes++) {
+    if (!guarded_fd(app_context, fildes, worker)) {
+      (void)close(fildes);
+    }
+  }
+}
+
+static void restore_fans(struct app_context *app_context)
+{
+  int restored = 0;
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    const struct hwmon_fan *fan = &app_context->fan.hwmon[i];
+    if (fan->pwm_enable_fildes < 0) continue;
+
+    if (pwrite(fan->pwm_enable_fildes, fan->pwm_auto_control, strlen(fan->pwm_auto_control), 0) < 0) {
+      (void)fprintf(stderr, "Guardian failed to set %s back to auto control: %s\n",
+                    fan->pwm_enable_file, strerror(errno));
+      continue;
+    }
+    restored++;
+  }
+
+  (void)fprintf(stderr, "cfans exited abnormally, handed %d of %d fans back to the firmware\n",
+                restored, app_context->num_fans);
+}
+
+static void replace_fan(struct app_context *app_context, const struct guardian_message *message,
+                        int fildes)
+{
+  if (message->index < 0 || message->index >= app_context->num_fans) {
+    if (fildes >= 0) (void)close(fildes);
+    return;
+  }
+
+  struct hwmon_fan *fan = &app_context->fan.hwmon[message->index];
+  if (fan->pwm_enable_fildes >= 0) (void)close(fan->pwm_enable_fildes);
+  fan->pwm_enable_fildes = fildes;
+  memcpy(fan->pwm_auto_control, message->pwm_auto_control, sizeof(fan->pwm_auto_control));
+  fan->pwm_auto_control[sizeof(fan->pwm_auto_control) - 1] = '\0';
+}
+
+// Runs in the forked child on its own copy of the fan state. The socket
+// reads EOF as soon as the worker is gone, however it died; only an
+// explicit release means the worker restored the fans or handed them over.
+[[gnu::noreturn]] static void guard(struct app_context *app_context, int worker)
+{
+  // SIGABRT is the watchdog's, sent to the whole unit when its KillMode
+  // is control-group, and a hung worker is when the guardian is needed
+  static const int ignored[] = {SIGINT, SIGTERM, SIGHUP, SIGUSR1, SIGUSR2, SIGPIPE, SIGABRT};
+  for (size_t k = 0; k < sizeof(ignored) / sizeof(ignored[0]); k++) {
+    (void)signal(ignored[k], SIG_IGN);
+  }
+  (void)prctl(PR_SET_NAME, GUARDIAN_NAME);
+
+  close_worker_fds(app_context, worker);
+
+  for (;;) {
+    struct guardian_message message;
+    union {
+      struct cmsghdr align;
+      char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = &message, .iov_len = sizeof(message)};
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+    };
+
+    ssize_t len = recvmsg(worker, &msg, MSG_CMSG_CLOEXEC);
+    if (len < 0 && errno == EINTR) continue;
+    if (len <= 0) break;
+
+    int fildes = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&fildes, CMSG_DATA(cmsg), sizeof(fildes));
+    }
+
+    if (len != sizeof(message)) {
+      if (fildes >= 0) (void)close(fildes);
+      continue;
+    }
+    if (message.index == GUARDIAN_RELEASE) _exit(EXIT_SUCCESS);
+
+    replace_fan(app_context, &message, fildes);
+  }
+
+  restore_fans(app_context);
+  _exit(EXIT_SUCCESS);
+}
+
+int guardian_start(struct app_context *app_context)
+{
+  struct guardian *guardian = arena_alloc(&app_context->arena, 1, sizeof(*guardian));
+  if (!guardian) return -1;
+
+  int fildes[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fildes) < 0) {
+    perror("Failed to create guardian socket");
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("Failed to start guardian");
+    (void)close(fildes[0]);
+    (void)close(fildes[1]);
+    return -1;
+  }
+
+  if (pid == 0) {
+    (void)close(fildes[0]);
+    guard(app_context, fildes[1]);
+  }
+
+  if (close(fildes[1]) == -1) {
+    perror("close");
+  }
+  guardian->fildes = fildes[0];
+  guardian->pid = pid;
+  app_context->guardian = guardian;
+
+  return 0;
+}
+
+// A rebound fan has a new pwm_enable file; the guardian's copy of the old
+// one points at a device that is gone
+int guardian_update_fan(struct app_context *app_context, int index)
+{
+  struct guardian *guardian = app_context->guardian;
+  const struct hwmon_fan *fan = &app_context->fan.hwmon[index];
+  if (!guardian || fan->pwm_enable_fildes < 0) return 0;
+
+  struct guardian_message message = {.index = index};
+  memcpy(message.pwm_auto_control, fan->pwm_auto_control, sizeof(message.pwm_auto_control));
+
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control = {0};
+  struct iovec iov = {.iov_base = &message, .iov_len = sizeof(message)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buffer,
+    .msg_controllen = sizeof(control.buffer),
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fan->pwm_enable_fildes, sizeof(int));
+
+  if (sendmsg(guardian->fildes, &msg, MSG_NOSIGNAL) < 0) {
+    (void)fprintf(stderr, "Failed to pass %s to the guardian: %s\n",
+                  fan->pwm_enable_file, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+// Called once the worker has restored the fans itself or left them to the
+// next instance; waits so the guardian is gone before the service is
+void guardian_release(struct app_context *app_context)
+{
+  struct guardian *guardian = app_context->guardian;
+  if (!guardian) return;
+
+  struct guardian_message message = {.index = GUARDIAN_RELEASE};
+  if (send(guardian->fildes, &message, sizeof(message), MSG_NOSIGNAL) < 0) {
+    perror("Failed to release guardian");
+  }
+  if (close(guardian->fildes) == -1) {
+    perror("close");
+  }
+  if (waitpid(guardian->pid, NULL, 0) < 0) {
+    perror("waitpid");
+  }
+
+  app_context->guardian = NULL;
+}
+
+size_t guardian_arena_size(void)
+{
+  return arena_size(1, sizeof(struct guardian));
+}
@@ -0,0 +1,22 @@
+#ifndef GUARDIAN_H
+#define GUARDIAN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct app_context;
+
+// A forked process holding its own copies of the pwm_enable files and the
+// values they had before cfans took over. It hands the fans back to the
+// firmware when the worker dies without saying goodbye.
+struct guardian {
+  int fildes;
+  pid_t pid;
+};
+
+int guardian_start(struct app_context *app_context);
+int guardian_update_fan(struct app_context *app_context, int index);
+void guardian_release(struct app_context *app_context);
+size_t guardian_arena_size(void);
+
+#endif
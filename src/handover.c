@@ -0,0 +1,661 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "handover.h"
+#include "control.h"
+#include "sd_compat.h"
+
+#define SNAPSHOT_MAGIC 0x43464E53U // "CFNS"
+#define SNAPSHOT_VERSION 1U
+#define SNAPSHOT_FDNAME "snapshot"
+#define FDNAME_SIZE 32
+#define NOTIFY_SIZE 64
+#define STRING_MAX 4096
+
+struct snapshot_header {
+  uint32_t magic;
+  uint32_t version;
+  int32_t num_sensors;
+  int32_t num_fans;
+  int32_t num_curves;
+};
+
+// The snapshot is only read by the same build or a later one that checks
+// SNAPSHOT_VERSION, so records are written as plain structs
+struct sensor_record {
+  float current_value;
+  float window[FILTER_MEDIAN_MAX];
+  int32_t window_size;
+  int32_t window_len;
+  int32_t window_pos;
+  float value;
+  struct timespec timestamp;
+  bool primed;
+};
+
+struct fan_record {
+  char pwm_auto_control[HWMON_MAX_PWM_VALUE];
+  int32_t pwm_value;
+  float fan_percent;
+  float floor_percent;
+  struct timespec floor_until;
+};
+
+struct curve_record {
+  float hyst_val;
+  float fan_percent;
+  struct timespec timer;
+  int32_t failures;
+  bool failsafe;
+};
+
+static int put_string(FILE *file, const char *string)
+{
+  uint32_t len = string ? strlen(string) : 0;
+
+  if (fwrite(&len, sizeof(len), 1, file) != 1 || (len && fwrite(string, len, 1, file) != 1)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static char *get_string(FILE *file)
+{
+  uint32_t len;
+  if (fread(&len, sizeof(len), 1, file) != 1 || len > STRING_MAX) return NULL;
+
+  char *string = malloc(len + 1);
+  if (!string) return NULL;
+
+  if (len && fread(string, len, 1, file) != 1) {
+    free(string);
+    return NULL;
+  }
+  string[len] = '\0';
+
+  return string;
+}
+
+// Files are stored under the name of their slot in the previous instance;
+// the snapshot records which name belongs to which sensor or fan
+static int store_fd(int fildes, const char *fdname)
+{
+  char state[NOTIFY_SIZE];
+  (void)snprintf(state, sizeof(state), "FDSTORE=1\nFDNAME=%s", fdname);
+
+  int ret = sd_pid_notify_with_fds(0, 0, state, &fildes, 1);
+  if (ret <= 0) {
+    (void)fprintf(stderr, "Failed to store %s: %s\n", fdname, ret < 0 ? strerror(-ret) : "no service manager");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sensor_fildes(const struct app_sensor *sensor)
+{
+  if (sensor->get_temp_func != hwmon_read_temp || !sensor->sensor_data) return -1;
+
+  return ((const struct hwmon_sensor *)sensor->sensor_data)->fildes;
+}
+
+// Source device of a hwmon sensor, from the source whose slots hold it
+static const char *sensor_device_id(const struct app_context *app_context, int slot)
+{
+  for (int i = 0; i < app_context->num_sources; i++) {
+    const struct hwmon_source *source = &app_context->source[i];
+    if (!source->config) continue;
+
+    int first = source->config->sensor[0].slot;
+    if (slot >= first && slot < first + source->config->num_sensors) {
+      return source->device_id;
+    }
+  }
+
+  return NULL;
+}
+
+static int write_snapshot(FILE *file, const struct app_context *app_context)
+{
+  const struct fan_state *fan = &app_context->fan;
+  const struct curve_state *curve = &app_context->curve;
+  char fdname[FDNAME_SIZE];
+
+  struct snapshot_header header = {
+    .magic = SNAPSHOT_MAGIC,
+    .version = SNAPSHOT_VERSION,
+    .num_sensors = app_context->num_sensors,
+    .num_fans = app_context->num_fans,
+    .num_curves = app_context->num_curves
+  };
+  if (fwrite(&header, sizeof(header), 1, file) != 1) return -1;
+
+  for (int i = 0; i < app_context->num_sensors; i++) {
+    const struct app_sensor *sensor = &app_context->sensor[i];
+    const struct sensor_filter *filter = &sensor->filter;
+
+    struct sensor_record record = {
+      .current_value = sensor->current_value,
+      .window_size = filter->window_size,
+      .window_len = filter->window_len,
+      .window_pos = filter->window_pos,
+      .value = filter->value,
+      .timestamp = filter->timestamp,
+      .primed = filter->primed
+    };
+    memcpy(record.window, filter->window, sizeof(record.window));
+
+    fdname[0] = '\0';
+    if (sensor_fildes(sensor) >= 0) {
+      (void)snprintf(fdname, sizeof(fdname), "sensor%d", i);
+    }
+
+    if (put_string(file, sensor->name) < 0 ||
+        put_string(file, fdname[0] ? sensor_device_id(app_context, i) : NULL) < 0 ||
+        put_string(file, fdname) < 0 ||
+        fwrite(&record, sizeof(record), 1, file) != 1)
+    {
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    const struct hwmon_fan *hwmon = &fan->hwmon[i];
+
+    struct fan_record record = {
+      .pwm_value = fan->pwm_value[i],
+      .fan_percent = fan->fan_percent[i],
+      .floor_percent = fan->floor_percent[i],
+      .floor_until = fan->floor_until[i]
+    };
+    memcpy(record.pwm_auto_control, hwmon->pwm_auto_control, sizeof(record.pwm_auto_control));
+
+    fdname[0] = '\0';
+    if (fan->pwm_fildes[i] >= 0) {
+      (void)snprintf(fdname, sizeof(fdname), "pwm%d", i);
+    }
+
+    if (put_string(file, fan->name[i]) < 0 ||
+        put_string(file, hwmon->device_id) < 0 ||
+        put_string(file, hwmon->pwm_file) < 0 ||
+        put_string(file, fdname) < 0 ||
+        fwrite(&record, sizeof(record), 1, file) != 1)
+    {
+      return -1;
+    }
+  }
+
+  for (int c = 0; c < app_context->num_curves; c++) {
+    struct curve_record record = {
+      .hyst_val = curve->hyst_val[c],
+      .fan_percent = curve->fan_percent[c],
+      .timer = curve->timer[c],
+      .failures = curve->failures[c],
+      .failsafe = curve->failsafe[c]
+    };
+
+    if (put_string(file, curve->name[c]) < 0 || fwrite(&record, sizeof(record), 1, file) != 1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int create_snapshot(const struct app_context *app_context)
+{
+  int fildes = memfd_create("cfans-snapshot", MFD_CLOEXEC);
+  if (fildes < 0) {
+    perror("memfd_create");
+    return -1;
+  }
+
+  int dup_fildes = dup(fildes);
+  FILE *file = dup_fildes < 0 ? NULL : fdopen(dup_fildes, "w");
+  if (!file) {
+    perror("fdopen");
+    if (dup_fildes >= 0) close(dup_fildes);
+    close(fildes);
+    return -1;
+  }
+
+  int ret = write_snapshot(file, app_context);
+  if (fclose(file) == EOF) {
+    ret = -1;
+  }
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to write runtime snapshot\n");
+    close(fildes);
+    return -1;
+  }
+
+  return fildes;
+}
+
+// Leaves the open files and a snapshot of the control state to the service
+// manager so the next instance continues without touching the fans
+int handover_save(struct app_context *app_context)
+{
+  const struct fan_state *fan = &app_context->fan;
+
+  // The fans belong to the firmware until resume
+  if (app_context->suspended) {
+    (void)fprintf(stderr, "Not handing over while suspended\n");
+    return -1;
+  }
+
+  int needed = 1;
+  for (int i = 0; i < app_context->num_sensors; i++) {
+    needed += sensor_fildes(&app_context->sensor[i]) >= 0;
+  }
+  for (int i = 0; i < app_context->num_fans; i++) {
+    needed += fan->pwm_fildes[i] >= 0;
+  }
+
+  const char *capacity = getenv("FDSTORE");
+  if (!capacity || atoi(capacity) < needed) {
+    (void)fprintf(stderr, "File descriptor store holds %s, %d needed for handover\n",
+                  capacity ? capacity : "nothing", needed);
+    return -1;
+  }
+
+  char fdname[FDNAME_SIZE];
+
+  for (int i = 0; i < app_context->num_sensors; i++) {
+    int fildes = sensor_fildes(&app_context->sensor[i]);
+    if (fildes < 0) continue;
+
+    (void)snprintf(fdname, sizeof(fdname), "sensor%d", i);
+    if (store_fd(fildes, fdname) < 0) return -1;
+  }
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    if (fan->pwm_fildes[i] < 0) continue;
+
+    (void)snprintf(fdname, sizeof(fdname), "pwm%d", i);
+    if (store_fd(fan->pwm_fildes[i], fdname) < 0) return -1;
+  }
+
+  // Stored last, so the next instance only finds it once every file is there
+  int fildes = create_snapshot(app_context);
+  if (fildes < 0) return -1;
+
+  int ret = store_fd(fildes, SNAPSHOT_FDNAME);
+  if (close(fildes) == -1) {
+    perror("close");
+  }
+
+  return ret;
+}
+
+static int find_fdname(char **names, int num_fds, const char *fdname)
+{
+  if (!fdname[0]) return -1;
+
+  for (int k = 0; k < num_fds; k++) {
+    if (names[k] && strcmp(names[k], fdname) == 0) {
+      free(names[k]);
+      names[k] = NULL;
+      return SD_LISTEN_FDS_START + k;
+    }
+  }
+
+  return -1;
+}
+
+static int read_sensors(FILE *file, struct handover *handover, char **names, int num_fds)
+{
+  for (int i = 0; i < handover->num_sensors; i++) {
+    struct handover_sensor *sensor = &handover->sensor[i];
+    struct sensor_record record;
+
+    sensor->name = get_string(file);
+    sensor->device_id = get_string(file);
+    char *fdname = get_string(file);
+    if (!sensor->name || !sensor->device_id || !fdname || fread(&record, sizeof(record), 1, file) != 1) {
+      free(fdname);
+      return -1;
+    }
+
+    sensor->fildes = find_fdname(names, num_fds, fdname);
+    free(fdname);
+
+    sensor->current_value = record.current_value;
+    memcpy(sensor->filter.window, record.window, sizeof(record.window));
+    sensor->filter.window_size = record.window_size;
+    sensor->filter.window_len = record.window_len;
+    sensor->filter.window_pos = record.window_pos;
+    sensor->filter.value = record.value;
+    sensor->filter.timestamp = record.timestamp;
+    sensor->filter.primed = record.primed;
+  }
+
+  return 0;
+}
+
+static int read_fans(FILE *file, struct handover *handover, char **names, int num_fds)
+{
+  for (int i = 0; i < handover->num_fans; i++) {
+    struct handover_fan *fan = &handover->fan[i];
+    struct fan_record record;
+
+    fan->name = get_string(file);
+    fan->device_id = get_string(file);
+    fan->pwm_file = get_string(file);
+    char *fdname = get_string(file);
+    if (!fan->name || !fan->device_id || !fan->pwm_file || !fdname ||
+        fread(&record, sizeof(record), 1, file) != 1)
+    {
+      free(fdname);
+      return -1;
+    }
+
+    fan->fildes = find_fdname(names, num_fds, fdname);
+    free(fdname);
+
+    memcpy(fan->pwm_auto_control, record.pwm_auto_control, sizeof(fan->pwm_auto_control));
+    fan->pwm_auto_control[sizeof(fan->pwm_auto_control) - 1] = '\0';
+    fan->pwm_value = record.pwm_value;
+    fan->fan_percent = record.fan_percent;
+    fan->floor_percent = record.floor_percent;
+    fan->floor_until = record.floor_until;
+  }
+
+  return 0;
+}
+
+static int read_curves(FILE *file, struct handover *handover)
+{
+  for (int c = 0; c < handover->num_curves; c++) {
+    struct handover_curve *curve = &handover->curve[c];
+    struct curve_record record;
+
+    curve->name = get_string(file);
+    if (!curve->name || fread(&record, sizeof(record), 1, file) != 1) return -1;
+
+    curve->hyst_val = record.hyst_val;
+    curve->fan_percent = record.fan_percent;
+    curve->timer = record.timer;
+    curve->failures = record.failures;
+    curve->failsafe = record.failsafe;
+  }
+
+  return 0;
+}
+
+static void free_handover(struct handover *handover)
+{
+  for (int i = 0; i < handover->num_sensors; i++) {
+    if (handover->sensor[i].fildes >= 0) close(handover->sensor[i].fildes);
+    free(handover->sensor[i].name);
+    free(handover->sensor[i].device_id);
+  }
+  for (int i = 0; i < handover->num_fans; i++) {
+    if (handover->fan[i].fildes >= 0) close(handover->fan[i].fildes);
+    free(handover->fan[i].name);
+    free(handover->fan[i].device_id);
+    free(handover->fan[i].pwm_file);
+  }
+  for (int c = 0; c < handover->num_curves; c++) {
+    free(handover->curve[c].name);
+  }
+
+  free(handover->sensor);
+  free(handover->fan);
+  free(handover->curve);
+  free(handover);
+}
+
+static struct handover *read_snapshot(int fildes, char **names, int num_fds)
+{
+  // The writer's duplicate shared the file offset, which is now at the end
+  int dup_fildes = dup(fildes);
+  if (dup_fildes >= 0 && lseek(dup_fildes, 0, SEEK_SET) == -1) {
+    perror("lseek");
+  }
+  FILE *file = dup_fildes < 0 ? NULL : fdopen(dup_fildes, "r");
+  if (!file) {
+    perror("fdopen");
+    if (dup_fildes >= 0) close(dup_fildes);
+    return NULL;
+  }
+
+  struct snapshot_header header;
+  struct handover *handover = NULL;
+
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != SNAPSHOT_MAGIC ||
+      header.version != SNAPSHOT_VERSION || header.num_sensors < 0 || header.num_fans < 0 ||
+      header.num_curves < 0)
+  {
+    (void)fprintf(stderr, "Ignoring runtime snapshot of another version\n");
+    goto out;
+  }
+
+  handover = calloc(1, sizeof(*handover));
+  if (!handover) goto out;
+
+  handover->sensor = calloc(header.num_sensors, sizeof(*handover->sensor));
+  handover->fan = calloc(header.num_fans, sizeof(*handover->fan));
+  handover->curve = calloc(header.num_curves, sizeof(*handover->curve));
+  if ((header.num_sensors && !handover->sensor) || (header.num_fans && !handover->fan) ||
+      (header.num_curves && !handover->curve))
+  {
+    free_handover(handover);
+    handover = NULL;
+    goto out;
+  }
+
+  handover->num_sensors = header.num_sensors;
+  handover->num_fans = header.num_fans;
+  handover->num_curves = header.num_curves;
+
+  // Records not read yet must not close anything when a truncated
+  // snapshot is freed
+  for (int i = 0; i < handover->num_sensors; i++) {
+    handover->sensor[i].fildes = -1;
+  }
+  for (int i = 0; i < handover->num_fans; i++) {
+    handover->fan[i].fildes = -1;
+  }
+
+  if (read_sensors(file, handover, names, num_fds) == 0 &&
+      read_fans(file, handover, names, num_fds) == 0 &&
+      read_curves(file, handover) == 0)
+  {
+    goto out;
+  }
+
+  (void)fprintf(stderr, "Runtime snapshot is truncated\n");
+  free_handover(handover);
+  handover = NULL;
+
+out:
+  if (fclose(file) == EOF) {
+    perror("fclose");
+  }
+  return handover;
+}
+
+// Picks up what a previous instance left in the file descriptor store. The
+// store is emptied straight away so a later crash does not bring back stale
+// state; anything not taken over is closed by handover_restore()
+int handover_load(struct app_context *app_context)
+{
+  char **names = NULL;
+  int num_fds = sd_listen_fds_with_names(1, &names);
+  if (num_fds <= 0) return 0;
+
+  int snapshot = -1;
+  for (int k = 0; k < num_fds; k++) {
+    char state[NOTIFY_SIZE];
+    (void)snprintf(state, sizeof(state), "FDSTOREREMOVE=1\nFDNAME=%s", names[k]);
+    (void)sd_notify(0, state);
+
+    if (strcmp(names[k], SNAPSHOT_FDNAME) == 0) {
+      snapshot = SD_LISTEN_FDS_START + k;
+      free(names[k]);
+      names[k] = NULL;
+    }
+  }
+
+  if (snapshot >= 0) {
+    app_context->handover = read_snapshot(snapshot, names, num_fds);
+    if (close(snapshot) == -1) {
+      perror("close");
+    }
+  }
+
+  // Files the snapshot did not claim
+  for (int k = 0; k < num_fds; k++) {
+    if (!names[k]) continue;
+
+    if (close(SD_LISTEN_FDS_START + k) == -1) {
+      perror("close");
+    }
+    free(names[k]);
+  }
+  free(names);
+
+  if (app_context->handover) {
+    (void)fprintf(stderr, "Taking over from the previous instance\n");
+  }
+
+  return 0;
+}
+
+int handover_find_sensor(const struct handover *handover, const char *name, const char *device_id)
+{
+  for (int i = 0; i < handover->num_sensors; i++) {
+    const struct handover_sensor *sensor = &handover->sensor[i];
+
+    if (sensor->fildes >= 0 && strcmp(sensor->name, name) == 0 && device_id &&
+        strcmp(sensor->device_id, device_id) == 0)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+int handover_take_sensor(struct handover *handover, int index)
+{
+  int fildes = handover->sensor[index].fildes;
+  handover->sensor[index].fildes = -1;
+
+  return fildes;
+}
+
+// The previous instance left the fan under manual control, so its original
+// mode comes from the snapshot rather than from pwm_enable
+int handover_take_fan(struct handover *handover, const char *name, const char *device_id,
+                      const char *pwm_file, char *pwm_auto_control)
+{
+  for (int i = 0; i < handover->num_fans; i++) {
+    struct handover_fan *fan = &handover->fan[i];
+
+    if (fan->fildes < 0 || strcmp(fan->name, name) != 0 || !device_id ||
+        strcmp(fan->device_id, device_id) != 0 || strcmp(fan->pwm_file, pwm_file) != 0)
+    {
+      continue;
+    }
+
+    int fildes = fan->fildes;
+    fan->fildes = -1;
+    memcpy(pwm_auto_control, fan->pwm_auto_control, sizeof(fan->pwm_auto_control));
+
+    return fildes;
+  }
+
+  return -1;
+}
+
+static void restore_sensor(struct app_sensor *sensor, const struct handover_sensor *saved)
+{
+  sensor->current_value = saved->current_value;
+
+  // A filter whose window changed starts over
+  struct sensor_filter *filter = &sensor->filter;
+  if (!filter->config || filter->window_size != saved->filter.window_size ||
+      saved->filter.window_len > FILTER_MEDIAN_MAX || saved->filter.window_pos >= FILTER_MEDIAN_MAX)
+  {
+    return;
+  }
+
+  memcpy(filter->window, saved->filter.window, sizeof(filter->window));
+  filter->window_len = saved->filter.window_len;
+  filter->window_pos = saved->filter.window_pos;
+  filter->value = saved->filter.value;
+  filter->timestamp = saved->filter.timestamp;
+  filter->primed = saved->filter.primed;
+}
+
+// Carries the control state over by name, so curves, fans and sensors
+// added or renamed since the previous instance start cold
+void handover_restore(struct app_context *app_context)
+{
+  struct handover *handover = app_context->handover;
+  if (!handover) return;
+
+  for (int i = 0; i < app_context->num_sensors; i++) {
+    struct app_sensor *sensor = &app_context->sensor[i];
+
+    for (int k = 0; k < handover->num_sensors; k++) {
+      if (sensor->name && strcmp(sensor->name, handover->sensor[k].name) == 0) {
+        restore_sensor(sensor, &handover->sensor[k]);
+        break;
+      }
+    }
+  }
+
+  struct fan_state *fan = &app_context->fan;
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    if (!fan->hwmon[i].adopted) continue;
+
+    for (int k = 0; k < handover->num_fans; k++) {
+      const struct handover_fan *saved = &handover->fan[k];
+      if (strcmp(fan->name[i], saved->name) != 0) continue;
+
+      fan->pwm_value[i] = saved->pwm_value;
+      fan->fan_percent[i] = saved->fan_percent;
+      fan->floor_percent[i] = saved->floor_percent;
+      fan->floor_until[i] = saved->floor_until;
+      break;
+    }
+  }
+
+  struct curve_state *curve = &app_context->curve;
+
+  for (int c = 0; c < app_context->num_curves; c++) {
+    for (int k = 0; k < handover->num_curves; k++) {
+      const struct handover_curve *saved = &handover->curve[k];
+      if (strcmp(curve->name[c], saved->name) != 0) continue;
+
+      curve->hyst_val[c] = saved->hyst_val;
+      curve->fan_percent[c] = saved->fan_percent;
+      curve->timer[c] = saved->timer;
+      curve->failures[c] = saved->failures;
+      curve->failsafe[c] = saved->failsafe;
+      break;
+    }
+  }
+
+  handover_free(app_context);
+}
+
+void handover_free(struct app_context *app_context)
+{
+  if (!app_context->handover) return;
+
+  free_handover(app_context->handover);
+  app_context->handover = NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "filter.h"
+#include "hwmon.h"
+
+struct app_context;
+
+struct handover_sensor {
+  char *name;
+  char *device_id;
+  int fildes;
+
+  float current_value;
+  struct sensor_filter filter;
+};
+
+struct handover_fan {
+  char *name;
+  char *device_id;
+  char *pwm_file;
+  char pwm_auto_control[HWMON_MAX_PWM_VALUE];
+  int fildes;
+
+  int pwm_value;
+  float fan_percent;
+  float floor_percent;
+  struct timespec floor_until;
+};
+
+struct handover_curve {
+  char *name;
+
+  float hyst_val;
+  float fan_percent;
+  struct timespec timer;
+  int failures;
+  bool failsafe;
+};
+
+// Runtime state and open files left in the service manager's file
+// descriptor store by the previous instance
+struct handover {
+  struct handover_sensor *sensor;
+  int num_sensors;
+
+  struct handover_fan *fan;
+  int num_fans;
+
+  struct handover_curve *curve;
+  int num_curves;
+};
+
+int handover_load(struct app_context *app_context);
+int handover_find_sensor(const struct handover *handover, const char *name, const char *device_id);
+int handover_take_sensor(struct handover *handover, int index);
+int handover_take_fan(struct handover *handover, const char *name, const char *device_id,
+                      const char *pwm_file, char *pwm_auto_control);
+void handover_restore(struct app_context *app_context);
+void handover_free(struct app_context *app_context);
+int handover_save(struct app_context *app_context);
+
+#endif
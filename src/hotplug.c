@@ -0,0 +1,113 @@
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hotplug.h"
+#include "arena.h"
+#include "control.h"
+#include "device.h"
+#include "guardian.h"
+#include "hwmon.h"
+#include "loop.h"
+
+static bool same_device(struct device *a, struct device *b)
+{
+  const char *a_syspath = device_syspath(a);
+  const char *b_syspath = device_syspath(b);
+
+  return a_syspath && b_syspath && strcmp(a_syspath, b_syspath) == 0;
+}
+
+static void handle_remove(struct app_context *app_context, struct device *device)
+{
+  for (int i = 0; i < app_context->num_sources; i++) {
+    struct hwmon_source *source = &app_context->source[i];
+    if (!same_device(source->device, device)) continue;
+
+    (void)fprintf(stderr, "hwmon device of \"%s\" removed\n", source->device_id);
+    hwmon_unbind_source(app_context, i);
+  }
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    struct hwmon_fan *fan = &app_context->fan.hwmon[i];
+    if (!same_device(fan->device, device)) continue;
+
+    (void)fprintf(stderr, "hwmon device of %s removed\n", app_context->fan.name[i]);
+    hwmon_unbind_fan(app_context, i);
+  }
+}
+
+// Only sources and fans that lost their device are rebound; everything
+// else keeps its open files
+static void handle_add(struct app_context *app_context, struct device *device)
+{
+  for (int i = 0; i < app_context->num_sources; i++) {
+    struct hwmon_source *source = &app_context->source[i];
+    if (!source->config || source->device || !device_parent_matches(device, source->device_id)) {
+      continue;
+    }
+
+    if (hwmon_rebind_source(app_context, i) == 0) {
+      (void)fprintf(stderr, "hwmon device of \"%s\" rebound\n", source->device_id);
+    }
+  }
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    struct hwmon_fan *fan = &app_context->fan.hwmon[i];
+    if (fan->device || !device_parent_matches(device, fan->device_id)) continue;
+
+    if (hwmon_rebind_fan(app_context, i) == 0) {
+      (void)fprintf(stderr, "hwmon device of %s rebound\n", app_context->fan.name[i]);
+      guardian_update_fan(app_context, i);
+    }
+  }
+}
+
+static void handle_uevent(void *userdata, enum device_action action, struct device *device)
+{
+  struct app_context *app_context = userdata;
+
+  if (action == DEVICE_REMOVE) {
+    handle_remove(app_context, device);
+  }
+  else if (action == DEVICE_ADD) {
+    handle_add(app_context, device);
+  }
+}
+
+static void handle_event(void *userdata, short revents)
+{
+  struct hotplug *hotplug = userdata;
+  (void)revents;
+
+  (void)device_monitor_receive(hotplug->monitor, handle_uevent, hotplug->app_context);
+}
+
+int hotplug_init(struct app_context *app_context, struct event_loop *loop)
+{
+  struct hotplug *hotplug = arena_alloc(&app_context->arena, 1, sizeof(*hotplug));
+  if (!hotplug) return -1;
+  hotplug->app_context = app_context;
+  app_context->hotplug = hotplug;
+
+  if (device_monitor_new(&hotplug->monitor) < 0) return -1;
+
+  hotplug->fildes = device_monitor_fd(hotplug->monitor);
+  if (hotplug->fildes < 0) return -1;
+
+  return loop_add(loop, hotplug->fildes, POLLIN, handle_event, hotplug);
+}
+
+void hotplug_destroy(struct app_context *app_context)
+{
+  struct hotplug *hotplug = app_context->hotplug;
+  if (!hotplug) return;
+
+  device_monitor_free(hotplug->monitor);
+  app_context->hotplug = NULL;
+}
+
+size_t hotplug_arena_size(void)
+{
+  return arena_size(1, sizeof(struct hotplug));
+}
@@ -0,0 +1,21 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <stddef.h>
+
+struct app_context;
+struct device_monitor;
+struct event_loop;
+
+struct hotplug {
+  struct device_monitor *monitor;
+  int fildes;
+
+  struct app_context *app_context;
+};
+
+int hotplug_init(struct app_context *app_context, struct event_loop *loop);
+void hotplug_destroy(struct app_context *app_context);
+size_t hotplug_arena_size(void);
+
+#endif
@@ -1,80 +1,121 @@
+#include <errno.h>
 #include <linux/limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <systemd/sd-device.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "hwmon.h"
+#include "arena.h"
 #include "control.h"
 #include "config.h"
+#include "gpu_metrics.h"
+#include "handover.h"
 
 #define HWMON_FILENAME_BUFFER_SIZE 32
-#define HWMON_MAX_PWM_VALUE 16
 #define TEMP_INPUT_SIZE 32
+#define PWM_ENABLE_SUFFIX "_enable"
+#define PWM_MANUAL_CONTROL "1"
 
-static sd_device *get_sd_device(const char *device_id)
+static void close_sensor(struct hwmon_sensor *sensor)
 {
-  sd_device_enumerator *enumerator [[gnu::cleanup(sd_device_enumerator_unrefp)]] = NULL;
-  sd_device *parent [[gnu::cleanup(sd_device_unrefp)]] = NULL;
-
-  int ret = sd_device_new_from_device_id(&parent, device_id);
-  if (ret < 0) {
-    (void)fprintf(stderr, "failed to find device ID \"%s\": %s\n", device_id, strerror(-ret));
-    return NULL;
+  if (sensor->fildes >= 0 && close(sensor->fildes) == -1) {
+    perror("close");
   }
+  sensor->fildes = -1;
+}
 
-  ret = sd_device_enumerator_new(&enumerator);
-  if (ret < 0) {
-    (void)fprintf(stderr, "failed to create enumerator: %s\n", strerror(-ret));
-    return NULL;
-  }
+static void destroy_sensor(struct app_sensor *app_sensor)
+{
+  close_sensor(app_sensor->sensor_data);
+}
 
-  ret = sd_device_enumerator_add_match_parent(enumerator, parent);
-  if (ret < 0) {
-    (void)fprintf(stderr, "failed to add parent match: %s\n", strerror(-ret));
-    return NULL;
+static int init_gpu_metrics_source(struct source_config *source_config,
+                                   struct app_context *app_context)
+{
+  if (source_config->device_id == NULL) {
+    (void)fprintf(stderr, "Config error: \"%s\" has no device id\n", source_config->name);
+    return -1;
   }
 
-  ret = sd_device_enumerator_add_match_subsystem(enumerator, "hwmon", 1);
-  if (ret < 0) {
-    (void)fprintf(stderr, "failed to add subsystem match: %s\n", strerror(-ret));
-    return NULL;
+  char syspath[PATH_MAX];
+  if (device_resolve_id(source_config->device_id, syspath, sizeof(syspath)) < 0) {
+    return -1;
   }
 
-  sd_device *child = sd_device_enumerator_get_device_first(enumerator);
-  if (child == NULL) {
-    (void)fprintf(stderr, "Error: no hwmon device for PCI device \"%s\"\n", device_id);
-    return NULL;
+  return gpu_metrics_init_sensors(syspath, source_config, app_context);
+}
+
+static int link_sensor(struct app_sensor *app_sensor, const struct sensor_config *config,
+                       struct hwmon_sensor *sensor, struct arena *arena)
+{
+  sensor->label = arena_strdup(arena, sensor_label(config));
+  if (!sensor->label) return -1;
+
+  sensor->scale = 0;
+  sensor->offset = config->offset;
+
+  app_sensor->config = config;
+  app_sensor->sensor_data = sensor;
+  app_sensor->get_temp_func = hwmon_read_temp;
+  app_sensor->destroy_func = destroy_sensor;
+
+  return 0;
+}
+
+// Takes over the inputs a previous instance left open instead of scanning
+// the device's labels, but only if it left all of them. Returns 1 when the
+// source's sensors were taken over.
+static int adopt_sensors(struct source_config *source_config, struct app_context *app_context)
+{
+  struct handover *handover = app_context->handover;
+  if (!handover) return 0;
+
+  for (int i = 0; i < source_config->num_sensors; i++) {
+    if (handover_find_sensor(handover, source_config->sensor[i].name, source_config->device_id) < 0) {
+      return 0;
+    }
   }
 
-  const char *devpath;
-  ret = sd_device_get_devpath(child, &devpath);
-  if (ret < 0) {
-    (void)fprintf(stderr, "failed to get hwmon devpath for PCI device \"%s\": %s\n", device_id, strerror(-ret));
-    return NULL;
+  for (int i = 0; i < source_config->num_sensors; i++) {
+    struct sensor_config *config = &source_config->sensor[i];
+    struct app_sensor *app_sensor = &app_context->sensor[config->slot];
+
+    if (filter_init(&app_sensor->filter, &config->filter, config->name) < 0) return -1;
+
+    struct hwmon_sensor *sensor = arena_alloc(&app_context->arena, 1, sizeof(struct hwmon_sensor));
+    if (!sensor) return -1;
+
+    int index = handover_find_sensor(handover, config->name, source_config->device_id);
+    sensor->fildes = handover_take_sensor(handover, index);
+    if (link_sensor(app_sensor, config, sensor, &app_context->arena) < 0) return -1;
   }
 
-  return sd_device_ref(child);
+  return 1;
 }
 
-static int init_sensors(sd_device *device,
-                         struct source_config *source_config,
-                         struct app_context *app_context)
+// Sensor names are unique across the config, labels only within a source
+static int find_label(const struct source_config *source_config, const char *label)
 {
-  const char *syspath;
-  int ret = sd_device_get_syspath(device, &syspath);
-  if (ret < 0) {
-    (void)fprintf(stderr, "Failed to get path for \"%s\": %s\n", source_config->device_id, strerror(-ret));
-    return -1;
+  for (int i = 0; i < source_config->num_sensors; i++) {
+    if (strcmp(sensor_label(&source_config->sensor[i]), label) == 0) return i;
   }
 
+  return -1;
+}
+
+static int init_sensors(struct device *device,
+                        struct source_config *source_config,
+                        struct app_context *app_context)
+{
+  const char *syspath = device_syspath(device);
+
   int count = 0;
-  for (const char *sysattr = sd_device_get_sysattr_first(device);
+  for (const char *sysattr = device_attr_first(device);
        sysattr;
-       sysattr = sd_device_get_sysattr_next(device))
+       sysattr = device_attr_next(device))
   {
     if (count >= source_config->num_sensors) break;
 
@@ -83,47 +124,56 @@ static int init_sensors(sd_device *device,
     }
 
     const char *value;
-    ret = sd_device_get_sysattr_value(device, sysattr, &value);
-    if (ret < 0) {
-      (void)fprintf(stderr, "Failed to read \"%s\": %s\n", sysattr, strerror(-ret));
+    if (device_attr_read(device, sysattr, &value) < 0) {
+      (void)fprintf(stderr, "Failed to read \"%s\": %s\n", sysattr, strerror(errno));
+      continue;
+    }
+
+    int index = find_label(source_config, value);
+    if (index < 0) continue;
+
+    struct app_sensor *app_sensor = &app_context->sensor[source_config->sensor[index].slot];
+    if (app_sensor->sensor_data != NULL) {
       continue;
     }
 
+    if (filter_init(&app_sensor->filter, &source_config->sensor[index].filter,
+                    source_config->sensor[index].name) < 0) {
+      return -1;
+    }
+
+    struct hwmon_sensor *sensor = arena_alloc(&app_context->arena, 1, sizeof(struct hwmon_sensor));
+    if (!sensor) return -1;
+
+    long num = strtol(sysattr + strlen("temp"), NULL, 0);
+    char temp_input_path[PATH_MAX];
+    if (snprintf(temp_input_path, sizeof(temp_input_path), "%s/temp%li_input", syspath, num) >=
+        (int)sizeof(temp_input_path))
+    {
+      (void)fprintf(stderr, "Path truncated: %s\n", temp_input_path);
+      return -1;
+    }
+
+    sensor->fildes = open(temp_input_path, O_RDONLY | O_CLOEXEC);
+    if (sensor->fildes < 0) {
+      (void)fprintf(stderr, "Failed to open %s: %s\n", temp_input_path, strerror(errno));
+      return -1;
+    }
+
+    if (link_sensor(app_sensor, &source_config->sensor[index], sensor, &app_context->arena) < 0) {
+      return -1;
+    }
+    count++;
+  }
+
+  if (count < source_config->num_sensors) {
     for (int i = 0; i < source_config->num_sensors; i++) {
-      if (strcmp(source_config->sensor[i].name, value) == 0) {
-        struct hwmon_sensor *sensor = malloc(sizeof(struct hwmon_sensor));
-
-        long num = strtol(sysattr + strlen("temp"), NULL, 0);
-        char *temp_input_path;
-        if (asprintf(&temp_input_path, "%s/temp%li_input", syspath, num) < 0) {
-          perror("asprintf");
-          return -1;
-        }
-
-        sensor->fildes = open(temp_input_path, O_RDONLY);
-        if (sensor->fildes < 0) {
-          (void)fprintf(stderr, "Failed to open %s: %s\n", temp_input_path, strerror(errno));
-          free(temp_input_path);
-          free(sensor);
-          return -1;
-        }
-        free(temp_input_path);
-
-        sensor->scale = 0;
-        sensor->offset = source_config->sensor[i].offset;
-
-        app_context->sensor[app_context->num_sensors].name = source_config->sensor[i].name;
-        app_context->sensor[app_context->num_sensors].config = &source_config->sensor[i];
-        app_context->sensor[app_context->num_sensors].sensor_data = sensor;
-        app_context->sensor[app_context->num_sensors].get_temp_func = hwmon_read_temp;
-        app_context->num_sensors++;
-        app_context->num_hwmon_sensors++;
-
-        count++;
-        break;
+      if (app_context->sensor[source_config->sensor[i].slot].sensor_data == NULL) {
+        (void)fprintf(stderr, "Error: no sensor \"%s\" found for \"%s\"\n",
+                      source_config->sensor[i].name, source_config->name);
       }
     }
-
+    return -1;
   }
 
   return 0;
@@ -131,24 +181,41 @@ static int init_sensors(sd_device *device,
 
 int hwmon_init_sources(struct config *config, struct app_context *app_context)
 {
-  int sensor_count = 0;
+  app_context->source = arena_alloc(&app_context->arena, config->num_sources,
+                                    sizeof(*app_context->source));
+  if (config->num_sources && !app_context->source) return -1;
+  app_context->num_sources = config->num_sources;
+
   for (int i = 0; i < config->num_sources; i++) {
-    sensor_count += config->source[i].num_sensors;
-  }
+    if (config->source[i].num_sensors == 0) continue;
 
-  app_context->sensor = calloc(sensor_count, sizeof(struct app_sensor));
-  if (app_context->sensor == NULL) {
-    perror("Failed to allocate app_sensor array");
-    return -1;
-  }
+    if (config->source[i].type && strcmp(config->source[i].type, "gpu metrics") == 0) {
+      if (init_gpu_metrics_source(&config->source[i], app_context) < 0) {
+        return -1;
+      }
+      continue;
+    }
 
-  for (int i = 0; i < config->num_sources; i++) {
-    sd_device *device [[gnu::cleanup(sd_device_unrefp)]] = NULL;
-    device = get_sd_device(config->source[i].device_id);
-    if (device == NULL) {
+    if (config->source[i].type && strcmp(config->source[i].type, "hwmon") != 0) {
+      (void)fprintf(stderr, "Config error: unknown source type \"%s\"\n", config->source[i].type);
+      return -1;
+    }
+
+    struct hwmon_source *source = &app_context->source[i];
+    source->config = &config->source[i];
+    source->device_id = arena_strdup(&app_context->arena, config->source[i].device_id);
+    if (!source->device_id) return -1;
+
+    source->device = device_find_hwmon(config->source[i].device_id);
+    if (source->device == NULL) {
       return -1;
     }
-    if (init_sensors(device, &config->source[i], app_context) < 0) {
+
+    int adopted = adopt_sensors(&config->source[i], app_context);
+    if (adopted < 0) return -1;
+    if (adopted) continue;
+
+    if (init_sensors(source->device, &config->source[i], app_context) < 0) {
       return -1;
     }
   }
@@ -156,79 +223,140 @@ int hwmon_init_sources(struct config *config, struct app_context *app_context)
   return 0;
 }
 
-static int init_fan(const char *syspath, struct fan_config *config, struct hwmon_fan *fan)
+// pwm_enable is kept open so switching between manual and automatic
+// control never has to look the device up again
+static int open_pwm_enable(const char *syspath, const char *pwm_enable_file)
+{
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", syspath, pwm_enable_file) >= (int)sizeof(path)) {
+    (void)fprintf(stderr, "Path truncated: %s\n", path);
+    return -1;
+  }
+
+  int fildes = open(path, O_RDWR | O_CLOEXEC);
+  if (fildes < 0) {
+    (void)fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+  }
+
+  return fildes;
+}
+
+static void close_pwm_enable(struct hwmon_fan *fan)
 {
+  if (fan->pwm_enable_fildes >= 0 && close(fan->pwm_enable_fildes) == -1) {
+    perror("close");
+  }
+  fan->pwm_enable_fildes = -1;
+}
+
+static int init_fan(const char *syspath, struct fan_config *config, struct hwmon_fan *fan,
+                    int *pwm_fildes, struct app_context *app_context)
+{
+  struct arena *arena = &app_context->arena;
+
   char pwm_file[PATH_MAX];
   if (snprintf(pwm_file, sizeof(pwm_file), "%s/%s", syspath, config->pwm_file) >= (int)sizeof(pwm_file)) {
     (void)fprintf(stderr, "Path truncated: %s\n", pwm_file);
     return -1;
   }
 
-  if (asprintf(&fan->pwm_enable_file, "%s_enable", config->pwm_file) < 0) {
-    perror("asprintf");
-    return -1;
+  size_t enable_size = strlen(config->pwm_file) + sizeof(PWM_ENABLE_SUFFIX);
+  fan->pwm_enable_file = arena_alloc(arena, enable_size, 1);
+  if (!fan->pwm_enable_file) return -1;
+  (void)snprintf(fan->pwm_enable_file, enable_size, "%s" PWM_ENABLE_SUFFIX, config->pwm_file);
+
+  fan->pwm_enable_fildes = open_pwm_enable(syspath, fan->pwm_enable_file);
+  if (fan->pwm_enable_fildes < 0) return -1;
+
+  if (app_context->handover) {
+    *pwm_fildes = handover_take_fan(app_context->handover, config->name, config->device_id,
+                                    config->pwm_file, fan->pwm_auto_control);
+    fan->adopted = *pwm_fildes >= 0;
+    if (fan->adopted) return 0;
   }
 
-  fan->pwm_fildes = open(pwm_file, O_WRONLY);
-  if (fan->pwm_fildes < 0) {
+  *pwm_fildes = open(pwm_file, O_WRONLY | O_CLOEXEC);
+  if (*pwm_fildes < 0) {
     (void)fprintf(stderr, "Failed to open %s: %s\n", pwm_file, strerror(errno));
     return -1;
   }
 
-  if (sd_device_get_sysattr_value(fan->device, fan->pwm_enable_file, &fan->pwm_auto_control) < 0) {
-    (void)fprintf(stderr, "Failed to read %s\n", fan->pwm_enable_file);
+  ssize_t nread = pread(fan->pwm_enable_fildes, fan->pwm_auto_control,
+                        sizeof(fan->pwm_auto_control), 0);
+  if (nread < 0) {
+    (void)fprintf(stderr, "Failed to read %s: %s\n", fan->pwm_enable_file, strerror(errno));
+    return -1;
+  }
+  while (nread > 0 && fan->pwm_auto_control[nread - 1] == '\n') nread--;
+  if (nread == 0 || nread >= (ssize_t)sizeof(fan->pwm_auto_control)) {
+    (void)fprintf(stderr, "Unexpected %s value\n", fan->pwm_enable_file);
     return -1;
   }
+  fan->pwm_auto_control[nread] = '\0';
 
   return 0;
 }
 
 int hwmon_init_fans(struct config *config, struct app_context *app_context)
 {
-  app_context->fan = calloc(config->num_fans, sizeof(struct app_fan));
+  struct fan_state *fan = &app_context->fan;
 
   for (int i = 0; i < config->num_fans; i++) {
-    app_context->fan[i].hwmon = malloc(sizeof(struct hwmon_fan));
-    if (!app_context->fan[i].hwmon ) {
-      perror("Failed to allocate hwmon_fan struct");
-      return -1;
-    }
+    fan->hwmon[i].device_id = arena_strdup(&app_context->arena, config->fan[i].device_id);
+    fan->hwmon[i].pwm_file = arena_strdup(&app_context->arena, config->fan[i].pwm_file);
+    if (!fan->hwmon[i].device_id || !fan->hwmon[i].pwm_file) return -1;
 
-    app_context->fan[i].hwmon->device = get_sd_device(config->fan[i].device_id);
-    if (!app_context->fan[i].hwmon->device) return -1;
+    fan->hwmon[i].device = device_find_hwmon(config->fan[i].device_id);
+    if (!fan->hwmon[i].device) return -1;
 
-    const char *syspath;
-    int ret = sd_device_get_syspath(app_context->fan[i].hwmon->device, &syspath);
-    if (ret < 0) {
-      (void)fprintf(stderr, "Failed to get path for \"%s\": %s\n",
-                    config->fan[i].device_id, strerror(-ret));
+    if (init_fan(device_syspath(fan->hwmon[i].device), &config->fan[i], &fan->hwmon[i], &fan->pwm_fildes[i], app_context) < 0)
+    {
       return -1;
     }
+  }
+
+  return 0;
+}
 
-    if (init_fan(syspath, &config->fan[i], app_context->fan[i].hwmon) < 0) return -1;
+size_t hwmon_arena_size(const struct config *config)
+{
+  size_t size = arena_size(config->num_sources, sizeof(struct hwmon_source));
 
-    app_context->fan[i].config = &config->fan[i];
-    app_context->fan[i].curve = calloc(1, sizeof(struct app_curve));
-    if (!app_context->fan[i].curve) {
-      perror("Failed to allocate app_curve");
-      return -1;
+  for (int i = 0; i < config->num_sources; i++) {
+    if (config->source[i].type && strcmp(config->source[i].type, "gpu metrics") == 0) {
+      size += gpu_metrics_arena_size(&config->source[i]);
     }
+    else {
+      size += arena_size(config->source[i].num_sensors, sizeof(struct hwmon_sensor)) +
+              arena_string_size(config->source[i].device_id);
 
-    app_context->fan[i].curve->config = config->fan[i].curve;
-    app_context->num_fans++;
+      for (int j = 0; j < config->source[i].num_sensors; j++) {
+        size += arena_string_size(sensor_label(&config->source[i].sensor[j]));
+      }
+    }
   }
 
-  return 0;
+  for (int i = 0; i < config->num_fans; i++) {
+    size += arena_size(strlen(config->fan[i].pwm_file) + sizeof(PWM_ENABLE_SUFFIX), 1) +
+            arena_string_size(config->fan[i].device_id) +
+            arena_string_size(config->fan[i].pwm_file);
+  }
+
+  return size;
 }
 
 int hwmon_read_temp(struct app_sensor *app_sensor)
 {
   struct hwmon_sensor *sensor = app_sensor->sensor_data;
 
+  if (sensor->fildes < 0) {
+    errno = ENODEV;
+    return -1;
+  }
+
   char temp_input_string[TEMP_INPUT_SIZE];
   ssize_t nread = pread(sensor->fildes, temp_input_string, TEMP_INPUT_SIZE - 1, 0);
   if (nread < 0) {
-    perror("Couldn't read temperature");
     return -1;
   }
   
@@ -249,14 +377,47 @@ int hwmon_read_temp(struct app_sensor *app_sensor)
   return 0;
 }
 
-int hwmon_set_pwm(struct hwmon_fan *fan, int pwm_value)
+static int format_pwm_value(char *buffer, int pwm_value)
+{
+  char digits[HWMON_MAX_PWM_VALUE];
+  unsigned int value = pwm_value < 0 ? 0 : (unsigned int)pwm_value;
+  int len = 0;
+
+  do {
+    digits[len++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+
+  for (int i = 0; i < len; i++) {
+    buffer[i] = digits[len - 1 - i];
+  }
+
+  return len;
+}
+
+int hwmon_set_pwm(int pwm_fildes, int pwm_value)
 {
+  if (pwm_fildes < 0) {
+    errno = ENODEV;
+    return -1;
+  }
+
   char pwm_string[HWMON_MAX_PWM_VALUE];
 
-  int len = snprintf(pwm_string, HWMON_MAX_PWM_VALUE, "%i", pwm_value);
+  int len = format_pwm_value(pwm_string, pwm_value);
+
+  if (pwrite(pwm_fildes, pwm_string, len, 0) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
 
-  if (pwrite(fan->pwm_fildes, pwm_string, len, 0) < 0) {
-    perror("Couldn't change pwm value");
+int hwmon_enable_manual_control(struct hwmon_fan *fan)
+{
+  if (pwrite(fan->pwm_enable_fildes, PWM_MANUAL_CONTROL, strlen(PWM_MANUAL_CONTROL), 0) < 0) {
+    (void)fprintf(stderr, "Failed to set %s to manual control: %s\n",
+                  fan->pwm_enable_file, strerror(errno));
     return -1;
   }
 
@@ -265,10 +426,148 @@ int hwmon_set_pwm(struct hwmon_fan *fan, int pwm_value)
 
 int hwmon_restore_auto_control(struct hwmon_fan *fan)
 {
-  int ret = sd_device_set_sysattr_value(fan->device, fan->pwm_enable_file, fan->pwm_auto_control);
-  if (ret < 0) {
+  if (fan->device == NULL || fan->pwm_enable_fildes < 0) {
+    (void)fprintf(stderr, "Not restoring %s, its device is gone\n", fan->pwm_enable_file);
+    return -1;
+  }
+
+  if (pwrite(fan->pwm_enable_fildes, fan->pwm_auto_control, strlen(fan->pwm_auto_control), 0) < 0) {
     (void)fprintf(stderr, "Failed to set %s back to auto control: %s\n",
-                  fan->pwm_enable_file, strerror(-ret));
+                  fan->pwm_enable_file, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+// Opens the inputs of a source's sensors again, matching labels against
+// the interned copies as the config's strings are gone by now
+static int reopen_sensors(struct hwmon_source *source, struct app_context *app_context)
+{
+  const struct source_config *config = source->config;
+  int first = config->sensor[0].slot;
+
+  const char *syspath = device_syspath(source->device);
+  if (!syspath) return -1;
+
+  int count = 0;
+  for (const char *sysattr = device_attr_first(source->device);
+       sysattr && count < config->num_sensors;
+       sysattr = device_attr_next(source->device))
+  {
+    if (strncmp(sysattr, "temp", 4) != 0 || strstr(sysattr, "_label") == NULL) {
+      continue;
+    }
+
+    const char *value;
+    if (device_attr_read(source->device, sysattr, &value) < 0) continue;
+
+    for (int slot = first; slot < first + config->num_sensors; slot++) {
+      struct hwmon_sensor *sensor = app_context->sensor[slot].sensor_data;
+      if (sensor->fildes >= 0 || strcmp(sensor->label, value) != 0) continue;
+
+      long num = strtol(sysattr + strlen("temp"), NULL, 0);
+      char temp_input_path[PATH_MAX];
+      if (snprintf(temp_input_path, sizeof(temp_input_path), "%s/temp%li_input", syspath, num) >=
+          (int)sizeof(temp_input_path))
+      {
+        (void)fprintf(stderr, "Path truncated: %s\n", temp_input_path);
+        break;
+      }
+
+      sensor->fildes = open(temp_input_path, O_RDONLY | O_CLOEXEC);
+      if (sensor->fildes < 0) {
+        (void)fprintf(stderr, "Failed to open %s: %s\n", temp_input_path, strerror(errno));
+        break;
+      }
+      sensor->scale = 0;
+      count++;
+      break;
+    }
+  }
+
+  return count == config->num_sensors ? 0 : -1;
+}
+
+void hwmon_unbind_source(struct app_context *app_context, int index)
+{
+  struct hwmon_source *source = &app_context->source[index];
+  const struct source_config *config = source->config;
+
+  for (int i = 0; i < config->num_sensors; i++) {
+    close_sensor(app_context->sensor[config->sensor[i].slot].sensor_data);
+  }
+  source->device = device_unref(source->device);
+}
+
+int hwmon_rebind_source(struct app_context *app_context, int index)
+{
+  struct hwmon_source *source = &app_context->source[index];
+
+  hwmon_unbind_source(app_context, index);
+
+  source->device = device_find_hwmon(source->device_id);
+  if (!source->device) return -1;
+
+  if (reopen_sensors(source, app_context) < 0) {
+    (void)fprintf(stderr, "Failed to reopen all sensors of \"%s\"\n", source->device_id);
+    hwmon_unbind_source(app_context, index);
+    return -1;
+  }
+
+  return 0;
+}
+
+void hwmon_unbind_fan(struct app_context *app_context, int index)
+{
+  struct fan_state *fan = &app_context->fan;
+
+  if (fan->pwm_fildes[index] >= 0 && close(fan->pwm_fildes[index]) == -1) {
+    perror("close");
+  }
+  fan->pwm_fildes[index] = -1;
+  close_pwm_enable(&fan->hwmon[index]);
+  fan->hwmon[index].device = device_unref(fan->hwmon[index].device);
+}
+
+// Reopens the pwm file on the new device and writes the last value the
+// control loop chose, since the driver starts from its own default
+int hwmon_rebind_fan(struct app_context *app_context, int index)
+{
+  struct fan_state *fan = &app_context->fan;
+  struct hwmon_fan *hwmon = &fan->hwmon[index];
+
+  hwmon_unbind_fan(app_context, index);
+
+  hwmon->device = device_find_hwmon(hwmon->device_id);
+  const char *syspath = device_syspath(hwmon->device);
+  if (!syspath) return -1;
+
+  hwmon->pwm_enable_fildes = open_pwm_enable(syspath, hwmon->pwm_enable_file);
+  if (hwmon->pwm_enable_fildes < 0) {
+    hwmon_unbind_fan(app_context, index);
+    return -1;
+  }
+
+  char pwm_file[PATH_MAX];
+  if (snprintf(pwm_file, sizeof(pwm_file), "%s/%s", syspath, hwmon->pwm_file) >= (int)sizeof(pwm_file)) {
+    (void)fprintf(stderr, "Path truncated: %s\n", pwm_file);
+    return -1;
+  }
+
+  fan->pwm_fildes[index] = open(pwm_file, O_WRONLY | O_CLOEXEC);
+  if (fan->pwm_fildes[index] < 0) {
+    (void)fprintf(stderr, "Failed to open %s: %s\n", pwm_file, strerror(errno));
+    hwmon_unbind_fan(app_context, index);
+    return -1;
+  }
+
+  // Reloaded drivers start out under their own control
+  hwmon_enable_manual_control(hwmon);
+
+  // A negative value means the control loop has not written this fan yet
+  if (fan->pwm_value[index] >= 0 && hwmon_set_pwm(fan->pwm_fildes[index], fan->pwm_value[index]) < 0) {
+    (void)fprintf(stderr, "Failed to restore %s: %s\n", pwm_file, strerror(errno));
     return -1;
   }
 
@@ -278,23 +577,25 @@ int hwmon_restore_auto_control(struct hwmon_fan *fan)
 void hwmon_destroy_sources(struct app_context *app_context)
 {
   for (int i = 0; i < app_context->num_hwmon_sensors; i++) {
-    if (close(((struct hwmon_sensor*)app_context->sensor[i].sensor_data)->fildes) == -1) {
-      perror("close");
-    }
-    free(app_context->sensor[i].sensor_data);
+    if (app_context->sensor[i].sensor_data == NULL) continue;
+
+    app_context->sensor[i].destroy_func(&app_context->sensor[i]);
+  }
+
+  for (int i = 0; i < app_context->num_sources; i++) {
+    device_unref(app_context->source[i].device);
   }
 }
 
 void hwmon_destroy_fans(struct app_context *app_context)
 {
+  struct fan_state *fan = &app_context->fan;
+
   for (int i = 0; i < app_context->num_fans; i++) {
-    sd_device_unref(app_context->fan[i].hwmon->device);
-    if (close(app_context->fan[i].hwmon->pwm_fildes) == -1) {
+    device_unref(fan->hwmon[i].device);
+    close_pwm_enable(&fan->hwmon[i]);
+    if (fan->pwm_fildes[i] >= 0 && close(fan->pwm_fildes[i]) == -1) {
       perror("close");
     }
-    free(app_context->fan[i].hwmon->pwm_enable_file);
-    free(app_context->fan[i].hwmon);
-    free(app_context->fan[i].curve);
   }
-  free(app_context->fan);
 }
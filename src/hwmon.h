@@ -1,7 +1,10 @@
 #ifndef HWMON_H
 #define HWMON_H
 
-#include <systemd/sd-device.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "device.h"
 
 enum scale {
   DEGREES = 1,
@@ -9,17 +12,31 @@ enum scale {
 };
 
 struct hwmon_sensor {
+  const char *label;
   int fildes;
   float scale;
   float offset;
 };
 
+#define HWMON_MAX_PWM_VALUE 16
+
+// Hwmon devices of plain hwmon sources, kept so they can be rebound when
+// the driver re-registers them
+struct hwmon_source {
+  const struct source_config *config;
+  const char *device_id;
+  struct device *device;
+};
+
 struct hwmon_fan {
-  sd_device *device;
+  struct device *device;
+  const char *device_id;
+  const char *pwm_file;
 
-  int pwm_fildes;
   char *pwm_enable_file;
-  const char *pwm_auto_control;
+  int pwm_enable_fildes;
+  char pwm_auto_control[HWMON_MAX_PWM_VALUE];
+  bool adopted;
 
   int last_pwm_value;
   float target_fan_percent;
@@ -29,14 +46,22 @@ struct hwmon_fan {
 struct app_context;
 struct app_sensor;
 struct config;
+struct source_config;
 
 int hwmon_init_sources(struct config *config, struct app_context *app_context);
 int hwmon_init_fans(struct config *config, struct app_context *app_context);
+size_t hwmon_arena_size(const struct config *config);
 
 int hwmon_read_temp(struct app_sensor *app_sensor);
-int hwmon_set_pwm(struct hwmon_fan *fan, int pwm_value);
+int hwmon_set_pwm(int pwm_fildes, int pwm_value);
+int hwmon_enable_manual_control(struct hwmon_fan *fan);
 int hwmon_restore_auto_control(struct hwmon_fan *fan);
 
+int hwmon_rebind_source(struct app_context *app_context, int index);
+void hwmon_unbind_source(struct app_context *app_context, int index);
+int hwmon_rebind_fan(struct app_context *app_context, int index);
+void hwmon_unbind_fan(struct app_context *app_context, int index);
+
 void hwmon_destroy_sources(struct app_context *app_context);
 void hwmon_destroy_fans(struct app_context *app_context);
 
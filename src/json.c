@@ -0,0 +1,462 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+#define JSON_NUMBER_SIZE 64
+
+int json_open(struct json_reader *reader, const char *path)
+{
+  *reader = (struct json_reader) {
+    .line = { .number = 1 },
+    .expect = EXPECT_VALUE
+  };
+
+  reader->file = fopen(path, "r");
+  if (reader->file == NULL) {
+    (void)fprintf(stderr, "Config error: Failed to open %s\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+void json_close(struct json_reader *reader)
+{
+  if (reader->file && fclose(reader->file) == EOF) {
+    perror("fclose");
+  }
+  reader->file = NULL;
+}
+
+static int peek(struct json_reader *reader)
+{
+  if (reader->pos == reader->len) {
+    reader->len = fread(reader->buffer, 1, sizeof(reader->buffer), reader->file);
+    reader->pos = 0;
+    if (reader->len == 0) {
+      if (ferror(reader->file)) {
+        perror("fread");
+      }
+      return EOF;
+    }
+  }
+
+  return reader->buffer[reader->pos];
+}
+
+static bool is_space(int c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int advance(struct json_reader *reader)
+{
+  int c = peek(reader);
+  if (c == EOF) return c;
+  reader->pos++;
+
+  struct json_line *line = &reader->line;
+
+  if (c == '\n') {
+    if (reader->token_line.number == line->number) {
+      reader->token_line = *line;
+    }
+    line->len = 0;
+    line->number++;
+    reader->column = 0;
+    return c;
+  }
+
+  if (line->len < JSON_LINE_SIZE - 1) {
+    line->text[line->len++] = (char)c;
+  }
+  reader->column++;
+
+  if (!is_space(c)) {
+    reader->token_line.number = line->number;
+    reader->token_end = reader->column;
+  }
+
+  return c;
+}
+
+// Points just past the last token so that, for example, a missing comma is
+// reported at the end of the previous line rather than on the next key
+static void syntax_error(struct json_reader *reader, const char *reason)
+{
+  int column = reader->column;
+  int token_number = reader->token_line.number;
+  int token_end = reader->token_end;
+
+  // Only reads in the rest of the line to show it, without moving the token
+  while (peek(reader) != EOF && peek(reader) != '\n') {
+    advance(reader);
+  }
+  reader->token_line.number = token_number;
+  reader->token_end = token_end;
+
+  const struct json_line *line = &reader->line;
+  if (reader->token_line.number != 0) {
+    column = reader->token_end;
+    if (reader->token_line.number != line->number) {
+      line = &reader->token_line;
+    }
+  }
+
+  (void)fprintf(stderr, "Config error: JSON syntax error on line %d: %s\n", line->number, reason);
+  (void)fprintf(stderr, "    %.*s\n", line->len, line->text);
+  (void)fprintf(stderr, "    %*s^\n", column, "");
+}
+
+static int skip_space(struct json_reader *reader)
+{
+  while (is_space(peek(reader))) {
+    advance(reader);
+  }
+
+  return peek(reader);
+}
+
+static int append_utf8(struct json_reader *reader, unsigned long code)
+{
+  char bytes[4];
+  int len;
+
+  if (code < 0x80) {
+    bytes[0] = (char)code;
+    len = 1;
+  }
+  else if (code < 0x800) {
+    bytes[0] = (char)(0xC0 | (code >> 6));
+    bytes[1] = (char)(0x80 | (code & 0x3F));
+    len = 2;
+  }
+  else if (code < 0x10000) {
+    bytes[0] = (char)(0xE0 | (code >> 12));
+    bytes[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+    bytes[2] = (char)(0x80 | (code & 0x3F));
+    len = 3;
+  }
+  else {
+    bytes[0] = (char)(0xF0 | (code >> 18));
+    bytes[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    bytes[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    bytes[3] = (char)(0x80 | (code & 0x3F));
+    len = 4;
+  }
+
+  if (reader->string_len + len >= JSON_STRING_SIZE) {
+    syntax_error(reader, "string too long");
+    return -1;
+  }
+  memcpy(reader->string + reader->string_len, bytes, len);
+  reader->string_len += len;
+
+  return 0;
+}
+
+static int read_hex4(struct json_reader *reader, unsigned long *code)
+{
+  *code = 0;
+
+  for (int i = 0; i < 4; i++) {
+    int c = peek(reader);
+    int digit;
+
+    if (c >= '0' && c <= '9') digit = c - '0';
+    else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+    else {
+      syntax_error(reader, "invalid unicode escape");
+      return -1;
+    }
+
+    advance(reader);
+    *code = (*code << 4) | (unsigned long)digit;
+  }
+
+  return 0;
+}
+
+static int read_escape(struct json_reader *reader)
+{
+  int c = advance(reader);
+
+  switch (c) {
+    case '"': case '\\': case '/':
+      return append_utf8(reader, (unsigned long)c);
+    case 'b':
+      return append_utf8(reader, '\b');
+    case 'f':
+      return append_utf8(reader, '\f');
+    case 'n':
+      return append_utf8(reader, '\n');
+    case 'r':
+      return append_utf8(reader, '\r');
+    case 't':
+      return append_utf8(reader, '\t');
+    case 'u':
+      unsigned long code;
+      if (read_hex4(reader, &code) < 0) return -1;
+
+      if (code >= 0xD800 && code <= 0xDBFF) {
+        unsigned long low;
+        if (advance(reader) != '\\' || advance(reader) != 'u' || read_hex4(reader, &low) < 0 ||
+            low < 0xDC00 || low > 0xDFFF)
+        {
+          syntax_error(reader, "invalid surrogate pair");
+          return -1;
+        }
+        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+      }
+      else if (code >= 0xDC00 && code <= 0xDFFF) {
+        syntax_error(reader, "invalid surrogate pair");
+        return -1;
+      }
+
+      return append_utf8(reader, code);
+    default:
+      syntax_error(reader, "invalid escape sequence");
+      return -1;
+  }
+}
+
+static int read_string(struct json_reader *reader)
+{
+  advance(reader);
+  reader->string_len = 0;
+
+  for (;;) {
+    int c = peek(reader);
+
+    if (c == EOF) {
+      syntax_error(reader, "unterminated string");
+      return -1;
+    }
+    if (c < 0x20) {
+      syntax_error(reader, "control character in string");
+      return -1;
+    }
+
+    advance(reader);
+
+    if (c == '"') break;
+
+    if (c == '\\') {
+      if (read_escape(reader) < 0) return -1;
+      continue;
+    }
+
+    if (reader->string_len + 1 >= JSON_STRING_SIZE) {
+      syntax_error(reader, "string too long");
+      return -1;
+    }
+    reader->string[reader->string_len++] = (char)c;
+  }
+
+  reader->string[reader->string_len] = '\0';
+
+  return 0;
+}
+
+static int read_number(struct json_reader *reader)
+{
+  char number[JSON_NUMBER_SIZE];
+  int len = 0;
+
+  for (int c = peek(reader);
+       (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+       c = peek(reader))
+  {
+    if (len == JSON_NUMBER_SIZE - 1) {
+      syntax_error(reader, "number too long");
+      return -1;
+    }
+    number[len++] = (char)advance(reader);
+  }
+  number[len] = '\0';
+
+  // strtod() accepts a superset of JSON numbers, so reject the extras
+  const char *digits = number[0] == '-' ? number + 1 : number;
+  bool leading_zero = digits[0] == '0' && digits[1] >= '0' && digits[1] <= '9';
+
+  char *end;
+  errno = 0;
+  reader->number = strtod(number, &end);
+  if (len == 0 || *end != '\0' || errno == ERANGE || leading_zero ||
+      !(digits[0] >= '0' && digits[0] <= '9'))
+  {
+    syntax_error(reader, "invalid number");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int read_literal(struct json_reader *reader, const char *literal)
+{
+  for (const char *ptr = literal; *ptr; ptr++) {
+    if (peek(reader) != *ptr) {
+      syntax_error(reader, "invalid literal");
+      return -1;
+    }
+    advance(reader);
+  }
+
+  return 0;
+}
+
+static bool in_object(const struct json_reader *reader)
+{
+  return (reader->object_bits >> (reader->depth - 1)) & 1;
+}
+
+static enum json_token push(struct json_reader *reader, bool object)
+{
+  if (reader->depth == JSON_MAX_DEPTH) {
+    syntax_error(reader, "nesting too deep");
+    return JSON_ERROR;
+  }
+
+  advance(reader);
+
+  if (object) {
+    reader->object_bits |= (uint64_t)1 << reader->depth;
+  }
+  else {
+    reader->object_bits &= ~((uint64_t)1 << reader->depth);
+  }
+  reader->depth++;
+  reader->expect = object ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+
+  return object ? JSON_BEGIN_OBJECT : JSON_BEGIN_ARRAY;
+}
+
+static enum json_token pop(struct json_reader *reader)
+{
+  bool object = in_object(reader);
+
+  advance(reader);
+  reader->depth--;
+  reader->expect = reader->depth ? EXPECT_COMMA_OR_END : EXPECT_DONE;
+
+  return object ? JSON_END_OBJECT : JSON_END_ARRAY;
+}
+
+static enum json_token read_value(struct json_reader *reader, int c)
+{
+  enum json_token token;
+
+  switch (c) {
+    case '{':
+      return push(reader, true);
+    case '[':
+      return push(reader, false);
+    case '"':
+      if (read_string(reader) < 0) return JSON_ERROR;
+      token = JSON_STRING;
+      break;
+    case 't':
+      if (read_literal(reader, "true") < 0) return JSON_ERROR;
+      token = JSON_TRUE;
+      break;
+    case 'f':
+      if (read_literal(reader, "false") < 0) return JSON_ERROR;
+      token = JSON_FALSE;
+      break;
+    case 'n':
+      if (read_literal(reader, "null") < 0) return JSON_ERROR;
+      token = JSON_NULL;
+      break;
+    default:
+      if (c == '-' || (c >= '0' && c <= '9')) {
+        if (read_number(reader) < 0) return JSON_ERROR;
+        token = JSON_NUMBER;
+        break;
+      }
+      syntax_error(reader, c == EOF ? "unexpected end of file" : "expected a value");
+      return JSON_ERROR;
+  }
+
+  reader->expect = reader->depth ? EXPECT_COMMA_OR_END : EXPECT_DONE;
+
+  return token;
+}
+
+static enum json_token read_key(struct json_reader *reader, int c)
+{
+  if (c != '"') {
+    syntax_error(reader, c == EOF ? "unexpected end of file" : "expected a key");
+    return JSON_ERROR;
+  }
+  if (read_string(reader) < 0) return JSON_ERROR;
+
+  if (skip_space(reader) != ':') {
+    syntax_error(reader, "expected ':'");
+    return JSON_ERROR;
+  }
+  advance(reader);
+  reader->expect = EXPECT_VALUE;
+
+  return JSON_KEY;
+}
+
+enum json_token json_next(struct json_reader *reader)
+{
+  int c = skip_space(reader);
+
+  switch (reader->expect) {
+    case EXPECT_DONE:
+      if (c != EOF) {
+        syntax_error(reader, "unexpected data after the end of the document");
+        return JSON_ERROR;
+      }
+      return JSON_EOF;
+    case EXPECT_COMMA_OR_END:
+      if (c == (in_object(reader) ? '}' : ']')) {
+        return pop(reader);
+      }
+      if (c != ',') {
+        syntax_error(reader, in_object(reader) ? "expected ',' or '}'" : "expected ',' or ']'");
+        return JSON_ERROR;
+      }
+      advance(reader);
+      c = skip_space(reader);
+      if (in_object(reader)) {
+        return read_key(reader, c);
+      }
+      return read_value(reader, c);
+    case EXPECT_KEY_OR_END:
+      if (c == '}') {
+        return pop(reader);
+      }
+      return read_key(reader, c);
+    case EXPECT_VALUE_OR_END:
+      if (c == ']') {
+        return pop(reader);
+      }
+      return read_value(reader, c);
+    case EXPECT_VALUE:
+      return read_value(reader, c);
+  }
+
+  return JSON_ERROR;
+}
+
+int json_skip(struct json_reader *reader, enum json_token token)
+{
+  if (token != JSON_BEGIN_OBJECT && token != JSON_BEGIN_ARRAY) {
+    return token == JSON_ERROR ? -1 : 0;
+  }
+
+  int depth = reader->depth - 1;
+  while (reader->depth > depth) {
+    if (json_next(reader) == JSON_ERROR) return -1;
+  }
+
+  return 0;
+}
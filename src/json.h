@@ -0,0 +1,73 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define JSON_BUFFER_SIZE 4096
+#define JSON_STRING_SIZE 1024
+#define JSON_LINE_SIZE 256
+#define JSON_MAX_DEPTH 64
+
+enum json_token {
+  JSON_ERROR = -1,
+  JSON_EOF,
+  JSON_BEGIN_OBJECT,
+  JSON_END_OBJECT,
+  JSON_BEGIN_ARRAY,
+  JSON_END_ARRAY,
+  JSON_KEY,
+  JSON_STRING,
+  JSON_NUMBER,
+  JSON_TRUE,
+  JSON_FALSE,
+  JSON_NULL
+};
+
+enum json_expect {
+  EXPECT_VALUE,
+  EXPECT_VALUE_OR_END,
+  EXPECT_KEY_OR_END,
+  EXPECT_COMMA_OR_END,
+  EXPECT_DONE
+};
+
+struct json_line {
+  char text[JSON_LINE_SIZE];
+  int len;
+  int number;
+};
+
+// Pull parser over a stream; all scratch memory is part of the reader so
+// memory use does not grow with the size of the document
+struct json_reader {
+  FILE *file;
+  unsigned char buffer[JSON_BUFFER_SIZE];
+  size_t len;
+  size_t pos;
+
+  // Text of the current line so far, and of the line holding the end of
+  // the last token, for error reporting
+  struct json_line line;
+  struct json_line token_line;
+  int token_end;
+  int column;
+
+  uint64_t object_bits;
+  int depth;
+  enum json_expect expect;
+
+  char string[JSON_STRING_SIZE];
+  size_t string_len;
+  double number;
+};
+
+int json_open(struct json_reader *reader, const char *path);
+void json_close(struct json_reader *reader);
+
+enum json_token json_next(struct json_reader *reader);
+int json_skip(struct json_reader *reader, enum json_token token);
+
+#endif
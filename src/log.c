@@ -0,0 +1,171 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define SD_JOURNAL_SUPPRESS_LOCATION
+#include "sd_compat.h"
+
+#define LOG_MESSAGE_SIZE 256
+#define LOG_FIELD_SIZE 320
+#define LOG_MAX_FIELDS 6
+
+// Each entity may log a burst of LOG_BURST messages, then one every
+// LOG_REFILL_SEC seconds; suppressed messages are summarised at most every
+// LOG_SUMMARY_SEC seconds
+#define LOG_BURST 5.0F
+#define LOG_REFILL_SEC 10.0F
+#define LOG_SUMMARY_SEC 60
+#define NS_PER_SEC 1000000000L
+
+static bool use_journal;
+
+// Writes to the journal directly only when stderr already goes there, so
+// messages still reach a terminal when run by hand
+void log_init(void)
+{
+  const char *stream = getenv("JOURNAL_STREAM");
+  if (!stream) return;
+
+  unsigned long dev;
+  unsigned long ino;
+  if (sscanf(stream, "%lu:%lu", &dev, &ino) != 2) return;
+
+  struct stat st;
+  if (fstat(STDERR_FILENO, &st) == -1) return;
+
+  use_journal = st.st_dev == dev && st.st_ino == ino;
+}
+
+static void add_field(struct iovec *iov, int *num_fields, char buffer[LOG_FIELD_SIZE],
+                      const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buffer, LOG_FIELD_SIZE, format, args);
+  va_end(args);
+
+  if (len < 0) return;
+  if (len >= LOG_FIELD_SIZE) {
+    len = LOG_FIELD_SIZE - 1;
+  }
+
+  iov[*num_fields] = (struct iovec) { .iov_base = buffer, .iov_len = len };
+  (*num_fields)++;
+}
+
+static void write_entry(const struct log_bucket *bucket, int priority, const char *field,
+                        const char *entity, int errnum, const char *message)
+{
+  if (!use_journal) {
+    (void)fprintf(stderr, "%s\n", message);
+    return;
+  }
+
+  char buffer[LOG_MAX_FIELDS][LOG_FIELD_SIZE];
+  struct iovec iov[LOG_MAX_FIELDS];
+  int num_fields = 0;
+
+  add_field(iov, &num_fields, buffer[num_fields], "MESSAGE=%s", message);
+  add_field(iov, &num_fields, buffer[num_fields], "PRIORITY=%d", priority);
+  add_field(iov, &num_fields, buffer[num_fields], "%s=%s", field, entity);
+  add_field(iov, &num_fields, buffer[num_fields], "ERROR_COUNT=%lu", bucket->errors);
+  if (bucket->suppressed) {
+    add_field(iov, &num_fields, buffer[num_fields], "SUPPRESSED=%u", bucket->suppressed);
+  }
+  if (errnum) {
+    add_field(iov, &num_fields, buffer[num_fields], "ERRNO=%d", errnum);
+  }
+
+  if (sd_journal_sendv(iov, num_fields) < 0) {
+    (void)fprintf(stderr, "%s\n", message);
+  }
+}
+
+static void write_summary(struct log_bucket *bucket, const char *field, const char *entity,
+                          const struct timespec *now)
+{
+  char message[LOG_MESSAGE_SIZE];
+  (void)snprintf(message, sizeof(message), "%s: suppressed %u messages, %lu errors in total",
+                 entity, bucket->suppressed, bucket->errors);
+
+  write_entry(bucket, LOG_NOTICE, field, entity, 0, message);
+  bucket->suppressed = 0;
+  bucket->summary = *now;
+}
+
+static bool take_token(struct log_bucket *bucket, const struct timespec *now)
+{
+  if (bucket->refill.tv_sec == 0) {
+    bucket->tokens = LOG_BURST;
+    bucket->summary = *now;
+  }
+  else {
+    float elapsed = (float)(now->tv_sec - bucket->refill.tv_sec) +
+                    (float)(now->tv_nsec - bucket->refill.tv_nsec) / NS_PER_SEC;
+    bucket->tokens += elapsed / LOG_REFILL_SEC;
+    if (bucket->tokens > LOG_BURST) {
+      bucket->tokens = LOG_BURST;
+    }
+  }
+  bucket->refill = *now;
+
+  if (bucket->tokens < 1) return false;
+
+  bucket->tokens--;
+  return true;
+}
+
+void log_entity(struct log_bucket *bucket, int priority, const char *field, const char *entity,
+                int errnum, const char *format, ...)
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+    perror("clock_gettime");
+    return;
+  }
+
+  if (priority <= LOG_WARNING) {
+    bucket->errors++;
+  }
+
+  if (!take_token(bucket, &now)) {
+    bucket->suppressed++;
+    log_flush(bucket, field, entity);
+    return;
+  }
+
+  if (bucket->suppressed) {
+    write_summary(bucket, field, entity, &now);
+  }
+
+  char message[LOG_MESSAGE_SIZE];
+  va_list args;
+  va_start(args, format);
+  (void)vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  write_entry(bucket, priority, field, entity, errnum, message);
+}
+
+// Reports messages suppressed since the last summary, once the summary
+// interval has passed
+void log_flush(struct log_bucket *bucket, const char *field, const char *entity)
+{
+  if (!bucket->suppressed) return;
+
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+    perror("clock_gettime");
+    return;
+  }
+
+  if (now.tv_sec - bucket->summary.tv_sec < LOG_SUMMARY_SEC) return;
+
+  write_summary(bucket, field, entity, &now);
+}
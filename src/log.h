@@ -0,0 +1,29 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <syslog.h>
+#include <time.h>
+
+// Journal field naming the entity a message is about
+#define LOG_SENSOR "SENSOR"
+#define LOG_FAN "FAN"
+#define LOG_CURVE "CURVE"
+#define LOG_SOCKET "SOCKET"
+
+// Token bucket limiting the messages logged for one entity, with a count of
+// every error reported for it, logged or not
+struct log_bucket {
+  float tokens;
+  struct timespec refill;
+  struct timespec summary;
+  unsigned int suppressed;
+  unsigned long errors;
+};
+
+void log_init(void);
+
+void log_entity(struct log_bucket *bucket, int priority, const char *field, const char *entity,
+                int errnum, const char *format, ...) __attribute__((format(printf, 6, 7)));
+void log_flush(struct log_bucket *bucket, const char *field, const char *entity);
+
+#endif
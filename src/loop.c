@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "loop.h"
+
+#define NS_PER_SEC 1000000000L
+
+int loop_add(struct event_loop *loop, int fildes, short events,
+             void (*callback)(void *userdata, short revents), void *userdata)
+{
+  if (loop->num_sources == loop->capacity) {
+    int capacity = loop->capacity ? loop->capacity * 2 : 8;
+
+    struct pollfd *new_pollfd = reallocarray(loop->pollfd, capacity, sizeof(*loop->pollfd));
+    if (!new_pollfd) {
+      perror("Failed to allocate pollfd array");
+      return -1;
+    }
+    loop->pollfd = new_pollfd;
+
+    struct loop_source *new_source = reallocarray(loop->source, capacity, sizeof(*loop->source));
+    if (!new_source) {
+      perror("Failed to allocate loop_source array");
+      return -1;
+    }
+    loop->source = new_source;
+
+    loop->capacity = capacity;
+  }
+
+  loop->pollfd[loop->num_sources] = (struct pollfd) {
+    .fd = fildes,
+    .events = events
+  };
+  loop->source[loop->num_sources] = (struct loop_source) {
+    .fildes = fildes,
+    .callback = callback,
+    .userdata = userdata
+  };
+  loop->num_sources++;
+
+  return 0;
+}
+
+void loop_remove(struct event_loop *loop, int fildes)
+{
+  // Removed entries are compacted in loop_wait() so callbacks can remove
+  // sources while the loop is dispatching
+  for (int i = 0; i < loop->num_sources; i++) {
+    if (loop->source[i].fildes == fildes) {
+      loop->source[i].fildes = -1;
+      loop->pollfd[i].fd = -1;
+    }
+  }
+}
+
+void loop_wake(struct event_loop *loop)
+{
+  loop->wake = true;
+}
+
+static void compact_sources(struct event_loop *loop)
+{
+  int count = 0;
+
+  for (int i = 0; i < loop->num_sources; i++) {
+    if (loop->source[i].fildes < 0) continue;
+
+    loop->source[count] = loop->source[i];
+    loop->pollfd[count] = loop->pollfd[i];
+    count++;
+  }
+
+  loop->num_sources = count;
+}
+
+int loop_wait(struct event_loop *loop, const struct timespec *deadline)
+{
+  compact_sources(loop);
+
+  for (;;) {
+    if (loop->wake) {
+      loop->wake = false;
+      return LOOP_WAKE;
+    }
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+      perror("clock_gettime");
+      return -1;
+    }
+
+    struct timespec timeout = {
+      .tv_sec = deadline->tv_sec - now.tv_sec,
+      .tv_nsec = deadline->tv_nsec - now.tv_nsec
+    };
+    if (timeout.tv_nsec < 0) {
+      timeout.tv_sec--;
+      timeout.tv_nsec += NS_PER_SEC;
+    }
+    if (timeout.tv_sec < 0 || (timeout.tv_sec == 0 && timeout.tv_nsec == 0)) {
+      return LOOP_TIMEOUT;
+    }
+
+    int ret = ppoll(loop->pollfd, loop->num_sources, &timeout, NULL);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        return LOOP_INTERRUPTED;
+      }
+      perror("ppoll");
+      return -1;
+    }
+
+    for (int i = 0; i < loop->num_sources && ret > 0; i++) {
+      if (loop->pollfd[i].revents == 0 || loop->source[i].fildes < 0) continue;
+
+      loop->source[i].callback(loop->source[i].userdata, loop->pollfd[i].revents);
+      ret--;
+    }
+  }
+}
+
+void loop_free(struct event_loop *loop)
+{
+  free(loop->pollfd);
+  free(loop->source);
+  loop->pollfd = NULL;
+  loop->source = NULL;
+  loop->num_sources = 0;
+  loop->capacity = 0;
+}
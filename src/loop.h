@@ -0,0 +1,36 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <time.h>
+
+enum loop_result {
+  LOOP_TIMEOUT,
+  LOOP_WAKE,
+  LOOP_INTERRUPTED
+};
+
+struct loop_source {
+  int fildes;
+  void (*callback)(void *userdata, short revents);
+  void *userdata;
+};
+
+struct event_loop {
+  struct pollfd *pollfd;
+  struct loop_source *source;
+  int num_sources;
+  int capacity;
+
+  bool wake;
+};
+
+int loop_add(struct event_loop *loop, int fildes, short events,
+             void (*callback)(void *userdata, short revents), void *userdata);
+void loop_remove(struct event_loop *loop, int fildes);
+void loop_wake(struct event_loop *loop);
+int loop_wait(struct event_loop *loop, const struct timespec *deadline);
+void loop_free(struct event_loop *loop);
+
+#endif
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <getopt.h>
 #include <math.h>
 #include <signal.h>
@@ -5,6 +6,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -12,24 +14,63 @@
 #include <ncurses.h>
 #endif // DEBUG
 
+#include "autotune.h"
+#include "batch.h"
+#include "benchmark.h"
 #include "config.h"
 #include "control.h"
+#include "exec.h"
+#include "guardian.h"
+#include "handover.h"
+#include "hotplug.h"
 #include "hwmon.h"
+#include "log.h"
+#include "loop.h"
+#include "notify.h"
+#include "psi.h"
+#include "push.h"
+#include "realtime.h"
+#include "shadow.h"
+#include "suspend.h"
+#include "writer.h"
 
 #define NS_PER_SEC 1000000000L
 
 volatile sig_atomic_t keep_running = 1;
+volatile sig_atomic_t print_latency = 0;
+volatile sig_atomic_t handover_requested = 0;
 
 void signal_handler(int signum) {
   if (signum == SIGINT || signum == SIGTERM) {
     keep_running = 0;
   }
+  if (signum == SIGUSR2) {
+    handover_requested = 1;
+    keep_running = 0;
+  }
+  if (signum == SIGUSR1) {
+    print_latency = 1;
+  }
 }
 
 void destroy_hardware(struct app_context *app_context)
 {
   hwmon_destroy_sources(app_context);
   hwmon_destroy_fans(app_context);
+  destroy_custom_sensors(app_context);
+  handover_free(app_context);
+  shadow_destroy(app_context);
+  destroy_app_context(app_context);
+}
+
+void destroy_events(struct app_context *app_context, struct event_loop *loop)
+{
+  psi_destroy_triggers(app_context);
+  push_destroy_socket(app_context);
+  hotplug_destroy(app_context);
+  suspend_destroy(app_context);
+  autotune_destroy(app_context);
+  loop_free(loop);
 }
 
 #ifdef DEBUG
@@ -37,24 +78,30 @@ void ui_update(struct app_context *ctx)
 {
   erase();
 
+  struct curve_state *curve = &ctx->curve;
+  struct fan_state *fan = &ctx->fan;
+
   for (int i = 0; i < ctx->num_fans; i++) {
-    struct app_fan *fan = &ctx->fan[i];
+    int c = fan->curve[i];
 
     // NOLINTBEGIN(readability-magic-numbers)
-    mvprintw(i + 2, 0, "%s", fan->config->name);
-
-    mvprintw(i + 2, 37, "%6.2fC", fan->curve->sensor->current_value);
-    mvprintw(i + 2, 48, "%3.0f%%", fan->fan_percent);
-    mvprintw(i + 2, 56, "%6.2fC", fan->curve->hyst_val);
-    mvprintw(i + 2, 68, "%6.2fC", fan->curve->config->hysteresis);
-    if (fan->curve->timer.tv_sec > 0) {
+    mvprintw(i + 2, 0, "%s", fan->name[i]);
+
+    mvprintw(i + 2, 37, "%6.2fC", ctx->sensor[curve->sensor[c]].current_value);
+    mvprintw(i + 2, 48, "%3.0f%%", fan->fan_percent[i]);
+    mvprintw(i + 2, 56, "%6.2fC", curve->hyst_val[c]);
+    mvprintw(i + 2, 68, "%6.2fC", curve->hysteresis[c]);
+    if (curve->failsafe[c]) {
+      mvprintw(i + 2, 76, "failsafe");
+    }
+    else if (curve->timer[c].tv_sec > 0) {
       if (clock_gettime(CLOCK_MONOTONIC, &ctx->clock) == -1) {
         perror("clock_gettime");
       }
 
-      long elapsed = (ctx->clock.tv_sec - fan->curve->timer.tv_sec) +
-                     (ctx->clock.tv_nsec - fan->curve->timer.tv_nsec) / NS_PER_SEC;
-      long remaining = (long)fan->curve->config->response_time - elapsed;
+      long elapsed = (ctx->clock.tv_sec - curve->timer[c].tv_sec) +
+                     (ctx->clock.tv_nsec - curve->timer[c].tv_nsec) / NS_PER_SEC;
+      long remaining = (long)curve->response_time[c] - elapsed;
 
       mvprintw(i + 2, 76, "%ld", remaining);
     }
@@ -65,56 +112,144 @@ void ui_update(struct app_context *ctx)
 }
 #endif // DEBUG
 
-void update_fans(struct app_fan fan[], int num_fans, struct timespec *clock)
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
 {
-  for (int i = 0; i < num_fans; i++) {
-    if (fan[i].curve->sensor->get_temp_func(fan[i].curve->sensor) < 0) {
-      (void)fprintf(stderr, "Failed to read temperature for %s\n", fan[i].curve->sensor->name);
-    }
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
 
-    if (fan[i].curve->config->hysteresis > 0) {
-      if (fabsf(fan[i].curve->hyst_val - fan[i].curve->sensor->current_value) < fan[i].curve->config->hysteresis) {
-        fan[i].curve->timer.tv_sec = 0;
-        continue;
+void update_fans(struct app_context *app_context)
+{
+  struct fan_state *fan = &app_context->fan;
+
+  app_context->tick++;
+  if (clock_gettime(CLOCK_MONOTONIC, &app_context->clock) == -1) {
+    perror("clock_gettime");
+  }
+
+  int num_changed = control_evaluate(app_context);
+
+  // Fans are left to the firmware between PrepareForSleep and resume,
+  // which rewrites the values chosen in the meantime
+  if (!app_context->suspended) {
+    for (int k = 0; k < num_changed; k++) {
+      int i = fan->changed[k];
+      if (hwmon_set_pwm(fan->pwm_fildes[i], fan->pwm_value[i]) < 0) {
+        fan->error[i] = errno;
       }
     }
 
-    if (fan[i].curve->config->response_time > 0) {
-      if (clock_gettime(CLOCK_MONOTONIC, clock) == -1) {
-        perror("clock_gettime");
-      }
+    autotune_update(app_context);
+  }
 
-      if (fan[i].curve->timer.tv_sec == 0) {
-        fan[i].curve->timer = *clock;
-        continue;
-      }
+  shadow_update(app_context, num_changed);
+}
 
-      long elapsed = (clock->tv_sec - fan[i].curve->timer.tv_sec) +
-                     (clock->tv_nsec - fan[i].curve->timer.tv_nsec) / NS_PER_SEC;
+// Errors are rate limited per sensor, fan and curve, so a flapping sensor
+// costs the same log volume at any interval
+void report_errors(struct app_context *app_context)
+{
+  for (int i = 0; i < app_context->num_sensors; i++) {
+    struct app_sensor *sensor = &app_context->sensor[i];
+    if (sensor->tick == app_context->tick && sensor->status < 0) {
+      log_entity(&sensor->log, LOG_WARNING, LOG_SENSOR, sensor->name, sensor->error,
+                 "Failed to read temperature for %s: %s", sensor->name, strerror(sensor->error));
+    }
+    else {
+      log_flush(&sensor->log, LOG_SENSOR, sensor->name);
+    }
+  }
 
-      if ((long)fan[i].curve->config->response_time > elapsed) {
-        continue;
-      }
+  struct fan_state *fan = &app_context->fan;
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    if (fan->error[i]) {
+      log_entity(&fan->log[i], LOG_ERR, LOG_FAN, fan->name[i], fan->error[i],
+                 "Failed to set fan speed for %s: %s", fan->name[i], strerror(fan->error[i]));
+      fan->error[i] = 0;
     }
+    else {
+      log_flush(&fan->log[i], LOG_FAN, fan->name[i]);
+    }
+  }
 
-    fan[i].curve->hyst_val = fan[i].curve->sensor->current_value;
+  struct curve_state *curve = &app_context->curve;
 
-    fan[i].fan_percent = calculate_fan_percent(fan[i].config->curve, fan[i].curve->sensor->current_value);
-    int pwm_value = calculate_pwm_value(fan[i].fan_percent, fan[i].config);
+  for (int c = 0; c < app_context->num_curves; c++) {
+    const struct curve_config *config = curve->config[c];
+    const struct app_sensor *sensor = &app_context->sensor[curve->sensor[c]];
+    int failures = curve->event_failures[c];
 
-    if (pwm_value != fan[i].pwm_value) {
-      fan[i].pwm_value = pwm_value;
-      if (hwmon_set_pwm(fan[i].hwmon, fan[i].pwm_value) < 0) {
-        (void)fprintf(stderr, "Failed to set fan speed for %s\n", fan[i].config->name);
-      }
+    switch (curve->event[c]) {
+      case CURVE_SENSOR_FAILED:
+        log_entity(&curve->log[c], LOG_WARNING, LOG_CURVE, curve->name[c], sensor->error,
+                   "Curve %s: sensor %s failed, keeping its last value for up to %.0f ticks",
+                   curve->name[c], sensor->name, config->failsafe_ticks);
+        break;
+      case CURVE_FAILSAFE:
+        log_entity(&curve->log[c], LOG_ERR, LOG_CURVE, curve->name[c], sensor->error,
+                   "Curve %s: sensor %s failed %d reads in a row, failsafe at %.0f%%",
+                   curve->name[c], sensor->name, failures, config->failsafe_percent);
+        break;
+      case CURVE_SENSOR_RECOVERED:
+        log_entity(&curve->log[c], LOG_NOTICE, LOG_CURVE, curve->name[c], 0,
+                   "Curve %s: sensor %s recovered after %d failed reads",
+                   curve->name[c], sensor->name, failures);
+        break;
+      default:
+        log_flush(&curve->log[c], LOG_CURVE, curve->name[c]);
+        break;
     }
+    curve->event[c] = CURVE_EVENT_NONE;
+  }
+
+  if (app_context->push) {
+    log_flush(&app_context->push->log, LOG_SOCKET, app_context->push->path);
+  }
+}
+
+static void timespec_add(struct timespec *time, const struct timespec *interval)
+{
+  time->tv_sec += interval->tv_sec;
+  time->tv_nsec += interval->tv_nsec;
+  if (time->tv_nsec >= NS_PER_SEC) {
+    time->tv_sec++;
+    time->tv_nsec -= NS_PER_SEC;
+  }
+}
 
-    fan[i].curve->timer.tv_sec = 0;
+static void advance_deadline(struct timespec *deadline, const struct timespec *interval,
+                             const struct timespec *now)
+{
+  timespec_add(deadline, interval);
+
+  // Skip missed ticks rather than running them back to back
+  if (timespec_before(deadline, now)) {
+    *deadline = *now;
   }
 }
 
+// A tick is healthy when every fan write succeeded and it finished before
+// the next one was due. Fans whose device is gone are waiting for hotplug,
+// which a restart would not bring back any sooner.
+static bool tick_healthy(const struct app_context *app_context, const struct timespec *deadline,
+                         const struct timespec *interval, const struct timespec *done)
+{
+  const struct fan_state *fan = &app_context->fan;
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    if (fan->error[i] && fan->pwm_fildes[i] >= 0) return false;
+  }
+
+  struct timespec limit = *deadline;
+  timespec_add(&limit, interval);
+
+  return !timespec_before(&limit, done);
+}
+
 int main(int argc, char *argv[])
 {
+  log_init();
+
   struct sigaction sigact = {
     .sa_handler = signal_handler,
     .sa_flags = SA_RESTART
@@ -127,17 +262,48 @@ int main(int argc, char *argv[])
   if (sigaction(SIGTERM, &sigact, NULL) == -1) {
     perror("signal");
   }
+  if (sigaction(SIGUSR1, &sigact, NULL) == -1) {
+    perror("signal");
+  }
+  if (sigaction(SIGUSR2, &sigact, NULL) == -1) {
+    perror("signal");
+  }
 
   const char *config_path = "/etc/cfans/config.json";
+  const char *shadow_path = NULL;
+  int benchmark_cycles = 0;
+  bool benchmark_pwm = false;
+
+  static const struct option long_opts[] = {
+    {"config", required_argument, NULL, 'c'},
+    {"shadow", required_argument, NULL, 's'},
+    {"benchmark", optional_argument, NULL, 'b'},
+    {"benchmark-pwm", no_argument, NULL, 'p'},
+    {NULL, 0, NULL, 0}
+  };
 
   int opt;
-  while ((opt = getopt(argc, argv, "c:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "c:s:", long_opts, NULL)) != -1) {
     switch (opt) {
       case 'c':
         config_path = optarg;
         break;
+      case 's':
+        shadow_path = optarg;
+        break;
+      case 'b':
+        benchmark_cycles = optarg ? atoi(optarg) : BENCHMARK_DEFAULT_CYCLES;
+        if (benchmark_cycles <= 0) {
+          (void)fprintf(stderr, "Invalid benchmark cycle count: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'p':
+        benchmark_pwm = true;
+        break;
       default:
-        (void)fprintf(stderr, "Usage: %s [-c CONFIG_FILE]\n", argv[0]);
+        (void)fprintf(stderr, "Usage: %s [-c CONFIG_FILE] [-s SHADOW_CONFIG_FILE] "
+                      "[--benchmark[=CYCLES] [--benchmark-pwm]]\n", argv[0]);
         return EXIT_FAILURE;
     } 
   }
@@ -149,18 +315,50 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
+  struct notify_state notify;
+  if (notify_init(&notify, config.interval) < 0) {
+    free_config(&config);
+    return EXIT_FAILURE;
+  }
+
   struct app_context app_context = {0};
-  if (hwmon_init_sources(&config, &app_context) < 0 ||
+  struct event_loop loop = {0};
+  if (init_app_context(&config, &app_context) < 0 ||
+      handover_load(&app_context) < 0 ||
+      hwmon_init_sources(&config, &app_context) < 0 ||
       hwmon_init_fans(&config, &app_context) < 0 ||
       init_custom_sensors(&config, &app_context) < 0 ||
-      link_curve_sensors(&app_context) < 0)
+      exec_start_sensors(&config, &app_context, &loop) < 0 ||
+      psi_init_triggers(&config, &app_context, &loop) < 0 ||
+      push_init_socket(&config, &app_context, &loop) < 0 ||
+      hotplug_init(&app_context, &loop) < 0 ||
+      suspend_init(&app_context, &loop) < 0 ||
+      autotune_init(&config, &app_context, &loop) < 0)
   {
     (void)fprintf(stderr, "Failed to initialise hardware\n");
+    destroy_events(&app_context, &loop);
+    destroy_hardware(&app_context);
+    free_config(&config);
+    return EXIT_FAILURE;
+  }
+
+  handover_restore(&app_context);
+
+  if (shadow_path && shadow_init(shadow_path, &app_context) < 0) {
+    destroy_events(&app_context, &loop);
     destroy_hardware(&app_context);
     free_config(&config);
     return EXIT_FAILURE;
   }
 
+  if (benchmark_cycles > 0) {
+    int ret = benchmark_run(&config, &app_context, benchmark_cycles, benchmark_pwm);
+    destroy_events(&app_context, &loop);
+    destroy_hardware(&app_context);
+    free_config(&config);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
 #ifdef DEBUG
   initscr();
   cbreak();
@@ -173,24 +371,105 @@ int main(int argc, char *argv[])
     .tv_nsec = interval_ms % 1000 * 1000000
   };
 
+  if (realtime_setup(&config.realtime, interval_ms * 1000000) < 0) {
+    (void)fprintf(stderr, "Failed to set up low-latency mode\n");
+    destroy_events(&app_context, &loop);
+    destroy_hardware(&app_context);
+    free_config(&config);
+    return EXIT_FAILURE;
+  }
+
+  // Everything the control loop needs has been copied or linked by now
+  config_release_strings(&config);
+
+  if (guardian_start(&app_context) < 0) {
+    (void)fprintf(stderr, "Running without a guardian, a crash leaves the fans at their last value\n");
+  }
+
+  // Fans taken over from a previous instance are already under manual
+  // control, and writing pwm_enable again resets the duty on some chips
+  for (int i = 0; i < app_context.num_fans; i++) {
+    if (!app_context.fan.hwmon[i].adopted) {
+      hwmon_enable_manual_control(&app_context.fan.hwmon[i]);
+    }
+  }
+
+  struct latency_histogram wakeup_latency = { .name = "Wakeup" };
+  struct latency_histogram tick_latency = { .name = "Wake-to-write" };
+
+  struct timespec deadline;
+  if (clock_gettime(CLOCK_MONOTONIC, &deadline) == -1) {
+    perror("clock_gettime");
+  }
+
+  bool out_of_band = false;
+
   while (keep_running) {
-    update_fans(app_context.fan, app_context.num_fans, &app_context.clock);
+    update_fans(&app_context);
+
+    struct timespec done;
+    if (clock_gettime(CLOCK_MONOTONIC, &done) == -1) {
+      perror("clock_gettime");
+    }
+    if (!out_of_band) {
+      latency_record(&wakeup_latency, &deadline, &app_context.clock);
+      latency_record(&tick_latency, &deadline, &done);
+    }
+
+    notify_tick(&notify, &app_context, tick_healthy(&app_context, &deadline, &interval, &done));
+    report_errors(&app_context);
 
 #ifdef DEBUG
     ui_update(&app_context);
 #endif // DEBUG
 
-    if (nanosleep(&interval, NULL) == -1 && errno == EINVAL) {
-      perror("nanosleep");
+    if (print_latency) {
+      print_latency = 0;
+      latency_print(&wakeup_latency, stderr);
+      latency_print(&tick_latency, stderr);
+      shadow_print(&app_context, stderr);
+      writer_print(&app_context, stderr);
+      autotune_print(&app_context, stderr);
+    }
+
+    if (!out_of_band) {
+      advance_deadline(&deadline, &interval, &done);
+    }
+
+    int ret;
+    do {
+      ret = loop_wait(&loop, &deadline);
+    } while (ret == LOOP_INTERRUPTED && keep_running);
+
+    if (ret < 0) {
       break;
     }
+    out_of_band = ret == LOOP_WAKE;
   }
 
-  for (int i = 0; i < app_context.num_fans; i++) {
-    hwmon_restore_auto_control(app_context.fan[i].hwmon);
+  // On SIGUSR2 the fans stay as they are for the next instance, which the
+  // service manager starts with the stored files and snapshot
+  bool handed_over = handover_requested && handover_save(&app_context) == 0;
+
+  notify_stopping();
+
+  if (config.realtime.scheduler || config.realtime.lock_memory) {
+    latency_print(&wakeup_latency, stderr);
+    latency_print(&tick_latency, stderr);
+  }
+  shadow_print(&app_context, stderr);
+  writer_print(&app_context, stderr);
+  autotune_print(&app_context, stderr);
+  (void)autotune_save(&app_context);
+
+  if (!handed_over) {
+    for (int i = 0; i < app_context.num_fans; i++) {
+      hwmon_restore_auto_control(&app_context.fan.hwmon[i]);
+    }
   }
+  guardian_release(&app_context);
+  destroy_events(&app_context, &loop);
   destroy_hardware(&app_context);
-  destroy_custom_sensors(&app_context);
   free_config(&config);
 
 #ifdef DEBUG
@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+#define MIN_TABLE_SIZE 16
+
+static uint32_t hash_name(enum name_kind kind, const char *name)
+{
+  uint32_t hash = FNV_OFFSET_BASIS;
+
+  hash = (hash ^ (uint32_t)kind) * FNV_PRIME;
+  for (const char *ptr = name; *ptr != '\0'; ptr++) {
+    hash = (hash ^ (unsigned char)*ptr) * FNV_PRIME;
+  }
+
+  return hash;
+}
+
+static struct name_entry *find_slot(const struct name_table *table, enum name_kind kind,
+                                    const char *name, uint32_t hash)
+{
+  for (uint32_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+    struct name_entry *entry = &table->entry[i];
+
+    if (entry->name == NULL) return entry;
+
+    if (entry->hash == hash && entry->kind == kind && strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+}
+
+int name_table_init(struct name_table *table, int max_entries)
+{
+  uint32_t size = MIN_TABLE_SIZE;
+  while (size < (uint32_t)max_entries * 2) {
+    size <<= 1;
+  }
+
+  table->entry = calloc(size, sizeof(*table->entry));
+  if (!table->entry) {
+    perror("Failed to allocate name table");
+    return -1;
+  }
+  table->mask = size - 1;
+  table->count = 0;
+
+  return 0;
+}
+
+int name_table_insert(struct name_table *table, enum name_kind kind, const char *name, int index)
+{
+  uint32_t hash = hash_name(kind, name);
+  struct name_entry *entry = find_slot(table, kind, name, hash);
+
+  if (entry->name != NULL) return -1;
+
+  *entry = (struct name_entry) {
+    .name = name,
+    .hash = hash,
+    .kind = kind,
+    .index = index
+  };
+  table->count++;
+
+  return 0;
+}
+
+int name_table_lookup(const struct name_table *table, enum name_kind kind, const char *name)
+{
+  if (table->entry == NULL) return -1;
+
+  struct name_entry *entry = find_slot(table, kind, name, hash_name(kind, name));
+
+  return entry->name != NULL ? entry->index : -1;
+}
+
+void name_table_free(struct name_table *table)
+{
+  free(table->entry);
+  table->entry = NULL;
+  table->mask = 0;
+  table->count = 0;
+}
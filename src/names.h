@@ -0,0 +1,30 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <stdint.h>
+
+enum name_kind {
+  NAME_SENSOR,
+  NAME_CURVE,
+  NAME_FAN
+};
+
+struct name_entry {
+  const char *name;
+  uint32_t hash;
+  enum name_kind kind;
+  int index;
+};
+
+struct name_table {
+  struct name_entry *entry;
+  uint32_t mask;
+  int count;
+};
+
+int name_table_init(struct name_table *table, int max_entries);
+int name_table_insert(struct name_table *table, enum name_kind kind, const char *name, int index);
+int name_table_lookup(const struct name_table *table, enum name_kind kind, const char *name);
+void name_table_free(struct name_table *table);
+
+#endif
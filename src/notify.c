@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "notify.h"
+#include "config.h"
+#include "control.h"
+#include "sd_compat.h"
+
+#define NOTIFY_SIZE 256
+#define STATUS_INTERVAL_NS 1000000000L
+#define NS_PER_USEC 1000L
+#define USEC_PER_MSEC 1000
+#define NS_PER_SEC 1000000000L
+
+static long elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * NS_PER_SEC + (end->tv_nsec - start->tv_nsec);
+}
+
+static int append_status(char *buffer, int len, const struct app_context *app_context)
+{
+  int ret = snprintf(buffer + len, NOTIFY_SIZE - len, "STATUS=");
+  if (ret < 0 || ret >= NOTIFY_SIZE - len) return len;
+  len += ret;
+
+  const struct fan_state *fan = &app_context->fan;
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    const struct app_sensor *sensor = &app_context->sensor[app_context->curve.sensor[fan->curve[i]]];
+
+    ret = snprintf(buffer + len, NOTIFY_SIZE - len, "%s%s %.0f%% (%s %.1f)",
+                   i ? ", " : "", fan->name[i], fan->fan_percent[i],
+                   sensor->name, sensor->current_value);
+    if (ret < 0 || ret >= NOTIFY_SIZE - len) {
+      buffer[len] = '\0';
+      break;
+    }
+    len += ret;
+  }
+
+  return len;
+}
+
+// Pings only go out on ticks, so an interval of half the watchdog timeout
+// or more would have the service killed and restarted over and over
+int notify_init(struct notify_state *state, float interval_ms)
+{
+  *state = (struct notify_state) {0};
+
+  // Zero or negative means no watchdog was requested by the service manager
+  if (sd_watchdog_enabled(0, &state->watchdog_usec) <= 0) {
+    state->watchdog_usec = 0;
+    return 0;
+  }
+
+  if ((double)interval_ms * USEC_PER_MSEC >= (double)state->watchdog_usec / 2.0) {
+    (void)fprintf(stderr, "Config error: \"interval\" of %.0f ms must be under half the watchdog timeout "
+                  "of %llu ms (WatchdogSec=)\n", interval_ms,
+                  (unsigned long long)(state->watchdog_usec / USEC_PER_MSEC));
+    return -1;
+  }
+
+  return 0;
+}
+
+void notify_tick(struct notify_state *state, const struct app_context *app_context, bool healthy)
+{
+  const struct timespec *now = &app_context->clock;
+  char buffer[NOTIFY_SIZE];
+  int len = 0;
+
+  // Hold back readiness until fans have actually been put under control once
+  if (!healthy) return;
+
+  if (!state->ready) {
+    state->ready = true;
+    len += snprintf(buffer + len, NOTIFY_SIZE - len, "READY=1\n");
+  }
+
+  // Ping at twice the watchdog rate so a single late tick does not trip it
+  if (state->watchdog_usec &&
+      (state->last_ping.tv_sec == 0 ||
+       elapsed_ns(&state->last_ping, now) >= (long)state->watchdog_usec * NS_PER_USEC / 2))
+  {
+    state->last_ping = *now;
+    len += snprintf(buffer + len, NOTIFY_SIZE - len, "WATCHDOG=1\n");
+  }
+
+  if (state->last_status.tv_sec == 0 || elapsed_ns(&state->last_status, now) >= STATUS_INTERVAL_NS) {
+    state->last_status = *now;
+    len = append_status(buffer, len, app_context);
+  }
+
+  if (len == 0) return;
+
+  // Failures are not fatal; the service manager handles a missed watchdog
+  (void)sd_notify(0, buffer);
+}
+
+void notify_stopping(void)
+{
+  (void)sd_notify(0, "STOPPING=1");
+}
@@ -0,0 +1,21 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+struct app_context;
+
+struct notify_state {
+  bool ready;
+  uint64_t watchdog_usec;
+  struct timespec last_ping;
+  struct timespec last_status;
+};
+
+int notify_init(struct notify_state *state, float interval_ms);
+void notify_tick(struct notify_state *state, const struct app_context *app_context, bool healthy);
+void notify_stopping(void);
+
+#endif
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "power.h"
+#include "arena.h"
+#include "control.h"
+#include "config.h"
+
+#define POWER_INPUT_SIZE 32
+#define UW_PER_WATT 1000000.0F
+#define NS_PER_SEC 1000000000.0F
+
+static int read_counter(int fildes, uint64_t *value)
+{
+  char input_string[POWER_INPUT_SIZE];
+  ssize_t nread = pread(fildes, input_string, POWER_INPUT_SIZE - 1, 0);
+  if (nread < 0) {
+    return -1;
+  }
+  input_string[nread] = '\0';
+
+  char *end;
+  errno = 0;
+  *value = strtoull(input_string, &end, 10);
+  if (end == input_string || errno != 0) {
+    errno = errno ? errno : EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+int power_read_watts(struct app_sensor *self)
+{
+  struct power_sensor_data *data = self->sensor_data;
+
+  uint64_t value;
+  if (read_counter(data->fildes, &value) < 0) {
+    return -1;
+  }
+
+  if (!data->counter) {
+    self->current_value = (float)value / UW_PER_WATT;
+    return 0;
+  }
+
+  uint64_t delta = value >= data->last_energy
+    ? value - data->last_energy
+    : value + (data->max_energy_range - data->last_energy);
+
+  float elapsed = (float)(self->timestamp.tv_sec - data->last_timestamp.tv_sec) +
+                  (float)(self->timestamp.tv_nsec - data->last_timestamp.tv_nsec) / NS_PER_SEC;
+
+  data->last_energy = value;
+  data->last_timestamp = self->timestamp;
+
+  if (elapsed <= 0) {
+    return 0;
+  }
+
+  self->current_value = (float)delta / UW_PER_WATT / elapsed;
+
+  return 0;
+}
+
+static void destroy_power_sensor(struct app_sensor *self)
+{
+  struct power_sensor_data *data = self->sensor_data;
+
+  if (close(data->fildes) == -1) {
+    perror("close");
+  }
+}
+
+static int init_counter(struct power_sensor_data *data, const char *path)
+{
+  char range_path[PATH_MAX];
+  const char *basename = strrchr(path, '/');
+  int dir_len = basename ? (int)(basename - path) : 0;
+
+  if (snprintf(range_path, sizeof(range_path), "%.*s/max_energy_range_uj",
+               dir_len, path) >= (int)sizeof(range_path))
+  {
+    (void)fprintf(stderr, "Path truncated: %s\n", range_path);
+    return -1;
+  }
+
+  int fildes = open(range_path, O_RDONLY | O_CLOEXEC);
+  if (fildes < 0) {
+    (void)fprintf(stderr, "Failed to open %s: %s\n", range_path, strerror(errno));
+    return -1;
+  }
+
+  int ret = read_counter(fildes, &data->max_energy_range);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to read %s: %s\n", range_path, strerror(errno));
+  }
+  close(fildes);
+  if (ret < 0) return -1;
+
+  if (read_counter(data->fildes, &data->last_energy) < 0) {
+    (void)fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &data->last_timestamp) == -1) {
+    perror("clock_gettime");
+    return -1;
+  }
+
+  return 0;
+}
+
+int link_power_sensor(struct app_context *app_context, struct app_sensor *sensor,
+                      struct custom_sensor_config *config)
+{
+  const char *path = config->type_opts.power.path;
+
+  struct power_sensor_data *data = arena_alloc(&app_context->arena, 1, sizeof(*data));
+  if (!data) return -1;
+
+  const char *basename = strrchr(path, '/');
+  data->counter = strcmp(basename ? basename + 1 : path, "energy_uj") == 0;
+
+  data->fildes = open(path, O_RDONLY | O_CLOEXEC);
+  if (data->fildes < 0) {
+    (void)fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (data->counter && init_counter(data, path) < 0) {
+    close(data->fildes);
+    return -1;
+  }
+
+  sensor->sensor_data = data;
+  sensor->destroy_func = destroy_power_sensor;
+
+  return 0;
+}
+
+size_t power_arena_size(const struct custom_sensor_config *config)
+{
+  (void)config;
+
+  return arena_size(1, sizeof(struct power_sensor_data));
+}
@@ -0,0 +1,27 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct power_sensor_data {
+  int fildes;
+
+  bool counter;
+  uint64_t max_energy_range;
+  uint64_t last_energy;
+  struct timespec last_timestamp;
+};
+
+struct app_context;
+struct app_sensor;
+struct custom_sensor_config;
+
+int power_read_watts(struct app_sensor *self);
+int link_power_sensor(struct app_context *app_context, struct app_sensor *sensor,
+                      struct custom_sensor_config *config);
+size_t power_arena_size(const struct custom_sensor_config *config);
+
+#endif
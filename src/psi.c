@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "psi.h"
+#include "arena.h"
+#include "config.h"
+#include "control.h"
+#include "loop.h"
+
+#define PSI_TRIGGER_SIZE 64
+#define US_PER_MS 1000L
+#define NS_PER_SEC 1000000000L
+
+static void apply_floor(struct psi_trigger *trigger)
+{
+  const struct pressure_config *config = trigger->config;
+  struct timespec until;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &until) == -1) {
+    perror("clock_gettime");
+    return;
+  }
+  until.tv_sec += (time_t)config->hold;
+  until.tv_nsec += (long)((config->hold - (float)(time_t)config->hold) * NS_PER_SEC);
+  if (until.tv_nsec >= NS_PER_SEC) {
+    until.tv_sec++;
+    until.tv_nsec -= NS_PER_SEC;
+  }
+
+  struct fan_state *fan = &trigger->app_context->fan;
+
+  for (int i = 0; i < config->num_fans; i++) {
+    int index = config->fan[i].index;
+
+    if (fan->floor_until[index].tv_sec == 0 || fan->floor_percent[index] < config->fan_percent) {
+      fan->floor_percent[index] = config->fan_percent;
+    }
+    fan->floor_until[index] = until;
+  }
+}
+
+static void handle_trigger(void *userdata, short revents)
+{
+  struct psi_trigger *trigger = userdata;
+
+  if (revents & (POLLERR | POLLNVAL)) {
+    (void)fprintf(stderr, "Pressure trigger on %s is no longer valid\n", trigger->path);
+    loop_remove(trigger->loop, trigger->fildes);
+    return;
+  }
+
+  if (!(revents & POLLPRI)) return;
+
+  if (trigger->config->fan_percent > 0) {
+    apply_floor(trigger);
+  }
+
+  loop_wake(trigger->loop);
+}
+
+static int open_trigger(struct psi_trigger *trigger)
+{
+  const struct pressure_config *config = trigger->config;
+
+  char buffer[PSI_TRIGGER_SIZE];
+  int len = snprintf(buffer, sizeof(buffer), "%s %ld %ld",
+                     config->type ? config->type : "some",
+                     (long)(config->stall * US_PER_MS), (long)(config->window * US_PER_MS));
+  if (len >= (int)sizeof(buffer)) {
+    (void)fprintf(stderr, "Pressure trigger truncated: %s\n", buffer);
+    return -1;
+  }
+
+  trigger->fildes = open(config->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (trigger->fildes < 0) {
+    (void)fprintf(stderr, "Failed to open %s: %s\n", config->path, strerror(errno));
+    return -1;
+  }
+
+  // The kernel expects the trigger to include its NUL terminator
+  if (write(trigger->fildes, buffer, len + 1) < 0) {
+    (void)fprintf(stderr, "Failed to register \"%s\" on %s: %s\n", buffer, config->path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int psi_init_triggers(struct config *config, struct app_context *app_context, struct event_loop *loop)
+{
+  if (config->num_pressure_triggers == 0) return 0;
+
+  app_context->trigger = arena_alloc(&app_context->arena, config->num_pressure_triggers,
+                                     sizeof(*app_context->trigger));
+  if (!app_context->trigger) return -1;
+
+  for (int i = 0; i < config->num_pressure_triggers; i++) {
+    struct psi_trigger *trigger = &app_context->trigger[i];
+
+    trigger->config = &config->pressure_trigger[i];
+    trigger->app_context = app_context;
+    trigger->loop = loop;
+    trigger->fildes = -1;
+    app_context->num_triggers++;
+
+    trigger->path = arena_strdup(&app_context->arena, config->pressure_trigger[i].path);
+    if (!trigger->path) return -1;
+
+    if (open_trigger(trigger) < 0) return -1;
+
+    if (loop_add(loop, trigger->fildes, POLLPRI, handle_trigger, trigger) < 0) return -1;
+  }
+
+  return 0;
+}
+
+void psi_destroy_triggers(struct app_context *app_context)
+{
+  for (int i = 0; i < app_context->num_triggers; i++) {
+    if (app_context->trigger[i].fildes >= 0 && close(app_context->trigger[i].fildes) == -1) {
+      perror("close");
+    }
+  }
+  app_context->trigger = NULL;
+  app_context->num_triggers = 0;
+}
+
+size_t psi_arena_size(const struct config *config)
+{
+  size_t size = arena_size(config->num_pressure_triggers, sizeof(struct psi_trigger));
+
+  for (int i = 0; i < config->num_pressure_triggers; i++) {
+    size += arena_string_size(config->pressure_trigger[i].path);
+  }
+
+  return size;
+}
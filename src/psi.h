@@ -0,0 +1,24 @@
+#ifndef PSI_H
+#define PSI_H
+
+#include <stddef.h>
+
+struct app_context;
+struct config;
+struct event_loop;
+struct pressure_config;
+
+struct psi_trigger {
+  const struct pressure_config *config;
+  const char *path;
+  int fildes;
+
+  struct app_context *app_context;
+  struct event_loop *loop;
+};
+
+int psi_init_triggers(struct config *config, struct app_context *app_context, struct event_loop *loop);
+void psi_destroy_triggers(struct app_context *app_context);
+size_t psi_arena_size(const struct config *config);
+
+#endif
@@ -0,0 +1,292 @@
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "push.h"
+#include "arena.h"
+#include "config.h"
+#include "control.h"
+#include "loop.h"
+
+#define PUSH_DATAGRAM_SIZE 512
+#define PUSH_SOCKET_MODE 0660
+#define NS_PER_SEC 1000000000.0F
+
+int push_read_temp(struct app_sensor *self)
+{
+  struct push_sensor_data *data = self->sensor_data;
+
+  if (!data->received) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  if (data->max_age > 0) {
+    float age = (float)(self->timestamp.tv_sec - data->timestamp.tv_sec) +
+                (float)(self->timestamp.tv_nsec - data->timestamp.tv_nsec) / NS_PER_SEC;
+    if (age > data->max_age) {
+      errno = ESTALE;
+      return -1;
+    }
+  }
+
+  self->current_value = data->value;
+
+  return 0;
+}
+
+int link_push_sensor(struct app_context *app_context, struct app_sensor *sensor,
+                     struct custom_sensor_config *config)
+{
+  struct push_sensor_data *data = arena_alloc(&app_context->arena, 1, sizeof(*data));
+  if (!data) return -1;
+
+  data->max_age = config->type_opts.push.max_age;
+  sensor->sensor_data = data;
+
+  return 0;
+}
+
+size_t push_sensor_arena_size(const struct custom_sensor_config *config)
+{
+  (void)config;
+
+  return arena_size(1, sizeof(struct push_sensor_data));
+}
+
+static struct app_sensor *find_sensor(struct push_server *server, const char *name, size_t len)
+{
+  for (int i = 0; i < server->num_sensors; i++) {
+    const char *sensor_name = server->sensor[i]->name;
+    if (strncmp(sensor_name, name, len) == 0 && sensor_name[len] == '\0') {
+      return server->sensor[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void update_sensor(struct push_server *server, const char *name, size_t len, float value,
+                          const struct timespec *now)
+{
+  struct app_sensor *sensor = find_sensor(server, name, len);
+  if (!sensor) {
+    log_entity(&server->log, LOG_WARNING, LOG_SOCKET, server->path, 0,
+               "Push for unknown sensor \"%.*s\"", (int)len, name);
+    return;
+  }
+
+  struct push_sensor_data *data = sensor->sensor_data;
+  data->value = value;
+  data->timestamp = *now;
+  data->received = true;
+}
+
+// Text datagrams hold one "name value" pair per line
+static void parse_text(struct push_server *server, char *buffer, const struct timespec *now)
+{
+  for (char *line = buffer, *next; line && *line; line = next) {
+    next = strchr(line, '\n');
+    if (next) *next++ = '\0';
+
+    char *space = strrchr(line, ' ');
+    if (!space || space == line) {
+      log_entity(&server->log, LOG_WARNING, LOG_SOCKET, server->path, 0,
+                 "Malformed push datagram: \"%s\"", line);
+      continue;
+    }
+
+    char *end;
+    float value = strtof(space + 1, &end);
+    if (end == space + 1 || (*end != '\0' && *end != '\r') || !isfinite(value)) {
+      log_entity(&server->log, LOG_WARNING, LOG_SOCKET, server->path, 0,
+                 "Malformed push value for \"%.*s\"", (int)(space - line), line);
+      continue;
+    }
+
+    update_sensor(server, line, space - line, value, now);
+  }
+}
+
+// Binary datagrams hold records of a zero byte, the name length, the name
+// and the value as a float in host byte order
+static void parse_binary(struct push_server *server, const unsigned char *buffer, size_t len,
+                         const struct timespec *now)
+{
+  size_t pos = 0;
+
+  while (pos < len) {
+    if (len - pos < 2 || buffer[pos] != 0 || len - pos - 2 < buffer[pos + 1] + sizeof(float)) {
+      log_entity(&server->log, LOG_WARNING, LOG_SOCKET, server->path, 0,
+                 "Malformed binary push datagram");
+      return;
+    }
+
+    size_t name_len = buffer[pos + 1];
+    const char *name = (const char *)buffer + pos + 2;
+
+    float value;
+    memcpy(&value, buffer + pos + 2 + name_len, sizeof(value));
+    pos += 2 + name_len + sizeof(value);
+
+    if (!isfinite(value)) {
+      log_entity(&server->log, LOG_WARNING, LOG_SOCKET, server->path, 0,
+                 "Malformed push value for \"%.*s\"", (int)name_len, name);
+      continue;
+    }
+
+    update_sensor(server, name, name_len, value, now);
+  }
+}
+
+static void handle_datagram(void *userdata, short revents)
+{
+  struct push_server *server = userdata;
+
+  if (revents & (POLLERR | POLLNVAL)) {
+    (void)fprintf(stderr, "Push socket %s is no longer valid\n", server->path);
+    return;
+  }
+
+  for (;;) {
+    char buffer[PUSH_DATAGRAM_SIZE];
+    ssize_t len = recv(server->fildes, buffer, sizeof(buffer) - 1, MSG_DONTWAIT | MSG_TRUNC);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        perror("recv");
+      }
+      return;
+    }
+    if (len >= (ssize_t)sizeof(buffer)) {
+      log_entity(&server->log, LOG_WARNING, LOG_SOCKET, server->path, 0,
+                 "Push datagram of %zd bytes is too long", len);
+      continue;
+    }
+    if (len == 0) continue;
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+      perror("clock_gettime");
+      return;
+    }
+
+    if (buffer[0] == '\0') {
+      parse_binary(server, (unsigned char *)buffer, len, &now);
+    }
+    else {
+      buffer[len] = '\0';
+      parse_text(server, buffer, &now);
+    }
+  }
+}
+
+static int bind_socket(struct push_server *server)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(server->path) >= sizeof(addr.sun_path)) {
+    (void)fprintf(stderr, "Push socket path too long: %s\n", server->path);
+    return -1;
+  }
+  strcpy(addr.sun_path, server->path);
+
+  server->fildes = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server->fildes < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  // Remove a socket left behind by an earlier instance that did not exit cleanly
+  struct stat st;
+  if (lstat(server->path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(server->path) == -1) {
+    (void)fprintf(stderr, "Failed to remove %s: %s\n", server->path, strerror(errno));
+    return -1;
+  }
+
+  mode_t mask = umask(~PUSH_SOCKET_MODE & 0777);
+  int ret = bind(server->fildes, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (ret == -1) {
+    (void)fprintf(stderr, "Failed to bind %s: %s\n", server->path, strerror(errno));
+    close(server->fildes);
+    server->fildes = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int count_push_sensors(const struct config *config)
+{
+  int count = 0;
+
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    count += strcmp(config->custom_sensor[i].type, "push") == 0;
+  }
+
+  return count;
+}
+
+static const char *socket_path(const struct config *config)
+{
+  return config->push_socket ? config->push_socket : PUSH_DEFAULT_SOCKET;
+}
+
+int push_init_socket(struct config *config, struct app_context *app_context, struct event_loop *loop)
+{
+  int num_sensors = count_push_sensors(config);
+  if (num_sensors == 0) return 0;
+
+  struct arena *arena = &app_context->arena;
+
+  struct push_server *server = arena_alloc(arena, 1, sizeof(*server));
+  if (!server) return -1;
+  server->fildes = -1;
+
+  server->path = arena_strdup(arena, socket_path(config));
+  server->sensor = arena_alloc(arena, num_sensors, sizeof(*server->sensor));
+  if (!server->path || !server->sensor) return -1;
+
+  for (int i = 0; i < config->num_custom_sensors; i++) {
+    if (strcmp(config->custom_sensor[i].type, "push") != 0) continue;
+
+    server->sensor[server->num_sensors++] = &app_context->sensor[config->custom_sensor[i].slot];
+  }
+  app_context->push = server;
+
+  if (bind_socket(server) < 0) return -1;
+
+  return loop_add(loop, server->fildes, POLLIN, handle_datagram, server);
+}
+
+void push_destroy_socket(struct app_context *app_context)
+{
+  struct push_server *server = app_context->push;
+  if (!server || server->fildes < 0) return;
+
+  if (close(server->fildes) == -1) {
+    perror("close");
+  }
+  if (unlink(server->path) == -1 && errno != ENOENT) {
+    (void)fprintf(stderr, "Failed to remove %s: %s\n", server->path, strerror(errno));
+  }
+  app_context->push = NULL;
+}
+
+size_t push_arena_size(const struct config *config)
+{
+  int num_sensors = count_push_sensors(config);
+  if (num_sensors == 0) return 0;
+
+  return arena_size(1, sizeof(struct push_server)) +
+         arena_string_size(socket_path(config)) +
+         arena_size(num_sensors, sizeof(struct app_sensor *));
+}
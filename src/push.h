@@ -0,0 +1,44 @@
+#ifndef PUSH_H
+#define PUSH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "log.h"
+
+#define PUSH_DEFAULT_SOCKET "/run/cfans/push.sock"
+
+struct push_sensor_data {
+  float value;
+  float max_age;
+  bool received;
+  struct timespec timestamp;
+};
+
+struct push_server {
+  const char *path;
+  int fildes;
+
+  struct app_sensor **sensor;
+  int num_sensors;
+
+  struct log_bucket log;
+};
+
+struct app_context;
+struct app_sensor;
+struct config;
+struct custom_sensor_config;
+struct event_loop;
+
+int push_read_temp(struct app_sensor *self);
+int link_push_sensor(struct app_context *app_context, struct app_sensor *sensor,
+                     struct custom_sensor_config *config);
+size_t push_sensor_arena_size(const struct custom_sensor_config *config);
+
+int push_init_socket(struct config *config, struct app_context *app_context, struct event_loop *loop);
+void push_destroy_socket(struct app_context *app_context);
+size_t push_arena_size(const struct config *config);
+
+#endif
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "realtime.h"
+#include "config.h"
+
+#define NS_PER_SEC 1000000000L
+#define NS_PER_MS 1000000L
+#define NS_PER_US 1000L
+#define PREFAULT_STACK_SIZE (256 * 1024)
+#define DEFAULT_DEADLINE_RUNTIME 2.0F // 2ms
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+
+struct deadline_attr {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+};
+
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+  CPU_ZERO(set);
+
+  const char *ptr = list;
+  while (*ptr != '\0') {
+    char *end;
+    long first = strtol(ptr, &end, 10);
+    if (end == ptr) return -1;
+
+    long last = first;
+    if (*end == '-') {
+      ptr = end + 1;
+      last = strtol(ptr, &end, 10);
+      if (end == ptr) return -1;
+    }
+
+    if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+
+    ptr = end;
+    if (*ptr == ',') {
+      ptr++;
+    }
+    else if (*ptr != '\0') {
+      return -1;
+    }
+  }
+
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+[[gnu::noinline]] static void prefault_stack(void)
+{
+  unsigned char stack[PREFAULT_STACK_SIZE];
+
+  memset(stack, 0, sizeof(stack));
+  __asm__ volatile("" : : "r"(stack) : "memory");
+}
+
+static int lock_memory(void)
+{
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+    perror("mlockall");
+    return -1;
+  }
+
+  // Keep freed memory mapped so the heap never has to fault pages back in
+  if (mallopt(M_TRIM_THRESHOLD, -1) == 0 || mallopt(M_MMAP_MAX, 0) == 0) {
+    (void)fprintf(stderr, "Failed to disable heap trimming\n");
+  }
+
+  prefault_stack();
+
+  return 0;
+}
+
+static int set_scheduler(const struct realtime_config *config, long interval_ns)
+{
+  if (strcmp(config->scheduler, "other") == 0) {
+    return 0;
+  }
+
+  if (strcmp(config->scheduler, "fifo") == 0 || strcmp(config->scheduler, "rr") == 0) {
+    int policy = strcmp(config->scheduler, "fifo") == 0 ? SCHED_FIFO : SCHED_RR;
+    struct sched_param param = {
+      .sched_priority = (int)config->priority
+    };
+
+    if (param.sched_priority < sched_get_priority_min(policy) ||
+        param.sched_priority > sched_get_priority_max(policy))
+    {
+      (void)fprintf(stderr, "Config error: \"priority\" must be between %d and %d\n",
+                    sched_get_priority_min(policy), sched_get_priority_max(policy));
+      return -1;
+    }
+
+    if (sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &param) == -1) {
+      perror("sched_setscheduler");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if (strcmp(config->scheduler, "deadline") == 0) {
+    float runtime = config->runtime > 0 ? config->runtime : DEFAULT_DEADLINE_RUNTIME;
+
+    struct deadline_attr attr = {
+      .size = sizeof(attr),
+      .sched_policy = SCHED_DEADLINE,
+      .sched_flags = SCHED_FLAG_RESET_ON_FORK,
+      .sched_runtime = (uint64_t)(runtime * NS_PER_MS),
+      .sched_deadline = interval_ns,
+      .sched_period = interval_ns
+    };
+
+    if (attr.sched_runtime > attr.sched_period) {
+      (void)fprintf(stderr, "Config error: \"runtime\" can't be longer than \"interval\"\n");
+      return -1;
+    }
+
+    if (syscall(SYS_sched_setattr, 0, &attr, 0) == -1) {
+      perror("sched_setattr");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  (void)fprintf(stderr, "Config error: unknown scheduler \"%s\"\n", config->scheduler);
+  return -1;
+}
+
+int realtime_setup(const struct realtime_config *config, long interval_ns)
+{
+  if (config->lock_memory && lock_memory() < 0) {
+    return -1;
+  }
+
+  if (config->cpu_affinity) {
+    cpu_set_t set;
+    if (parse_cpu_list(config->cpu_affinity, &set) < 0) {
+      (void)fprintf(stderr, "Config error: invalid CPU list \"%s\"\n", config->cpu_affinity);
+      return -1;
+    }
+
+    if (config->scheduler && strcmp(config->scheduler, "deadline") == 0) {
+      (void)fprintf(stderr, "Config error: \"cpu affinity\" can't be used with the deadline scheduler\n");
+      return -1;
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+      perror("sched_setaffinity");
+      return -1;
+    }
+  }
+
+  if (config->scheduler && set_scheduler(config, interval_ns) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void latency_record(struct latency_histogram *histogram, const struct timespec *start,
+                    const struct timespec *end)
+{
+  long latency = (end->tv_sec - start->tv_sec) * NS_PER_SEC + (end->tv_nsec - start->tv_nsec);
+  if (latency < 0) {
+    latency = 0;
+  }
+
+  int bucket = 0;
+  for (long us = latency / NS_PER_US; us > 0 && bucket < LATENCY_BUCKETS - 1; us >>= 1) {
+    bucket++;
+  }
+
+  histogram->bucket[bucket]++;
+  histogram->count++;
+  if (latency > histogram->max_ns) {
+    histogram->max_ns = latency;
+  }
+}
+
+void latency_print(const struct latency_histogram *histogram, FILE *stream)
+{
+  (void)fprintf(stream, "%s latency over %lu ticks, max %ld us:\n",
+                histogram->name, histogram->count, histogram->max_ns / NS_PER_US);
+
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    if (histogram->bucket[i] == 0) continue;
+
+    if (i == LATENCY_BUCKETS - 1) {
+      (void)fprintf(stream, "  >= %8ld us: %lu\n", 1L << (i - 1), histogram->bucket[i]);
+    }
+    else {
+      (void)fprintf(stream, "  <  %8ld us: %lu\n", 1L << i, histogram->bucket[i]);
+    }
+  }
+}
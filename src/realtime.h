@@ -0,0 +1,24 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdio.h>
+#include <time.h>
+
+#define LATENCY_BUCKETS 22
+
+struct realtime_config;
+
+struct latency_histogram {
+  const char *name;
+  unsigned long bucket[LATENCY_BUCKETS];
+  unsigned long count;
+  long max_ns;
+};
+
+int realtime_setup(const struct realtime_config *config, long interval_ns);
+
+void latency_record(struct latency_histogram *histogram, const struct timespec *start,
+                    const struct timespec *end);
+void latency_print(const struct latency_histogram *histogram, FILE *stream);
+
+#endif
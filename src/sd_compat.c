@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sd_compat.h"
+
+#define NOTIFY_MAX_FDS 16
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+static int parse_long(const char *string, long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtol(string, &end, 10);
+  if (errno || end == string || *end != '\0') return -EINVAL;
+
+  return 0;
+}
+
+// NOTIFY_SOCKET is either a path or, with a leading '@', an abstract name
+static int notify_address(const char *path, struct sockaddr_un *addr, socklen_t *addr_len)
+{
+  size_t len = strlen(path);
+
+  if (path[0] != '/' && path[0] != '@') return -EAFNOSUPPORT;
+  if (len >= sizeof(addr->sun_path)) return -EINVAL;
+
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path, len);
+  if (path[0] == '@') addr->sun_path[0] = '\0';
+
+  *addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + (path[0] == '/'));
+
+  return 0;
+}
+
+int sd_pid_notify_with_fds(pid_t pid, int unset_environment, const char *state,
+                           const int *fds, unsigned n_fds)
+{
+  const char *path = getenv("NOTIFY_SOCKET");
+  int ret = 0;
+
+  if (!path) goto finish;
+
+  if (n_fds > NOTIFY_MAX_FDS) {
+    ret = -E2BIG;
+    goto finish;
+  }
+
+  struct sockaddr_un addr = {0};
+  socklen_t addr_len;
+  ret = notify_address(path, &addr, &addr_len);
+  if (ret < 0) goto finish;
+
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(sizeof(int) * NOTIFY_MAX_FDS)];
+  } control = {0};
+
+  struct iovec iov = {.iov_base = (char *)state, .iov_len = strlen(state)};
+  struct msghdr msg = {
+    .msg_name = &addr,
+    .msg_namelen = addr_len,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buffer,
+  };
+
+  // Only needed when notifying on behalf of another process
+  bool send_ucred = pid != 0 && pid != getpid();
+  size_t control_len = (send_ucred ? CMSG_SPACE(sizeof(struct ucred)) : 0) +
+                       (n_fds ? CMSG_SPACE(sizeof(int) * n_fds) : 0);
+  msg.msg_controllen = control_len;
+
+  struct cmsghdr *cmsg = control_len ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (n_fds) {
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+    cmsg = CMSG_NXTHDR(&msg, cmsg);
+  }
+  if (send_ucred) {
+    struct ucred cred = {.pid = pid, .uid = getuid(), .gid = getgid()};
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_CREDENTIALS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(cred));
+    memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+  }
+  if (!control_len) msg.msg_control = NULL;
+
+  int fildes = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fildes < 0) {
+    ret = -errno;
+    goto finish;
+  }
+
+  ret = sendmsg(fildes, &msg, MSG_NOSIGNAL) < 0 ? -errno : 1;
+  (void)close(fildes);
+
+finish:
+  if (unset_environment) (void)unsetenv("NOTIFY_SOCKET");
+  return ret;
+}
+
+int sd_notify(int unset_environment, const char *state)
+{
+  return sd_pid_notify_with_fds(0, unset_environment, state, NULL, 0);
+}
+
+int sd_watchdog_enabled(int unset_environment, uint64_t *usec)
+{
+  const char *usec_string = getenv("WATCHDOG_USEC");
+  const char *pid_string = getenv("WATCHDOG_PID");
+  int ret = 0;
+
+  if (!usec_string) goto finish;
+
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(usec_string, &end, 10);
+  if (errno || end == usec_string || *end != '\0' || value == 0) {
+    ret = -EINVAL;
+    goto finish;
+  }
+
+  if (pid_string) {
+    long pid;
+    ret = parse_long(pid_string, &pid);
+    if (ret < 0) goto finish;
+    if (pid != getpid()) goto finish;
+  }
+
+  *usec = value;
+  ret = 1;
+
+finish:
+  if (unset_environment) {
+    (void)unsetenv("WATCHDOG_USEC");
+    (void)unsetenv("WATCHDOG_PID");
+  }
+  return ret;
+}
+
+static void free_names(char **names, int count)
+{
+  for (int k = 0; k < count; k++) {
+    free(names[k]);
+  }
+  free(names);
+}
+
+// Files passed in are closed on exec like libsystemd does; names missing
+// from LISTEN_FDNAMES are "unknown"
+int sd_listen_fds_with_names(int unset_environment, char ***names_out)
+{
+  const char *pid_string = getenv("LISTEN_PID");
+  const char *fds_string = getenv("LISTEN_FDS");
+  const char *names_string = getenv("LISTEN_FDNAMES");
+  int ret = 0;
+
+  if (!pid_string || !fds_string) goto finish;
+
+  long pid;
+  long num_fds;
+  ret = parse_long(pid_string, &pid);
+  if (ret < 0) goto finish;
+  if (pid != getpid()) goto finish;
+
+  ret = parse_long(fds_string, &num_fds);
+  if (ret < 0) goto finish;
+  if (num_fds <= 0 || num_fds > INT32_MAX - SD_LISTEN_FDS_START) {
+    ret = num_fds == 0 ? 0 : -EINVAL;
+    goto finish;
+  }
+
+  for (int fildes = SD_LISTEN_FDS_START; fildes < SD_LISTEN_FDS_START + num_fds; fildes++) {
+    int flags = fcntl(fildes, F_GETFD);
+    if (flags < 0 || fcntl(fildes, F_SETFD, flags | FD_CLOEXEC) < 0) {
+      ret = -errno;
+      goto finish;
+    }
+  }
+
+  char **names = calloc((size_t)num_fds + 1, sizeof(*names));
+  if (!names) {
+    ret = -ENOMEM;
+    goto finish;
+  }
+
+  const char *name = names_string;
+  for (int k = 0; k < num_fds; k++) {
+    size_t len = 0;
+    if (name) {
+      const char *colon = strchr(name, ':');
+      len = colon ? (size_t)(colon - name) : strlen(name);
+    }
+
+    names[k] = len ? strndup(name, len) : strdup("unknown");
+    if (!names[k]) {
+      free_names(names, k);
+      ret = -ENOMEM;
+      goto finish;
+    }
+
+    if (name) {
+      name = name[len] == ':' ? name + len + 1 : NULL;
+    }
+  }
+
+  *names_out = names;
+  ret = (int)num_fds;
+
+finish:
+  if (unset_environment) {
+    (void)unsetenv("LISTEN_PID");
+    (void)unsetenv("LISTEN_FDS");
+    (void)unsetenv("LISTEN_FDNAMES");
+  }
+  return ret;
+}
+
+// Native journal protocol: "FIELD=value\n", or for values containing a
+// newline "FIELD\n", the value's length as 64 bit little endian, the value
+// and "\n"
+int sd_journal_sendv(const struct iovec *iov, int n)
+{
+  static int journal_fildes = -1;
+
+  size_t size = 0;
+  for (int i = 0; i < n; i++) {
+    size += iov[i].iov_len + 1 + sizeof(uint64_t);
+  }
+
+  char *buffer = malloc(size);
+  if (!buffer) return -ENOMEM;
+
+  char *pos = buffer;
+  for (int i = 0; i < n; i++) {
+    const char *field = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+
+    const char *equals = memchr(field, '=', len);
+    if (!equals) {
+      free(buffer);
+      return -EINVAL;
+    }
+
+    size_t key_len = (size_t)(equals - field);
+    size_t value_len = len - key_len - 1;
+    if (memchr(equals + 1, '\n', value_len) == NULL) {
+      memcpy(pos, field, len);
+      pos += len;
+    }
+    else {
+      uint64_t le_len = htole64(value_len);
+      memcpy(pos, field, key_len);
+      pos += key_len;
+      *pos++ = '\n';
+      memcpy(pos, &le_len, sizeof(le_len));
+      pos += sizeof(le_len);
+      memcpy(pos, equals + 1, value_len);
+      pos += value_len;
+    }
+    *pos++ = '\n';
+  }
+
+  if (journal_fildes < 0) {
+    journal_fildes = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  }
+
+  int ret = 0;
+  if (journal_fildes < 0) {
+    ret = -errno;
+  }
+  else {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = JOURNAL_SOCKET};
+    if (sendto(journal_fildes, buffer, (size_t)(pos - buffer), MSG_NOSIGNAL,
+               (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+      ret = -errno;
+    }
+  }
+
+  free(buffer);
+  return ret;
+}
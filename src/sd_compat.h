@@ -0,0 +1,30 @@
+#ifndef SD_COMPAT_H
+#define SD_COMPAT_H
+
+// The sysfs build speaks the service manager's notify and fd passing
+// protocols and the journal's native protocol itself instead of linking
+// libsystemd. Only the calls cfans makes are provided.
+#ifdef CFANS_SYSFS
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+#define SD_LISTEN_FDS_START 3
+
+int sd_notify(int unset_environment, const char *state);
+int sd_pid_notify_with_fds(pid_t pid, int unset_environment, const char *state,
+                           const int *fds, unsigned n_fds);
+int sd_watchdog_enabled(int unset_environment, uint64_t *usec);
+int sd_listen_fds_with_names(int unset_environment, char ***names);
+int sd_journal_sendv(const struct iovec *iov, int n);
+
+#else
+
+#include <systemd/sd-daemon.h>
+#include <systemd/sd-journal.h>
+
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shadow.h"
+
+// hwmon pwm files take values from 0 to 255
+#define PWM_DUTY_MAX 255.0
+
+static int find_live_sensor(const struct app_context *app_context, const char *name)
+{
+  for (int i = 0; i < app_context->num_sensors; i++) {
+    if (app_context->sensor[i].name && strcmp(app_context->sensor[i].name, name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int find_live_fan(const struct app_context *app_context, const char *name)
+{
+  for (int i = 0; i < app_context->num_fans; i++) {
+    if (strcmp(app_context->fan.name[i], name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// The shadow config is parsed and checked in full, but its sources and
+// custom sensors are never opened: its curves read the live sensors of the
+// same name, so both controllers see the same readings every tick
+int shadow_init(const char *path, struct app_context *app_context)
+{
+  struct shadow *shadow = calloc(1, sizeof(*shadow));
+  if (!shadow) {
+    perror("Failed to allocate shadow controller");
+    return -1;
+  }
+  app_context->shadow = shadow;
+
+  if (load_config(path, &shadow->config) < 0) {
+    (void)fprintf(stderr, "Error loading shadow config file: %s\n", path);
+    return -1;
+  }
+
+  struct app_context *context = &shadow->context;
+  if (init_app_context(&shadow->config, context) < 0) return -1;
+
+  int errors = 0;
+  for (int c = 0; c < context->num_curves; c++) {
+    const struct curve_config *curve = &shadow->config.curve[c];
+
+    context->curve.sensor[c] = find_live_sensor(app_context, curve->sensor);
+    if (context->curve.sensor[c] < 0) {
+      (void)fprintf(stderr, "Shadow config error: sensor \"%s\" of curve \"%s\" is not in the live config\n",
+                    curve->sensor, curve->name);
+      errors++;
+    }
+  }
+  if (errors) return -1;
+
+  context->sensor = app_context->sensor;
+  context->num_sensors = app_context->num_sensors;
+
+  shadow->fan = calloc(context->num_fans, sizeof(*shadow->fan));
+  if (context->num_fans && !shadow->fan) {
+    perror("Failed to allocate shadow fans");
+    return -1;
+  }
+
+  for (int i = 0; i < context->num_fans; i++) {
+    shadow->fan[i].live = find_live_fan(app_context, context->fan.name[i]);
+  }
+
+  config_release_strings(&shadow->config);
+
+  return 0;
+}
+
+static bool live_changed(const struct app_context *app_context, int index, int num_live_changed)
+{
+  for (int k = 0; k < num_live_changed; k++) {
+    if (app_context->fan.changed[k] == index) return true;
+  }
+
+  return false;
+}
+
+// Runs after the live writes of the same tick, so sensors are only read
+// here when no live curve uses them and never hold up a PWM write. The
+// failure policy events of shadow curves are left unreported, so the
+// journal only names live curves.
+void shadow_update(struct app_context *app_context, int num_live_changed)
+{
+  struct shadow *shadow = app_context->shadow;
+  if (!shadow) return;
+
+  struct app_context *context = &shadow->context;
+  const struct fan_state *live = &app_context->fan;
+  const struct fan_state *fan = &context->fan;
+
+  context->tick = app_context->tick;
+  context->clock = app_context->clock;
+
+  int num_changed = control_evaluate(context);
+  for (int k = 0; k < num_changed; k++) {
+    shadow->fan[fan->changed[k]].writes++;
+  }
+
+  for (int i = 0; i < context->num_fans; i++) {
+    struct shadow_fan *stats = &shadow->fan[i];
+    int j = stats->live;
+    if (j < 0) continue;
+
+    if (live_changed(app_context, j, num_live_changed)) {
+      stats->live_writes++;
+    }
+
+    if (fan->pwm_value[i] < 0 || live->pwm_value[j] < 0) continue;
+
+    double diff = (fan->pwm_value[i] - live->pwm_value[j]) * 100.0 / PWM_DUTY_MAX;
+    stats->duty_diff += diff;
+    stats->duty_abs += fabs(diff);
+    stats->samples++;
+  }
+
+  shadow->ticks++;
+}
+
+void shadow_print(const struct app_context *app_context, FILE *stream)
+{
+  const struct shadow *shadow = app_context->shadow;
+  if (!shadow) return;
+
+  const struct app_context *context = &shadow->context;
+  const struct fan_state *live = &app_context->fan;
+
+  (void)fprintf(stream, "Shadow config over %lu ticks:\n", shadow->ticks);
+  (void)fprintf(stream, "  %-24s %8s %8s %10s %10s %9s %9s\n",
+                "Fan", "live pwm", "pwm", "live writes", "writes", "duty diff", "abs diff");
+
+  for (int i = 0; i < context->num_fans; i++) {
+    const struct shadow_fan *stats = &shadow->fan[i];
+    int pwm_value = context->fan.pwm_value[i];
+
+    if (stats->live < 0) {
+      (void)fprintf(stream, "  %-24s %8s %8d %10s %10lu %9s %9s\n",
+                    context->fan.name[i], "-", pwm_value, "-", stats->writes, "-", "-");
+      continue;
+    }
+
+    double samples = stats->samples ? (double)stats->samples : 1.0;
+    (void)fprintf(stream, "  %-24s %8d %8d %10lu %10lu %+8.2f%% %8.2f%%\n",
+                  context->fan.name[i], live->pwm_value[stats->live], pwm_value,
+                  stats->live_writes, stats->writes,
+                  stats->duty_diff / samples, stats->duty_abs / samples);
+  }
+}
+
+void shadow_destroy(struct app_context *app_context)
+{
+  struct shadow *shadow = app_context->shadow;
+  if (!shadow) return;
+
+  // The sensors belong to the live controller
+  shadow->context.sensor = NULL;
+  destroy_app_context(&shadow->context);
+  free_config(&shadow->config);
+  free(shadow->fan);
+  free(shadow);
+  app_context->shadow = NULL;
+}
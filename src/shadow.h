@@ -0,0 +1,38 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdio.h>
+
+#include "config.h"
+#include "control.h"
+
+struct shadow_fan {
+  // Live fan of the same name, or -1
+  int live;
+
+  unsigned long writes;
+  unsigned long live_writes;
+
+  // Sums of the shadow minus the live duty cycle, in percent, over the
+  // ticks where both fans had a pwm value
+  unsigned long samples;
+  double duty_diff;
+  double duty_abs;
+};
+
+// A second config evaluated on the live sensor readings every tick, whose
+// pwm values are compared with the live ones but never written
+struct shadow {
+  struct config config;
+  struct app_context context;
+
+  struct shadow_fan *fan;
+  unsigned long ticks;
+};
+
+int shadow_init(const char *path, struct app_context *app_context);
+void shadow_update(struct app_context *app_context, int num_live_changed);
+void shadow_print(const struct app_context *app_context, FILE *stream);
+void shadow_destroy(struct app_context *app_context);
+
+#endif
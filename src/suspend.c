@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "suspend.h"
+#include "arena.h"
+#include "control.h"
+#include "hwmon.h"
+#include "loop.h"
+
+#ifdef CFANS_SYSFS
+
+// The sysfs build has no D-Bus client, so the fans are left as they are
+// across sleep
+int suspend_init(struct app_context *app_context, struct event_loop *loop)
+{
+  (void)app_context;
+  (void)loop;
+  (void)fprintf(stderr, "Built without the system bus, suspend handling disabled\n");
+  return 0;
+}
+
+void suspend_destroy(struct app_context *app_context)
+{
+  (void)app_context;
+}
+
+#else
+
+#define LOGIND_SERVICE "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER "org.freedesktop.login1.Manager"
+
+static void release_inhibitor(struct suspend_monitor *monitor)
+{
+  if (monitor->inhibitor >= 0 && close(monitor->inhibitor) == -1) {
+    perror("close");
+  }
+  monitor->inhibitor = -1;
+}
+
+static int handle_inhibit_reply(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+  (void)ret_error;
+  struct suspend_monitor *monitor = userdata;
+
+  monitor->inhibit_call = sd_bus_slot_unref(monitor->inhibit_call);
+
+  const sd_bus_error *error = sd_bus_message_get_error(reply);
+  if (error) {
+    (void)fprintf(stderr, "Failed to take a sleep inhibitor: %s\n", error->message);
+    return 0;
+  }
+
+  // The descriptor belongs to the message, so keep a copy
+  int fildes;
+  int ret = sd_bus_message_read(reply, "h", &fildes);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to read sleep inhibitor: %s\n", strerror(-ret));
+    return 0;
+  }
+
+  release_inhibitor(monitor);
+  monitor->inhibitor = fcntl(fildes, F_DUPFD_CLOEXEC, 3);
+  if (monitor->inhibitor < 0) {
+    perror("fcntl");
+  }
+
+  return 0;
+}
+
+// A delay inhibitor holds off sleep until the fans have been handed back
+// to firmware control, or until logind's InhibitDelayMaxSec runs out
+static void take_inhibitor(struct suspend_monitor *monitor)
+{
+  if (monitor->inhibit_call) return;
+
+  int ret = sd_bus_call_method_async(monitor->bus, &monitor->inhibit_call,
+                                     LOGIND_SERVICE, LOGIND_PATH, LOGIND_MANAGER, "Inhibit",
+                                     handle_inhibit_reply, monitor, "ssss", "sleep", "cfans",
+                                     "Handing fans back to firmware control", "delay");
+  if (ret >= 0) {
+    ret = sd_bus_flush(monitor->bus);
+  }
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to request a sleep inhibitor: %s\n", strerror(-ret));
+  }
+}
+
+static void prepare_for_sleep(struct suspend_monitor *monitor)
+{
+  struct app_context *app_context = monitor->app_context;
+
+  app_context->suspended = true;
+  for (int i = 0; i < app_context->num_fans; i++) {
+    if (app_context->fan.hwmon[i].device) {
+      hwmon_restore_auto_control(&app_context->fan.hwmon[i]);
+    }
+  }
+
+  release_inhibitor(monitor);
+}
+
+// Firmware often resumes with its own fan control and reset registers,
+// so every fan is put back under manual control and given its last value
+// without waiting for the values to change
+static void resume(struct suspend_monitor *monitor)
+{
+  struct app_context *app_context = monitor->app_context;
+  struct fan_state *fan = &app_context->fan;
+
+  for (int i = 0; i < app_context->num_fans; i++) {
+    if (!fan->hwmon[i].device) continue;
+
+    hwmon_enable_manual_control(&fan->hwmon[i]);
+    if (fan->pwm_value[i] >= 0 && hwmon_set_pwm(fan->pwm_fildes[i], fan->pwm_value[i]) < 0) {
+      fan->error[i] = errno;
+    }
+  }
+  app_context->suspended = false;
+
+  take_inhibitor(monitor);
+  loop_wake(monitor->loop);
+}
+
+static int handle_prepare_for_sleep(sd_bus_message *message, void *userdata, sd_bus_error *ret_error)
+{
+  (void)ret_error;
+  struct suspend_monitor *monitor = userdata;
+
+  int start;
+  int ret = sd_bus_message_read(message, "b", &start);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to read PrepareForSleep: %s\n", strerror(-ret));
+    return 0;
+  }
+
+  if (start) {
+    prepare_for_sleep(monitor);
+  }
+  else {
+    resume(monitor);
+  }
+
+  return 0;
+}
+
+static void process_bus(struct suspend_monitor *monitor)
+{
+  int ret;
+  while ((ret = sd_bus_process(monitor->bus, NULL)) > 0) {
+  }
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to process bus messages: %s\n", strerror(-ret));
+    loop_remove(monitor->loop, monitor->fildes);
+  }
+}
+
+static void handle_bus(void *userdata, short revents)
+{
+  struct suspend_monitor *monitor = userdata;
+
+  if (revents & (POLLERR | POLLNVAL)) {
+    (void)fprintf(stderr, "Lost the system bus connection\n");
+    loop_remove(monitor->loop, monitor->fildes);
+    return;
+  }
+
+  process_bus(monitor);
+}
+
+// Suspend handling is optional; without a system bus or logind the fans
+// are simply left as they are across sleep
+int suspend_init(struct app_context *app_context, struct event_loop *loop)
+{
+  struct suspend_monitor *monitor = arena_alloc(&app_context->arena, 1, sizeof(*monitor));
+  if (!monitor) return -1;
+  monitor->app_context = app_context;
+  monitor->loop = loop;
+  monitor->inhibitor = -1;
+  app_context->suspend = monitor;
+
+  int ret = sd_bus_open_system(&monitor->bus);
+  if (ret < 0) {
+    (void)fprintf(stderr, "No system bus, suspend handling disabled: %s\n", strerror(-ret));
+    return 0;
+  }
+
+  ret = sd_bus_match_signal(monitor->bus, &monitor->match, LOGIND_SERVICE, LOGIND_PATH,
+                            LOGIND_MANAGER, "PrepareForSleep", handle_prepare_for_sleep, monitor);
+  if (ret < 0) {
+    (void)fprintf(stderr, "Failed to watch PrepareForSleep, suspend handling disabled: %s\n",
+                  strerror(-ret));
+    return 0;
+  }
+
+  monitor->fildes = sd_bus_get_fd(monitor->bus);
+  if (monitor->fildes < 0) {
+    (void)fprintf(stderr, "Failed to get bus fd: %s\n", strerror(-monitor->fildes));
+    return -1;
+  }
+
+  take_inhibitor(monitor);
+  process_bus(monitor);
+
+  return loop_add(loop, monitor->fildes, POLLIN, handle_bus, monitor);
+}
+
+void suspend_destroy(struct app_context *app_context)
+{
+  struct suspend_monitor *monitor = app_context->suspend;
+  if (!monitor) return;
+
+  release_inhibitor(monitor);
+  sd_bus_slot_unref(monitor->inhibit_call);
+  sd_bus_slot_unref(monitor->match);
+  sd_bus_flush_close_unref(monitor->bus);
+  app_context->suspend = NULL;
+}
+
+#endif
+
+size_t suspend_arena_size(void)
+{
+  return arena_size(1, sizeof(struct suspend_monitor));
+}
@@ -0,0 +1,29 @@
+#ifndef SUSPEND_H
+#define SUSPEND_H
+
+#include <stddef.h>
+#ifndef CFANS_SYSFS
+#include <systemd/sd-bus.h>
+#endif
+
+struct app_context;
+struct event_loop;
+
+struct suspend_monitor {
+#ifndef CFANS_SYSFS
+  sd_bus *bus;
+  sd_bus_slot *match;
+  sd_bus_slot *inhibit_call;
+#endif
+  int fildes;
+  int inhibitor;
+
+  struct app_context *app_context;
+  struct event_loop *loop;
+};
+
+int suspend_init(struct app_context *app_context, struct event_loop *loop);
+void suspend_destroy(struct app_context *app_context);
+size_t suspend_arena_size(void);
+
+#endif
@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "template.h"
+#include "device.h"
+
+#define INSTANCE_PLACEHOLDER "{n}"
+
+struct template {
+  const struct source_config *source;
+
+  // Matching devices, sorted so instance numbers follow the bus order
+  char **device_id;
+  int count;
+};
+
+static bool is_template(const struct source_config *source)
+{
+  return source->driver || source->pci_id ||
+         (source->device_id && strpbrk(source->device_id, "*?[") != NULL);
+}
+
+static int compare_device_ids(const void *a, const void *b)
+{
+  return strverscmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int copy_string(char **copy, const char *string)
+{
+  if (string == NULL) return 0;
+
+  *copy = strdup(string);
+  if (*copy == NULL) {
+    perror("strdup");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Replaces "{n}" with the instance number, or appends it to generated
+// names that have no placeholder so that instances never share a name
+static int instance_string(char **result, const char *string, int instance, bool append)
+{
+  if (string == NULL) return 0;
+
+  const char *placeholder = strstr(string, INSTANCE_PLACEHOLDER);
+  int ret;
+  if (placeholder) {
+    ret = asprintf(result, "%.*s%d%s", (int)(placeholder - string), string, instance,
+                   placeholder + strlen(INSTANCE_PLACEHOLDER));
+  }
+  else if (append) {
+    ret = asprintf(result, "%s %d", string, instance);
+  }
+  else {
+    return copy_string(result, string);
+  }
+
+  if (ret < 0) {
+    *result = NULL;
+    perror("asprintf");
+    return -1;
+  }
+
+  return 0;
+}
+
+static struct template *find_template(struct template *templates, int num_templates,
+                                      const char *name, const char *user)
+{
+  for (int i = 0; i < num_templates; i++) {
+    if (strcmp(templates[i].source->name, name) == 0) return &templates[i];
+  }
+
+  (void)fprintf(stderr, "Config error: template \"%s\" not found for \"%s\"\n", name, user);
+  return NULL;
+}
+
+static bool template_has_sensor(const struct template *template, const char *name)
+{
+  for (int i = 0; i < template->source->num_sensors; i++) {
+    if (strcmp(template->source->sensor[i].name, name) == 0) return true;
+  }
+
+  return false;
+}
+
+static bool template_has_curve(const struct config *config, const char *template, const char *name)
+{
+  for (int i = 0; i < config->num_curves; i++) {
+    const struct curve_config *curve = &config->curve[i];
+    if (curve->template && strcmp(curve->template, template) == 0 && strcmp(curve->name, name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void free_sources(void *array, int count)
+{
+  free_config(&(struct config) {.source = array, .num_sources = count});
+}
+
+static void free_curves(void *array, int count)
+{
+  free_config(&(struct config) {.curve = array, .num_curves = count});
+}
+
+static void free_fans(void *array, int count)
+{
+  free_config(&(struct config) {.fan = array, .num_fans = count});
+}
+
+// Puts each template entry's instances, built in the same order, in its
+// place. The other entries are moved, and what is left of the old array
+// is the template entries, which are freed along with it.
+static int splice(void **array, int *count, size_t size, const int *num_instances,
+                  void *instance, int total, void (*free_entries)(void *array, int count))
+{
+  int spliced_count = total;
+  for (int i = 0; i < *count; i++) {
+    spliced_count += num_instances[i] < 0;
+  }
+
+  char *spliced = NULL;
+  if (spliced_count > 0) {
+    spliced = calloc(spliced_count, size);
+    if (!spliced) {
+      perror("calloc");
+      free_entries(instance, total);
+      return -1;
+    }
+  }
+
+  char *old = *array;
+  const char *next_instance = instance;
+  int n = 0;
+  for (int i = 0; i < *count; i++) {
+    char *entry = old + i * size;
+
+    if (num_instances[i] < 0) {
+      memcpy(spliced + n * size, entry, size);
+      memset(entry, 0, size);
+      n++;
+    }
+    else if (num_instances[i] > 0) {
+      memcpy(spliced + n * size, next_instance, num_instances[i] * size);
+      next_instance += num_instances[i] * size;
+      n += num_instances[i];
+    }
+  }
+
+  free_entries(old, *count);
+  free(instance);
+
+  *array = spliced;
+  *count = spliced_count;
+  return 0;
+}
+
+static int instance_source(struct source_config *instance, const struct source_config *source,
+                           const char *device_id, int n)
+{
+  instance->scale = source->scale;
+
+  if (instance_string(&instance->name, source->name, n, true) < 0 ||
+      copy_string(&instance->type, source->type) < 0 ||
+      copy_string(&instance->device_id, device_id) < 0)
+  {
+    return -1;
+  }
+
+  instance->sensor = calloc(source->num_sensors, sizeof(*instance->sensor));
+  if (source->num_sensors && !instance->sensor) {
+    perror("calloc");
+    return -1;
+  }
+  instance->num_sensors = source->num_sensors;
+
+  for (int i = 0; i < source->num_sensors; i++) {
+    const struct sensor_config *sensor = &source->sensor[i];
+
+    instance->sensor[i].offset = sensor->offset;
+    instance->sensor[i].filter = sensor->filter;
+
+    // The label still has to match the device's own name for the input
+    if (instance_string(&instance->sensor[i].name, sensor->name, n, true) < 0 ||
+        copy_string(&instance->sensor[i].label, sensor_label(sensor)) < 0)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int instance_curve(struct curve_config *instance, const struct curve_config *curve,
+                          const struct template *template, int n)
+{
+  *instance = (struct curve_config) {
+    .hysteresis = curve->hysteresis,
+    .response_time = curve->response_time,
+    .failsafe_ticks = curve->failsafe_ticks,
+    .has_failsafe_ticks = curve->has_failsafe_ticks,
+    .failsafe_percent = curve->failsafe_percent,
+    .overshoot = curve->overshoot,
+  };
+
+  if (instance_string(&instance->name, curve->name, n, true) < 0 ||
+      copy_string(&instance->autotune, curve->autotune) < 0 ||
+      instance_string(&instance->sensor, curve->sensor, n, template_has_sensor(template, curve->sensor)) < 0)
+  {
+    return -1;
+  }
+
+  instance->graph_point = calloc(curve->num_points, sizeof(*instance->graph_point));
+  if (curve->num_points && !instance->graph_point) {
+    perror("calloc");
+    return -1;
+  }
+  memcpy(instance->graph_point, curve->graph_point, curve->num_points * sizeof(*curve->graph_point));
+  instance->num_points = curve->num_points;
+
+  return 0;
+}
+
+static int instance_fan(struct fan_config *instance, const struct fan_config *fan,
+                        const struct config *config, const char *device_id, int n)
+{
+  *instance = (struct fan_config) {
+    .min_pwm = fan->min_pwm,
+    .max_pwm = fan->max_pwm,
+    .zero_rpm = fan->zero_rpm,
+    .pwm_deadband = fan->pwm_deadband,
+  };
+
+  bool own_curve = template_has_curve(config, fan->template, fan->curve_name);
+
+  // Fans usually sit on the matched device itself, as on graphics cards
+  if (fan->device_id) {
+    if (instance_string(&instance->device_id, fan->device_id, n, false) < 0) return -1;
+  }
+  else if (copy_string(&instance->device_id, device_id) < 0) {
+    return -1;
+  }
+
+  if (instance_string(&instance->name, fan->name, n, true) < 0 ||
+      copy_string(&instance->pwm_file, fan->pwm_file) < 0 ||
+      instance_string(&instance->curve_name, fan->curve_name, n, own_curve) < 0)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+// Fans are expanded first as they look at the template curves, and curves
+// before sources as they look at the template sensors
+static int expand_fans(struct config *config, struct template *templates, int num_templates)
+{
+  int num_instances[config->num_fans + 1];
+  int total = 0;
+  int num_templated = 0;
+
+  for (int i = 0; i < config->num_fans; i++) {
+    num_instances[i] = -1;
+    if (!config->fan[i].template) continue;
+
+    const struct template *template = find_template(templates, num_templates,
+                                                    config->fan[i].template, config->fan[i].name);
+    if (!template) return -1;
+    num_instances[i] = template->count;
+    total += template->count;
+    num_templated++;
+  }
+  if (num_templated == 0) return 0;
+
+  struct fan_config *instance = calloc(total ? total : 1, sizeof(*instance));
+  if (!instance) {
+    perror("calloc");
+    return -1;
+  }
+
+  int k = 0;
+  for (int i = 0; i < config->num_fans; i++) {
+    if (num_instances[i] < 0) continue;
+
+    const struct template *template = find_template(templates, num_templates,
+                                                    config->fan[i].template, config->fan[i].name);
+    for (int n = 0; n < template->count; n++) {
+      if (instance_fan(&instance[k++], &config->fan[i], config, template->device_id[n], n) < 0) {
+        free_fans(instance, total);
+        return -1;
+      }
+    }
+  }
+
+  return splice((void **)&config->fan, &config->num_fans, sizeof(*config->fan), num_instances,
+                instance, total, free_fans);
+}
+
+static int expand_curves(struct config *config, struct template *templates, int num_templates)
+{
+  int num_instances[config->num_curves + 1];
+  int total = 0;
+  int num_templated = 0;
+
+  for (int i = 0; i < config->num_curves; i++) {
+    num_instances[i] = -1;
+    if (!config->curve[i].template) continue;
+
+    const struct template *template = find_template(templates, num_templates,
+                                                    config->curve[i].template, config->curve[i].name);
+    if (!template) return -1;
+    num_instances[i] = template->count;
+    total += template->count;
+    num_templated++;
+  }
+  if (num_templated == 0) return 0;
+
+  struct curve_config *instance = calloc(total ? total : 1, sizeof(*instance));
+  if (!instance) {
+    perror("calloc");
+    return -1;
+  }
+
+  int k = 0;
+  for (int i = 0; i < config->num_curves; i++) {
+    if (num_instances[i] < 0) continue;
+
+    const struct template *template = find_template(templates, num_templates,
+                                                    config->curve[i].template, config->curve[i].name);
+    for (int n = 0; n < template->count; n++) {
+      if (instance_curve(&instance[k++], &config->curve[i], template, n) < 0) {
+        free_curves(instance, total);
+        return -1;
+      }
+    }
+  }
+
+  return splice((void **)&config->curve, &config->num_curves, sizeof(*config->curve), num_instances,
+                instance, total, free_curves);
+}
+
+static int expand_sources(struct config *config, struct template *templates)
+{
+  int num_instances[config->num_sources + 1];
+  int total = 0;
+
+  for (int i = 0, t = 0; i < config->num_sources; i++) {
+    num_instances[i] = is_template(&config->source[i]) ? templates[t++].count : -1;
+    if (num_instances[i] > 0) total += num_instances[i];
+  }
+
+  struct source_config *instance = calloc(total ? total : 1, sizeof(*instance));
+  if (!instance) {
+    perror("calloc");
+    return -1;
+  }
+
+  int k = 0;
+  for (int i = 0, t = 0; i < config->num_sources; i++) {
+    if (num_instances[i] < 0) continue;
+
+    const struct template *template = &templates[t++];
+    for (int n = 0; n < template->count; n++) {
+      if (instance_source(&instance[k++], &config->source[i], template->device_id[n], n) < 0) {
+        free_sources(instance, total);
+        return -1;
+      }
+    }
+  }
+
+  return splice((void **)&config->source, &config->num_sources, sizeof(*config->source),
+                num_instances, instance, total, free_sources);
+}
+
+static int find_devices(struct template *template)
+{
+  const struct source_config *source = template->source;
+
+  // A plain device id on a driver or pci id template narrows it down
+  template->count = device_enumerate(source->driver, source->pci_id, source->device_id,
+                                     &template->device_id);
+  if (template->count < 0) {
+    (void)fprintf(stderr, "Failed to find devices for template \"%s\"\n", source->name);
+    return -1;
+  }
+
+  if (template->count == 0) {
+    (void)fprintf(stderr, "Warning: template \"%s\" matched no devices\n", source->name);
+    return 0;
+  }
+  qsort(template->device_id, template->count, sizeof(*template->device_id), compare_device_ids);
+
+  return 0;
+}
+
+static void free_templates(struct template *templates, int num_templates)
+{
+  for (int i = 0; i < num_templates; i++) {
+    for (int n = 0; n < templates[i].count; n++) {
+      free(templates[i].device_id[n]);
+    }
+    free(templates[i].device_id);
+  }
+  free(templates);
+}
+
+int expand_templates(struct config *config)
+{
+  int num_templates = 0;
+  for (int i = 0; i < config->num_sources; i++) {
+    num_templates += is_template(&config->source[i]);
+  }
+
+  if (num_templates == 0) {
+    for (int i = 0; i < config->num_curves; i++) {
+      if (config->curve[i].template) {
+        (void)fprintf(stderr, "Config error: template \"%s\" not found for \"%s\"\n",
+                      config->curve[i].template, config->curve[i].name);
+        return -1;
+      }
+    }
+    for (int i = 0; i < config->num_fans; i++) {
+      if (config->fan[i].template) {
+        (void)fprintf(stderr, "Config error: template \"%s\" not found for \"%s\"\n",
+                      config->fan[i].template, config->fan[i].name);
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  struct template *templates = calloc(num_templates, sizeof(*templates));
+  if (!templates) {
+    perror("calloc");
+    return -1;
+  }
+
+  // Each template is enumerated once, however many curves and fans use it
+  for (int i = 0, t = 0; i < config->num_sources; i++) {
+    if (!is_template(&config->source[i])) continue;
+
+    templates[t].source = &config->source[i];
+    if (find_devices(&templates[t++]) < 0) {
+      free_templates(templates, num_templates);
+      return -1;
+    }
+  }
+
+  int ret = 0;
+  if (expand_fans(config, templates, num_templates) < 0 ||
+      expand_curves(config, templates, num_templates) < 0 ||
+      expand_sources(config, templates) < 0)
+  {
+    ret = -1;
+  }
+
+  free_templates(templates, num_templates);
+  return ret;
+}
@@ -0,0 +1,11 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include "config.h"
+
+// Sources that match devices by driver, pci id or a device id glob are
+// templates. Each matching device gets its own instance of the source and
+// of every curve and fan naming it as "template", with generated names.
+int expand_templates(struct config *config);
+
+#endif
@@ -0,0 +1,202 @@
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "writer.h"
+#include "arena.h"
+#include "config.h"
+#include "control.h"
+
+#define NS_PER_SEC 1000000000L
+
+static bool uses_writer(const struct config *config)
+{
+  if (config->pwm_writes_per_second > 0) return true;
+
+  for (int i = 0; i < config->num_fans; i++) {
+    if (config->fan[i].pwm_deadband > 0) return true;
+  }
+
+  return false;
+}
+
+static int find_chip(const struct writer *writer, const char *device_id)
+{
+  for (int c = 0; c < writer->num_chips; c++) {
+    if (strcmp(writer->chip[c].device_id, device_id) == 0) return c;
+  }
+
+  return -1;
+}
+
+int writer_init(const struct config *config, struct app_context *app_context)
+{
+  if (!uses_writer(config)) return 0;
+
+  struct arena *arena = &app_context->arena;
+  const struct fan_state *fan = &app_context->fan;
+  int num_fans = config->num_fans;
+
+  struct writer *writer = arena_alloc(arena, 1, sizeof(*writer));
+  if (!writer) return -1;
+
+  writer->chip = arena_alloc(arena, num_fans, sizeof(*writer->chip));
+  writer->fan_chip = arena_alloc(arena, num_fans, sizeof(*writer->fan_chip));
+  writer->deadband = arena_alloc(arena, num_fans, sizeof(*writer->deadband));
+  writer->max_pwm = arena_alloc(arena, num_fans, sizeof(*writer->max_pwm));
+  writer->written = arena_alloc(arena, num_fans, sizeof(*writer->written));
+  writer->candidate = arena_alloc(arena, num_fans, sizeof(*writer->candidate));
+  if (num_fans && (!writer->chip || !writer->fan_chip || !writer->deadband || !writer->max_pwm ||
+                   !writer->written || !writer->candidate))
+  {
+    return -1;
+  }
+
+  writer->budget = config->pwm_writes_per_second;
+
+  for (int i = 0; i < num_fans; i++) {
+    const struct fan_config *fan_config = &config->fan[i];
+
+    int c = find_chip(writer, fan_config->device_id);
+    if (c < 0) {
+      c = writer->num_chips++;
+      writer->chip[c].device_id = arena_strdup(arena, fan_config->device_id);
+      if (!writer->chip[c].device_id) return -1;
+
+      // Up to a second's worth of writes can be spent at once
+      writer->chip[c].tokens = fmaxf(writer->budget, 1.0F);
+    }
+
+    writer->fan_chip[i] = c;
+    writer->deadband[i] = (int)fan_config->pwm_deadband;
+    writer->max_pwm[i] = scale_pwm(100.0F, fan->min_pwm[i], fan->pwm_range[i], fan->zero_rpm[i]);
+    writer->written[i] = -1;
+  }
+
+  app_context->writer = writer;
+
+  return 0;
+}
+
+static void refill(struct writer *writer, const struct timespec *clock)
+{
+  if (writer->budget <= 0) return;
+
+  if (writer->refilled.tv_sec != 0) {
+    float elapsed = (float)(clock->tv_sec - writer->refilled.tv_sec) +
+                    (float)(clock->tv_nsec - writer->refilled.tv_nsec) / (float)NS_PER_SEC;
+    float capacity = fmaxf(writer->budget, 1.0F);
+
+    for (int c = 0; c < writer->num_chips; c++) {
+      writer->chip[c].tokens = fminf(writer->chip[c].tokens + (elapsed * writer->budget), capacity);
+    }
+  }
+  writer->refilled = *clock;
+}
+
+static int compare_candidates(const void *a, const void *b)
+{
+  const struct write_candidate *first = a;
+  const struct write_candidate *second = b;
+
+  return (second->delta > first->delta) - (second->delta < first->delta);
+}
+
+// Runs between the evaluation of a tick and its writes, rewriting
+// fan->changed to the fans that are to be written now. Returns their number.
+int writer_schedule(struct app_context *app_context, int num_changed)
+{
+  struct writer *writer = app_context->writer;
+  if (!writer) return num_changed;
+
+  struct fan_state *fan = &app_context->fan;
+  int num_candidates = 0;
+
+  refill(writer, &app_context->clock);
+
+  for (int k = 0; k < num_changed; k++) {
+    int i = fan->changed[k];
+    int value = fan->pwm_value[i];
+    int last = writer->written[i];
+
+    // Stopping a fan or running it flat out is never held back by the
+    // deadband, and full speed not by the budget either
+    bool full_speed = value == writer->max_pwm[i];
+    int delta = last < 0 ? INT_MAX - 1 : abs(value - last);
+
+    if (value != 0 && !full_speed && delta < writer->deadband[i]) {
+      fan->pwm_value[i] = last;
+      writer->chip[writer->fan_chip[i]].deadband_skips++;
+      continue;
+    }
+
+    writer->candidate[num_candidates++] = (struct write_candidate) {
+      .fan = i,
+      .delta = full_speed ? INT_MAX : delta,
+    };
+  }
+
+  if (writer->budget > 0 && num_candidates > 1) {
+    qsort(writer->candidate, num_candidates, sizeof(*writer->candidate), compare_candidates);
+  }
+
+  int num_writes = 0;
+  for (int k = 0; k < num_candidates; k++) {
+    int i = writer->candidate[k].fan;
+    struct writer_chip *chip = &writer->chip[writer->fan_chip[i]];
+
+    if (writer->budget > 0) {
+      if (chip->tokens >= 1.0F) {
+        chip->tokens -= 1.0F;
+      }
+      else if (writer->candidate[k].delta != INT_MAX) {
+        fan->pwm_value[i] = writer->written[i];
+        chip->budget_deferrals++;
+        continue;
+      }
+    }
+
+    writer->written[i] = fan->pwm_value[i];
+    chip->writes++;
+    fan->changed[num_writes++] = i;
+  }
+
+  return num_writes;
+}
+
+void writer_print(const struct app_context *app_context, FILE *stream)
+{
+  const struct writer *writer = app_context->writer;
+  if (!writer) return;
+
+  (void)fprintf(stream, "PWM writes per chip:\n");
+  for (int c = 0; c < writer->num_chips; c++) {
+    const struct writer_chip *chip = &writer->chip[c];
+    unsigned long saved = chip->deadband_skips + chip->budget_deferrals;
+    unsigned long commanded = chip->writes + saved;
+
+    (void)fprintf(stream, "  %-24s %8lu written, %8lu saved (%lu within deadband, %lu over budget), %5.1f%%\n",
+                  chip->device_id, chip->writes, saved, chip->deadband_skips, chip->budget_deferrals,
+                  commanded ? (double)saved * 100.0 / (double)commanded : 0.0);
+  }
+}
+
+size_t writer_arena_size(const struct config *config)
+{
+  if (!uses_writer(config)) return 0;
+
+  int num_fans = config->num_fans;
+  size_t size = arena_size(1, sizeof(struct writer)) +
+                arena_size(num_fans, sizeof(struct writer_chip)) +
+                arena_size(num_fans, sizeof(int)) * 4 +
+                arena_size(num_fans, sizeof(struct write_candidate));
+
+  for (int i = 0; i < num_fans; i++) {
+    size += arena_string_size(config->fan[i].device_id);
+  }
+
+  return size;
+}
@@ -0,0 +1,52 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+struct app_context;
+struct config;
+
+// Fans whose pwm files live on the same hwmon chip, told apart by their
+// device id. Each write is a bus transaction on Super I/O and EC chips,
+// which the chip's sensors have to wait for.
+struct writer_chip {
+  const char *device_id;
+  float tokens;
+
+  unsigned long writes;
+  unsigned long deadband_skips;
+  unsigned long budget_deferrals;
+};
+
+struct write_candidate {
+  int fan;
+  int delta;
+};
+
+// Filters the fans whose pwm value changed in a tick before they are
+// written. Changes smaller than a fan's deadband are dropped, and each chip
+// may write "pwm writes per second" times, largest changes first. A fan
+// that is not written keeps its old pwm value, so it is weighed again in
+// the next tick.
+struct writer {
+  struct writer_chip *chip;
+  int num_chips;
+
+  int *fan_chip;
+  int *deadband;
+  int *max_pwm;
+  int *written;
+  struct write_candidate *candidate;
+
+  float budget;
+  struct timespec refilled;
+};
+
+int writer_init(const struct config *config, struct app_context *app_context);
+int writer_schedule(struct app_context *app_context, int num_changed);
+void writer_print(const struct app_context *app_context, FILE *stream);
+size_t writer_arena_size(const struct config *config);
+
+#endif